@@ -0,0 +1,139 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <algorithm>
+#include <math.h>
+
+#include "astroberry_autofocus.h"
+
+#define AUTOFOCUS_MAX_SHIFTS 3 // sweeps moved towards focus before giving up
+#define AUTOFOCUS_MIN_SAMPLES 3
+
+AstroberryAutofocus::AstroberryAutofocus()
+{
+}
+
+void AstroberryAutofocus::start(int center, int step, int points, int minimum, int maximum)
+{
+	this->step = std::max(step, 1);
+	this->points = std::max(points, AUTOFOCUS_MIN_SAMPLES);
+	this->minimum = minimum;
+	this->maximum = maximum;
+	shifts = 0;
+	running = true;
+	sweep(center);
+}
+
+void AstroberryAutofocus::sweep(int center)
+{
+	// always sweep outward, so every sample is approached from the same side
+	first = center - (points - 1) / 2 * step;
+	first = std::min(std::max(first, minimum), maximum - (points - 1) * step);
+	first = std::max(first, minimum);
+	point = 0;
+	metrics.clear();
+}
+
+int AstroberryAutofocus::addSample(double metric)
+{
+	if (!running)
+		return AUTOFOCUS_FAILED;
+
+	metrics.push_back(metric);
+
+	// next position of the sweep
+	if (++point < points && getTarget() <= maximum)
+		return AUTOFOCUS_MEASURE;
+
+	// best sample at an end, focus is further out
+	int lowest = -1;
+	for (int i = 0; i < (int) metrics.size(); i++)
+		if (!isnan(metrics[i]) && (lowest < 0 || metrics[i] < metrics[lowest]))
+			lowest = i;
+
+	if (lowest < 0)
+	{
+		running = false;
+		return AUTOFOCUS_FAILED;
+	}
+
+	int position = first + lowest * step;
+	bool atEdge = (lowest == 0 && position > minimum) || (lowest == (int) metrics.size() - 1 && position + step <= maximum);
+	if (atEdge && shifts < AUTOFOCUS_MAX_SHIFTS)
+	{
+		shifts++;
+		sweep(position);
+		return AUTOFOCUS_MEASURE;
+	}
+
+	if (!fit())
+	{
+		// fall back to the best sample
+		best = position;
+		bestMetric = metrics[lowest];
+	}
+
+	running = false;
+	return AUTOFOCUS_DONE;
+}
+
+bool AstroberryAutofocus::fit()
+{
+	// metric² = a x² + b x + c, x in sweep steps from the first position
+	double s[5] = { 0 }, t[3] = { 0 };
+	int n = 0;
+
+	for (int i = 0; i < (int) metrics.size(); i++)
+	{
+		if (isnan(metrics[i]))
+			continue;
+		double x = i, y = metrics[i] * metrics[i], xx = 1;
+		for (int k = 0; k < 5; k++, xx *= x)
+		{
+			s[k] += xx;
+			if (k < 3)
+				t[k] += xx * y;
+		}
+		n++;
+	}
+
+	if (n < AUTOFOCUS_MIN_SAMPLES)
+		return false;
+
+	// normal equations solved by Cramer's rule
+	const double m[3][3] = { { s[4], s[3], s[2] }, { s[3], s[2], s[1] }, { s[2], s[1], s[0] } };
+	const double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if (fabs(det) < 1e-12)
+		return false;
+
+	const double a = (t[2] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (t[1] * m[2][2] - m[1][2] * t[0]) + m[0][2] * (t[1] * m[2][1] - m[1][1] * t[0])) / det;
+	const double b = (m[0][0] * (t[1] * m[2][2] - m[1][2] * t[0]) - t[2] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + m[0][2] * (m[1][0] * t[0] - t[1] * m[2][0])) / det;
+	const double c = (m[0][0] * (m[1][1] * t[0] - t[1] * m[2][1]) - m[0][1] * (m[1][0] * t[0] - t[1] * m[2][0]) + t[2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])) / det;
+
+	// no minimum, or a minimum outside of the samples
+	if (a <= 0)
+		return false;
+	double x = -b / (2 * a);
+	if (x < 0 || x > (int) metrics.size() - 1)
+		return false;
+
+	best = lround(first + x * step);
+	bestMetric = sqrt(std::max(c - b * b / (4 * a), 0.0));
+
+	return true;
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYAUTOFOCUS_H
+#define ASTROBERRYAUTOFOCUS_H
+
+#include <vector>
+
+/*
+ * Autofocus sweep
+ *
+ * Steps through a fixed number of equally spaced positions around a start
+ * position, taking one metric sample at each. Near focus the half flux
+ * radius follows a hyperbola, so its square is a parabola in position and a
+ * linear least squares fit gives the minimum. If the best sample lies at an
+ * end of the sweep, focus is outside of it and the sweep is shifted there.
+ */
+class AstroberryAutofocus
+{
+public:
+	enum { AUTOFOCUS_MEASURE, AUTOFOCUS_DONE, AUTOFOCUS_FAILED };
+
+	AstroberryAutofocus();
+	void start(int center, int step, int points, int minimum, int maximum);
+	void abort() { running = false; }
+	bool isRunning() const { return running; }
+	int getTarget() const { return first + point * step; }
+	int getPoint() const { return point; }
+	int getPoints() const { return points; }
+	int addSample(double metric); // NAN if nothing could be measured
+	int getBest() const { return best; }
+	double getBestMetric() const { return bestMetric; }
+private:
+	bool fit();
+	void sweep(int center);
+
+	bool running { false };
+	int step { 0 };
+	int points { 0 };
+	int minimum { 0 };
+	int maximum { 0 };
+	int first { 0 };
+	int point { 0 };
+	int shifts { 0 };
+	std::vector<double> metrics;
+	int best { 0 };
+	double bestMetric { 0 };
+};
+
+#endif
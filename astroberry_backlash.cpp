@@ -0,0 +1,95 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <algorithm>
+#include <math.h>
+
+#include "astroberry_backlash.h"
+
+AstroberryBacklash::AstroberryBacklash()
+{
+}
+
+bool AstroberryBacklash::start(int center, int length, int count, int minimum, int maximum)
+{
+	// preload, then the legs between origin and origin + stroke
+	if (length < 1 || count < 1 || maximum - minimum < 2 * length)
+		return false;
+
+	origin = std::min(std::max(center, minimum + length), maximum - length);
+	stroke = length;
+	cycles = count;
+	point = 0;
+	samples.clear();
+	backlash = spread = 0;
+	running = true;
+
+	return true;
+}
+
+int AstroberryBacklash::getTarget() const
+{
+	if (point == 0)
+		return origin - stroke;
+
+	return point % 2 ? origin : origin + stroke;
+}
+
+int AstroberryBacklash::addSample(double value)
+{
+	if (!running)
+		return BACKLASH_FAILED;
+
+	samples.push_back(value);
+	if (point > 0 && isnan(value))
+	{
+		running = false;
+		return BACKLASH_FAILED;
+	}
+
+	if (++point < getPoints())
+		return BACKLASH_MEASURE;
+
+	running = false;
+
+	// measurement units per step, from the leg that kept going outward
+	// the sign follows the side of focus, a leg that barely changed the measurement cannot scale the others
+	double change = samples[2] - samples[1];
+	double largest = fabs(change);
+	for (int i = 3; i < getPoints(); i++)
+		largest = std::max(largest, fabs(samples[i] - samples[i - 1]));
+	if (largest == 0 || fabs(change) < BACKLASH_MIN_SCALE * largest)
+		return BACKLASH_FAILED;
+	double scale = change / stroke;
+
+	// commanded stroke less the distance measured, on every reversal
+	std::vector<double> lost;
+	for (int i = 3; i < getPoints(); i++)
+	{
+		int direction = i % 2 ? -1 : 1;
+		lost.push_back(stroke - direction * (samples[i] - samples[i - 1]) / scale);
+	}
+
+	std::sort(lost.begin(), lost.end());
+	size_t middle = lost.size() / 2;
+	double median = lost.size() % 2 ? lost[middle] : (lost[middle - 1] + lost[middle]) / 2;
+	backlash = std::max(0L, lround(median));
+	spread = lround(lost.back() - lost.front());
+
+	return BACKLASH_DONE;
+}
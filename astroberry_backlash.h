@@ -0,0 +1,67 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYBACKLASH_H
+#define ASTROBERRYBACKLASH_H
+
+#include <vector>
+
+#define BACKLASH_MIN_SCALE 0.2 // least change over the scaling leg, relative to the largest leg
+
+/*
+ * Backlash calibration
+ *
+ * Moves back and forth between two positions a stroke apart, with backlash
+ * compensation off, and measures how far the drawtube really went on every
+ * leg - from an encoder on the drawtube, or from the half flux radius of a
+ * defocused star, which grows linearly with the distance from focus.
+ *
+ * The first move only takes up the gears outward. The leg after it goes the
+ * same way, so no motion is lost on it and it scales the measurement to
+ * steps; for frames this is the slope of the HFR, so the test has to stay on
+ * one side of focus, either one. Every further leg reverses, the motion lost on it is the
+ * backlash, and the median over all reversals is the result.
+ */
+class AstroberryBacklash
+{
+public:
+	enum { BACKLASH_MEASURE, BACKLASH_DONE, BACKLASH_FAILED };
+
+	AstroberryBacklash();
+	bool start(int origin, int stroke, int cycles, int minimum, int maximum); // false if the range is too short
+	void abort() { running = false; }
+	bool isRunning() const { return running; }
+	int getTarget() const;
+	int getPoint() const { return point; }
+	int getPoints() const { return 3 + 2 * cycles; }
+	bool isPreload() const { return point == 0; } // nothing to measure there
+	int addSample(double value); // encoder position in steps or HFR, NAN if nothing could be measured
+	int getBacklash() const { return backlash; }
+	int getSpread() const { return spread; }
+private:
+	bool running { false };
+	int origin { 0 };
+	int stroke { 0 };
+	int cycles { 0 };
+	int point { 0 };
+	std::vector<double> samples;
+	int backlash { 0 };
+	int spread { 0 };
+};
+
+#endif
@@ -0,0 +1,462 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include <indidevapi.h>
+
+#include "config.h"
+#include "astroberry_gpio.h"
+#include "astroberry_journal.h"
+#include "astroberry_planner.h"
+#include "astroberry_simulator.h"
+#include "astroberry_stepper.h"
+#include "astroberry_thermometer.h"
+
+/*
+ * Motion path benchmark
+ *
+ * Runs the parts the focuser is built from the way the driver runs them, on
+ * the simulated focuser: the stepper thread drives a virtual motor through
+ * the mock GPIO chip, positions are journaled and temperatures are read from
+ * a simulated DS18B20 tree. Results are printed one JSON object per line, so
+ * runs of different releases can be compared by a script. A second channel
+ * on its own simulated board shows how simultaneous moves share the
+ * stepping engine.
+ *
+ * The soak mode keeps making random back-and-forth moves, retargeted on the
+ * way or not, with backlash compensation or an overshooting approach, until
+ * the time is up. Moves are decided by the stepper the way the focuser asks
+ * for them, and the soak fails as soon as the drawtube is not where the
+ * stepper counted it.
+ *
+ * Usage: astroberry_bench [soak seconds]
+ */
+
+#define BENCH_BOARD AstroberryStepper::BOARD_DRV8825
+#define BENCH_RESOLUTION 8 // 1/8 microsteps
+#define BENCH_FINE_STEP (32 / BENCH_RESOLUTION) // MAX_RESOLUTION units per fine step
+#define BENCH_BACKLASH 10 // fine steps
+#define BENCH_TRAVEL 200000 // MAX_RESOLUTION units
+
+static FILE *out; // stdout itself takes the INDI messages
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpuTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *name, double value, const char *unit)
+{
+	fprintf(out, "{\"version\":\"%d.%d\",\"name\":\"%s\",\"value\":%0.3f,\"unit\":\"%s\"}\n", VERSION_MAJOR, VERSION_MINOR, name, value, unit);
+	fflush(out);
+}
+
+// p50, p99 & max of samples in seconds, reported in µs
+static void percentiles(const char *name, std::vector<double> &samples)
+{
+	if (samples.empty())
+		return;
+
+	std::sort(samples.begin(), samples.end());
+	std::string key(name);
+	result((key + "_p50").c_str(), samples[samples.size() / 2] * 1e6, "us");
+	result((key + "_p99").c_str(), samples[(samples.size() * 99) / 100] * 1e6, "us");
+	result((key + "_max").c_str(), samples.back() * 1e6, "us");
+}
+
+static bool waitMove(AstroberryStepper &stepper)
+{
+	struct pollfd pfd = { stepper.getNotifyFd(), POLLIN, 0 };
+
+	while (stepper.isMoving())
+	{
+		if (poll(&pfd, 1, 10000) <= 0)
+			return false;
+		stepper.clearNotify();
+	}
+
+	return true;
+}
+
+// the focuser's default wiring on a simulated board, stepper at the middle of travel
+static bool startStepper(AstroberryStepper &stepper, AstroberrySimulator &simulator)
+{
+	unsigned int pins[AstroberrySimulator::PIN_COUNT] = { 23, 25, 22, 5, 6, 13 };
+	simulator.configure(BENCH_BOARD, pins);
+	AstroberryMockChip &chip = simulator.getChip();
+	if (!chip.open())
+		return false;
+
+	const int driveLevels[3] = { 1, 0, 0 };
+	AstroberryGpioBulk *drive = chip.requestOutputs(pins, 3, "astroberry_bench", driveLevels);
+	uint8_t mode[3];
+	AstroberryStepper::getModePins(BENCH_BOARD, BENCH_RESOLUTION, mode);
+	AstroberryGpioLine *modeLines[3];
+	for (int i = 0; i < 3; i++)
+	{
+		modeLines[i] = chip.getLine(pins[AstroberrySimulator::PIN_M0 + i]);
+		modeLines[i]->requestOutput("astroberry_bench", mode[i]);
+	}
+
+	AstroberryResolution resolution;
+	resolution.fineStep = BENCH_FINE_STEP;
+	AstroberryStepper::getModePins(BENCH_BOARD, BENCH_RESOLUTION, resolution.fineMode);
+	if (!drive || !stepper.start(drive->getLine(0), drive->getLine(1), drive->getLine(2), modeLines, mode))
+		return false;
+	stepper.setResolution(resolution);
+	stepper.setPosition(BENCH_TRAVEL / 2);
+	simulator.setPosition(BENCH_TRAVEL / 2);
+
+	return true;
+}
+
+static void benchSteps(AstroberryStepper &stepper, AstroberrySimulator &simulator)
+{
+	AstroberryPlanner planner;
+	planner.setProfile(1000, 20000, 100000);
+	const int steps = 20000;
+
+	// the virtual motor is not part of the cost
+	simulator.getChip().setListener(nullptr);
+
+	double cpu = cpuTime(), start = now();
+	stepper.move(stepper.getPosition() + steps * BENCH_FINE_STEP, 0, false, planner);
+	waitMove(stepper);
+	cpu = cpuTime() - cpu;
+	start = now() - start;
+
+	simulator.getChip().setListener(&simulator);
+	simulator.setPosition(stepper.getPosition());
+
+	const AstroberryStepTiming &timing = stepper.getTiming();
+	result("step_cpu", cpu / steps * 1e9, "ns");
+	result("step_rate", steps / start, "steps/s");
+	result("step_latency", timing.getLatency(), "us");
+	result("step_lateness_p50", timing.getPercentile(50), "us");
+	result("step_lateness_p99", timing.getPercentile(99), "us");
+	result("step_lateness_max", timing.getMax(), "us");
+	result("step_missed", timing.getMissed(), "edges");
+}
+
+static void benchChannels(AstroberryStepper &stepper, AstroberrySimulator &simulator)
+{
+	AstroberrySimulator secondSimulator;
+	AstroberryStepper second;
+	if (!startStepper(second, secondSimulator))
+	{
+		fprintf(stderr, "Cannot start second stepper\n");
+		return;
+	}
+
+	// slower than the single channel run, so timing shows interleaving rather than a saturated CPU
+	AstroberryPlanner planner;
+	planner.setProfile(1000, 5000, 100000);
+	const int steps = 5000;
+
+	// both channels move at once, out of phase by the opposite direction
+	double cpu = cpuTime(), start = now();
+	stepper.move(stepper.getPosition() - steps * BENCH_FINE_STEP, 0, false, planner);
+	second.move(second.getPosition() + steps * BENCH_FINE_STEP, 0, false, planner);
+	waitMove(stepper);
+	waitMove(second);
+	cpu = cpuTime() - cpu;
+	start = now() - start;
+
+	const AstroberryStepTiming &first = stepper.getTiming();
+	const AstroberryStepTiming &other = second.getTiming();
+	result("channels_step_cpu", cpu / (2 * steps) * 1e9, "ns");
+	result("channels_seconds", start, "s");
+	result("channels_lateness_p99", std::max(first.getPercentile(99), other.getPercentile(99)), "us");
+	result("channels_lateness_max", std::max(first.getMax(), other.getMax()), "us");
+	result("channels_missed", first.getMissed() + other.getMissed(), "edges");
+
+	// drawtubes still follow their steppers
+	result("channels_drift", abs(simulator.getDrawtubePosition() - stepper.getPosition()) + abs(secondSimulator.getDrawtubePosition() - second.getPosition()), "units");
+
+	second.stop();
+	secondSimulator.getChip().close();
+}
+
+static void benchSetNumber()
+{
+	INumber positionN[1];
+	INumberVectorProperty positionNP;
+	IUFillNumber(&positionN[0], "FOCUS_ABSOLUTE_POSITION", "Steps", "%0.0f", 0, 100000, 1, 0);
+	IUFillNumberVector(&positionNP, positionN, 1, "Astroberry Focuser", "ABS_FOCUS_POSITION", "Absolute Position", "Main Control", IP_RW, 0, IPS_BUSY);
+
+	INumber statsN[8];
+	INumberVectorProperty statsNP;
+	for (int i = 0; i < 8; i++)
+	{
+		char name[MAXINDINAME];
+		snprintf(name, sizeof(name), "STAT_%d", i);
+		IUFillNumber(&statsN[i], name, name, "%0.3f", 0, 1e9, 0, 0);
+	}
+	IUFillNumberVector(&statsNP, statsN, 8, "Astroberry Focuser", "STATS", "Stats", "Diagnostics", IP_RO, 0, IPS_OK);
+
+	const int iterations = 100000;
+	double start = now();
+	for (int i = 0; i < iterations; i++)
+	{
+		positionN[0].value = i;
+		IDSetNumber(&positionNP, nullptr);
+	}
+	result("idsetnumber_1", (now() - start) / iterations * 1e9, "ns");
+
+	start = now();
+	for (int i = 0; i < iterations; i++)
+	{
+		statsN[i % 8].value = i;
+		IDSetNumber(&statsNP, nullptr);
+	}
+	result("idsetnumber_8", (now() - start) / iterations * 1e9, "ns");
+}
+
+static void benchJournal(const std::string &dir)
+{
+	static const char *policies[3] = { "none", "at_rest", "always" };
+	const std::string fileName = dir + "/journal";
+
+	for (int policy = AstroberryJournal::SYNC_NONE; policy <= AstroberryJournal::SYNC_ALWAYS; policy++)
+	{
+		AstroberryJournal journal;
+		if (!journal.open(fileName.c_str()))
+		{
+			fprintf(stderr, "Cannot open journal %s\n", fileName.c_str());
+			return;
+		}
+		journal.setSyncPolicy(policy);
+
+		// synced writes are slow on an SD card, fewer of them do
+		const int iterations = policy == AstroberryJournal::SYNC_NONE ? 100000 : 500;
+		std::vector<double> samples;
+		samples.reserve(iterations);
+		for (int i = 0; i < iterations; i++)
+		{
+			double start = now();
+			journal.append(i, BENCH_FINE_STEP, true);
+			samples.push_back(now() - start);
+		}
+
+		percentiles((std::string("save_position_") + policies[policy]).c_str(), samples);
+		journal.close();
+	}
+
+	unlink(fileName.c_str());
+}
+
+static void benchTemperature(AstroberrySimulator &simulator)
+{
+	AstroberryThermometer thermometer;
+	if (!simulator.startThermometer(10, 0))
+	{
+		fprintf(stderr, "Cannot create simulated temperature sensor\n");
+		return;
+	}
+	thermometer.setDevicesPath(simulator.getDevicesPath());
+
+	// every wake up reads the sensor once, the interval itself never expires
+	const int interval = 3600000;
+	struct pollfd pfd;
+	std::vector<double> samples;
+	if (thermometer.start(interval))
+	{
+		pfd.fd = thermometer.getNotifyFd();
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 5000);
+		thermometer.clearNotify();
+
+		for (int i = 0; i < 200; i++)
+		{
+			double start = now();
+			thermometer.setInterval(interval);
+			if (poll(&pfd, 1, 5000) <= 0)
+				break;
+			samples.push_back(now() - start);
+			thermometer.clearNotify();
+		}
+		thermometer.stop();
+	}
+	simulator.stopThermometer();
+
+	percentiles("temperature_read", samples);
+}
+
+// the focuser's MoveAbsFocuser: a running move is retargeted, otherwise backlash is taken up only on reversal
+static bool command(AstroberryStepper &stepper, int target, int backlash, const AstroberryPlanner &planner)
+{
+	if (stepper.isMoving() && stepper.retarget(target, backlash))
+		return true;
+
+	// an abort cannot be retargeted, the motor has to come to rest first
+	if (stepper.isMoving() && !waitMove(stepper))
+		return false;
+
+	return target == stepper.getPosition() || stepper.move(target, stepper.getBacklash(target, backlash), false, planner);
+}
+
+static bool soak(AstroberryStepper &stepper, AstroberrySimulator &simulator, double seconds)
+{
+	// short and steep moves, so a few hours make millions of them
+	AstroberryPlanner planner;
+	planner.setProfile(2000, 50000, 2000000);
+	simulator.setBacklash(BENCH_BACKLASH * BENCH_FINE_STEP);
+
+	unsigned int seed = 1;
+	unsigned long moves = 0, steps = 0, retargets = 0, overshoots = 0;
+	const double start = now();
+	bool drift = false;
+	int offset = 0;
+
+	while (!drift && now() - start < seconds)
+	{
+		// backlash compensation, outward or inward approach, set up like the focuser's updateApproach
+		const int approach = (int) (rand_r(&seed) % 3) - 1;
+		const int backlash = approach == 0 ? BENCH_BACKLASH : 0;
+		stepper.setApproach(approach, 2 * BENCH_BACKLASH, 0, BENCH_TRAVEL);
+
+		// a new mode finds the gears loaded the way the last one left them, load them again before counting
+		const int load = approach == 0 ? 1 : approach;
+		if (!command(stepper, stepper.getPosition() + load * 100 * BENCH_FINE_STEP, BENCH_BACKLASH, planner) || !waitMove(stepper))
+		{
+			fprintf(stderr, "Loading the gears after move %lu did not complete\n", moves);
+			drift = true;
+			break;
+		}
+		offset = simulator.getDrawtubePosition() - stepper.getPosition();
+
+		for (int i = 0; i < 100 && now() - start < seconds; i++)
+		{
+			int target = stepper.getPosition() + ((int) (rand_r(&seed) % 401) - 200) * BENCH_FINE_STEP;
+			if (target < 0 || target > BENCH_TRAVEL)
+				target = BENCH_TRAVEL / 2;
+			if (target == stepper.getPosition())
+				continue;
+
+			overshoots += stepper.getOvershoot(stepper.getPosition(), target) > 0;
+			steps += abs(target - stepper.getPosition()) / BENCH_FINE_STEP;
+			bool done = command(stepper, target, backlash, planner);
+
+			// every other move is retargeted on the way, relative to its target like the focuser's MoveRelFocuser
+			if (done && rand_r(&seed) % 2)
+			{
+				usleep(rand_r(&seed) % 20000);
+				if (stepper.isMoving())
+				{
+					target = stepper.getTarget() + ((int) (rand_r(&seed) % 201) - 100) * BENCH_FINE_STEP;
+					if (target < 0 || target > BENCH_TRAVEL)
+						target = BENCH_TRAVEL / 2;
+					retargets++;
+				}
+				done = command(stepper, target, backlash, planner);
+			}
+
+			if (!done || !waitMove(stepper))
+			{
+				fprintf(stderr, "Move %lu to %d did not complete\n", moves, target);
+				drift = true;
+				break;
+			}
+			moves++;
+
+			if (stepper.getPosition() != target || simulator.getDrawtubePosition() - stepper.getPosition() != offset)
+			{
+				fprintf(stderr, "Drift after move %lu to %d with approach %d: stepper %d, drawtube %d, expected offset %d\n", moves, target, approach, stepper.getPosition(), simulator.getDrawtubePosition(), offset);
+				drift = true;
+				break;
+			}
+		}
+	}
+
+	result("soak_moves", moves, "moves");
+	result("soak_retargets", retargets, "moves");
+	result("soak_overshoots", overshoots, "moves");
+	result("soak_steps", steps, "steps");
+	result("soak_seconds", now() - start, "s");
+	result("soak_drift", simulator.getDrawtubePosition() - stepper.getPosition() - offset, "units");
+
+	return !drift;
+}
+
+int main(int argc, char *argv[])
+{
+	double soakSeconds = argc > 1 ? atof(argv[1]) : 0;
+	if (argc > 2 || soakSeconds < 0)
+	{
+		fprintf(stderr, "Usage: %s [soak seconds]\n", argv[0]);
+		return 1;
+	}
+
+	// results go to the original stdout, INDI messages to /dev/null
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	int devNull = open("/dev/null", O_WRONLY);
+	if (!out || devNull < 0 || dup2(devNull, STDOUT_FILENO) < 0)
+	{
+		fprintf(stderr, "Cannot redirect stdout\n");
+		return 1;
+	}
+	close(devNull);
+
+	char dirTemplate[] = "/tmp/astroberry-bench-XXXXXX";
+	if (!mkdtemp(dirTemplate))
+	{
+		fprintf(stderr, "Cannot create temporary directory\n");
+		return 1;
+	}
+
+	AstroberrySimulator simulator;
+	AstroberryStepper stepper;
+	if (!startStepper(stepper, simulator))
+	{
+		fprintf(stderr, "Cannot start stepper\n");
+		return 1;
+	}
+
+	benchSteps(stepper, simulator);
+	benchChannels(stepper, simulator);
+	benchSetNumber();
+	benchJournal(dirTemplate);
+	benchTemperature(simulator);
+
+	bool passed = soakSeconds <= 0 || soak(stepper, simulator, soakSeconds);
+
+	stepper.stop();
+	simulator.getChip().close();
+	rmdir(dirTemplate);
+
+	return passed ? 0 : 2;
+}
@@ -0,0 +1,104 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <math.h>
+
+#include "astroberry_compensation.h"
+
+#define COMPENSATION_FORGETTING 0.98 // weight left to a sample after each new one
+#define COMPENSATION_MIN_SAMPLES 3
+#define COMPENSATION_MIN_SPREAD 0.25 // °C² temperature variance, hours² time variance
+
+AstroberryCompensation::AstroberryCompensation()
+{
+	reset();
+}
+
+void AstroberryCompensation::reset()
+{
+	for (int i = 0; i < STAT_COUNT; i++)
+		stats[i] = 0;
+
+	offset = slope = drift = 0;
+	valid = false;
+}
+
+void AstroberryCompensation::setStatistics(const double *values)
+{
+	for (int i = 0; i < STAT_COUNT; i++)
+		stats[i] = values[i];
+}
+
+void AstroberryCompensation::addSample(double temperature, double hours, double position)
+{
+	for (int i = 0; i < STAT_COUNT; i++)
+		stats[i] *= COMPENSATION_FORGETTING;
+
+	stats[STAT_N] += 1;
+	stats[STAT_T] += temperature;
+	stats[STAT_H] += hours;
+	stats[STAT_P] += position;
+	stats[STAT_TT] += temperature * temperature;
+	stats[STAT_HH] += hours * hours;
+	stats[STAT_TH] += temperature * hours;
+	stats[STAT_TP] += temperature * position;
+	stats[STAT_HP] += hours * position;
+}
+
+bool AstroberryCompensation::solve(bool useTime)
+{
+	const double n = stats[STAT_N];
+	valid = false;
+
+	if (n < COMPENSATION_MIN_SAMPLES * COMPENSATION_FORGETTING)
+		return false;
+
+	// centered sums
+	const double ctt = stats[STAT_TT] - stats[STAT_T] * stats[STAT_T] / n;
+	const double chh = stats[STAT_HH] - stats[STAT_H] * stats[STAT_H] / n;
+	const double cth = stats[STAT_TH] - stats[STAT_T] * stats[STAT_H] / n;
+	const double ctp = stats[STAT_TP] - stats[STAT_T] * stats[STAT_P] / n;
+	const double chp = stats[STAT_HP] - stats[STAT_H] * stats[STAT_P] / n;
+
+	// samples at a single temperature do not tell anything about the slope
+	if (ctt / n < COMPENSATION_MIN_SPREAD)
+		return false;
+
+	if (useTime)
+	{
+		const double det = ctt * chh - cth * cth;
+		if (chh / n < COMPENSATION_MIN_SPREAD || fabs(det) < 1e-9 * ctt * chh)
+			return false;
+
+		slope = (ctp * chh - chp * cth) / det;
+		drift = (chp * ctt - ctp * cth) / det;
+	} else {
+		slope = ctp / ctt;
+		drift = 0;
+	}
+
+	offset = (stats[STAT_P] - slope * stats[STAT_T] - drift * stats[STAT_H]) / n;
+	valid = true;
+
+	return true;
+}
+
+double AstroberryCompensation::predict(double temperature, double hours) const
+{
+	return offset + slope * temperature + drift * hours;
+}
@@ -0,0 +1,59 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYCOMPENSATION_H
+#define ASTROBERRYCOMPENSATION_H
+
+/*
+ * Learned temperature compensation
+ *
+ * Least squares fit of focus position against temperature and, optionally,
+ * hours since the first focus of the night:
+ *
+ *   position = offset + slope * temperature + drift * hours
+ *
+ * The model keeps only the running sums of the normal equations, so adding a
+ * sample and solving are both O(1) and the whole model fits in a handful of
+ * numbers saved with the driver config. Older samples are slowly forgotten,
+ * so the model follows changes in the optical train.
+ */
+class AstroberryCompensation
+{
+public:
+	enum { STAT_N, STAT_T, STAT_H, STAT_P, STAT_TT, STAT_HH, STAT_TH, STAT_TP, STAT_HP, STAT_COUNT };
+
+	AstroberryCompensation();
+	void reset();
+	void addSample(double temperature, double hours, double position);
+	bool solve(bool useTime);
+	double predict(double temperature, double hours) const;
+	bool isValid() const { return valid; }
+	double getSamples() const { return stats[STAT_N]; }
+	double getSlope() const { return slope; }
+	double getDrift() const { return drift; }
+	const double *getStatistics() const { return stats; }
+	void setStatistics(const double *values);
+private:
+	double stats[STAT_COUNT];
+	double offset { 0 };
+	double slope { 0 };
+	double drift { 0 };
+	bool valid { false };
+};
+
+#endif
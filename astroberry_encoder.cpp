@@ -0,0 +1,134 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <vector>
+
+#include "astroberry_encoder.h"
+
+AstroberryEncoder::AstroberryEncoder()
+{
+}
+
+AstroberryEncoder::~AstroberryEncoder()
+{
+	stop();
+}
+
+bool AstroberryEncoder::start(AstroberryGpioEvents *lines)
+{
+	if (worker.joinable())
+		return true;
+
+	if (pipe2(quitFd, O_NONBLOCK | O_CLOEXEC) != 0)
+		return false;
+
+	// edges are counted from the levels the lines have now
+	events = lines;
+	level[0] = events->getValue(0) > 0;
+	level[1] = events->getValue(1) > 0;
+	count = 0;
+	errors = edges = wakeups = 0;
+
+	worker = std::thread(&AstroberryEncoder::run, this);
+
+	return true;
+}
+
+void AstroberryEncoder::stop()
+{
+	if (!worker.joinable())
+		return;
+
+	quit = true;
+	char c = 1;
+	if (write(quitFd[1], &c, 1) < 0)
+		return;
+	worker.join();
+	quit = false;
+
+	close(quitFd[0]);
+	close(quitFd[1]);
+	quitFd[0] = quitFd[1] = -1;
+	events = nullptr;
+}
+
+void AstroberryEncoder::run()
+{
+	std::vector<int> fds = events->getFds();
+	std::vector<struct pollfd> polls(fds.size() + 1);
+	polls[0].fd = quitFd[0];
+	polls[0].events = POLLIN;
+	for (size_t i = 0; i < fds.size(); i++)
+	{
+		polls[i + 1].fd = fds[i];
+		polls[i + 1].events = POLLIN;
+	}
+
+	AstroberryGpioEvent batch[ENCODER_BATCH];
+	while (!quit)
+	{
+		if (poll(polls.data(), polls.size(), -1) <= 0)
+			continue;
+		if (quit)
+			break;
+
+		// take everything queued, a burst of edges is handled in one wakeup
+		wakeups++;
+		int n;
+		while ((n = events->read(batch, ENCODER_BATCH)) > 0)
+			decode(batch, n);
+
+		// lines were released under us
+		if (n < 0)
+			break;
+	}
+}
+
+void AstroberryEncoder::decode(const AstroberryGpioEvent *batch, int n)
+{
+	long delta = 0;
+	unsigned long lost = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		const unsigned int line = batch[i].index;
+		if (line > 1)
+			continue;
+
+		if (batch[i].value == level[line])
+		{
+			lost++;
+			continue;
+		}
+		level[line] = batch[i].value;
+
+		// outward A rises while B is low and B rises while A is high
+		if (line == 0)
+			delta += level[0] != level[1] ? 1 : -1;
+		else
+			delta += level[1] == level[0] ? 1 : -1;
+	}
+
+	count += delta;
+	edges += n;
+	if (lost)
+		errors += lost;
+}
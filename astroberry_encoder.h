@@ -0,0 +1,74 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYENCODER_H
+#define ASTROBERRYENCODER_H
+
+#include <atomic>
+#include <thread>
+
+#include "astroberry_gpio.h"
+
+#define ENCODER_BATCH 64 // edges decoded per read
+
+/*
+ * Quadrature encoder reader
+ *
+ * An incremental encoder on the motor shaft reports rotation on two lines,
+ * A and B, a quarter period apart. Each edge of either line is one count and
+ * the level of the other line gives the direction, A leads B outward.
+ *
+ * Edges come from the kernel event queue. The reader thread sleeps in poll
+ * until edges are queued and decodes all of them in batches, so a burst
+ * costs one wakeup rather than one per edge, and a late wakeup loses nothing
+ * as long as the queue holds.
+ *
+ * Every edge changes one line, so the direction is always known. An edge to
+ * the level a line already had means the queue overflowed and the opposite
+ * edge was lost - the two cancel out on the count and are only counted as
+ * an error.
+ */
+class AstroberryEncoder
+{
+public:
+	AstroberryEncoder();
+	~AstroberryEncoder();
+	bool start(AstroberryGpioEvents *events); // lines A & B, in this order
+	void stop();
+	bool isRunning() const { return worker.joinable(); }
+	long getCount() const { return count.load(); }
+	unsigned long getErrors() const { return errors.load(); }
+	unsigned long getEdges() const { return edges.load(); }
+	unsigned long getWakeups() const { return wakeups.load(); }
+private:
+	void run();
+	void decode(const AstroberryGpioEvent *batch, int n);
+
+	std::thread worker;
+	AstroberryGpioEvents *events { nullptr };
+	int quitFd[2] { -1, -1 };
+	std::atomic<bool> quit { false };
+	int level[2] { 0, 0 }; // A & B as decoded, reader thread only
+
+	std::atomic<long> count { 0 };
+	std::atomic<unsigned long> errors { 0 };
+	std::atomic<unsigned long> edges { 0 };
+	std::atomic<unsigned long> wakeups { 0 };
+};
+
+#endif
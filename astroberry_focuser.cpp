@@ -20,34 +20,36 @@
  * TO DO:
  * - Save position in xml instead flat file
  * - Add Thermal expansion ratio selection for various materials
- * - Add temperature compensation auto learning and save temperature compensation curve to xml
- * - Add simulation mode
  */
 
 #include <stdio.h>
-#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <fstream>
 #include <math.h>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <time.h>
 #include "config.h"
 
-#include <gpiod.h>
 
 #include "astroberry_focuser.h"
+#include "astroberry_metrics.h"
 
-// We declare an auto pointer to AstroberryFocuser.
-std::unique_ptr<AstroberryFocuser> astroberryFocuser(new AstroberryFocuser());
-
-// create millisecond sleep macro
-#define msleep(milliseconds) usleep(milliseconds * 1000)
+// One AstroberryFocuser per stepper channel, all sharing the gpio chip & stepping thread.
+static std::vector<std::unique_ptr<AstroberryFocuser>> astroberryFocusers;
 
 #define MINMAX_MIN_POS 0 // lowest limit for focuser position
 #define MINMAX_MAX_POS 100000 // highest limit for focuser position
-#define TEMPERATURE_UPDATE_TIMEOUT (60 * 1000) // 60 sec
-#define TEMPERATURE_COMPENSATION_TIMEOUT (60 * 1000) // 60 sec
+#define DIAGNOSTICS_TAB "Diagnostics"
+#define AUTOFOCUS_TAB "Autofocus"
+#define FILTER_TAB "Filters"
+#define FOCUS_SETTLE_TIMEOUT (60 * 1000) // 60 sec at a position before it counts as focused
+#define COMPENSATION_NIGHT_GAP (12 * 3600) // sec without samples starting a new night
+#define EXPOSURE_STALE_TIMEOUT 60 // sec past the end of a snooped exposure we stop waiting for it
+#define FOCUSER_CHANNELS_ENV "ASTROBERRY_FOCUSERS" // number of focusers hosted by the driver, 1 by default
 
 void ISPoll(void *p);
 
@@ -58,35 +60,52 @@ void ISInit()
 
 	if (isInit == 1)
 	return;
-	if(astroberryFocuser.get() == 0)
-	{
-		isInit = 1;
-		astroberryFocuser.reset(new AstroberryFocuser());
-	}
+	isInit = 1;
+
+	int channels = getenv(FOCUSER_CHANNELS_ENV) ? atoi(getenv(FOCUSER_CHANNELS_ENV)) : 1;
+	channels = std::min(std::max(channels, 1), FOCUSER_MAX_CHANNELS);
+	for (int channel = 0; channel < channels; channel++)
+		astroberryFocusers.push_back(std::unique_ptr<AstroberryFocuser>(new AstroberryFocuser(channel)));
 }
 
 void ISGetProperties(const char *dev)
 {
 	ISInit();
-	astroberryFocuser->ISGetProperties(dev);
+	for (auto &focuser : astroberryFocusers)
+	{
+		if (dev == nullptr || !strcmp(dev, focuser->getDeviceName()))
+			focuser->ISGetProperties(dev);
+	}
 }
 
 void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int num)
 {
 	ISInit();
-	astroberryFocuser->ISNewSwitch(dev, name, states, names, num);
+	for (auto &focuser : astroberryFocusers)
+	{
+		if (dev == nullptr || !strcmp(dev, focuser->getDeviceName()))
+			focuser->ISNewSwitch(dev, name, states, names, num);
+	}
 }
 
 void ISNewText(	const char *dev, const char *name, char *texts[], char *names[], int num)
 {
 	ISInit();
-	astroberryFocuser->ISNewText(dev, name, texts, names, num);
+	for (auto &focuser : astroberryFocusers)
+	{
+		if (dev == nullptr || !strcmp(dev, focuser->getDeviceName()))
+			focuser->ISNewText(dev, name, texts, names, num);
+	}
 }
 
 void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int num)
 {
 	ISInit();
-	astroberryFocuser->ISNewNumber(dev, name, values, names, num);
+	for (auto &focuser : astroberryFocusers)
+	{
+		if (dev == nullptr || !strcmp(dev, focuser->getDeviceName()))
+			focuser->ISNewNumber(dev, name, values, names, num);
+	}
 }
 
 void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n)
@@ -103,13 +122,21 @@ void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[],
 
 void ISSnoopDevice (XMLEle *root)
 {
-	astroberryFocuser->ISSnoopDevice(root);
+	for (auto &focuser : astroberryFocusers)
+		focuser->ISSnoopDevice(root);
 }
 
-AstroberryFocuser::AstroberryFocuser()
+AstroberryFocuser::AstroberryFocuser(int channel) : channel(channel)
 {
 	setVersion(VERSION_MAJOR,VERSION_MINOR);
 
+	// first focuser keeps the name existing configs are saved under
+	if (channel > 0)
+	{
+		snprintf(channelName, sizeof(channelName), "Astroberry Focuser %d", channel + 1);
+		setDeviceName(channelName);
+	}
+
 	FI::SetCapability(
 		FOCUSER_CAN_ABS_MOVE	|
 		FOCUSER_CAN_REL_MOVE	|
@@ -127,17 +154,30 @@ AstroberryFocuser::~AstroberryFocuser()
 {
 	deleteProperty(MotorBoardSP.name);
 	deleteProperty(BCMpinsNP.name);
+	deleteProperty(EncoderModeSP.name);
+	deleteProperty(EncoderPinsNP.name);
 }
 
 const char * AstroberryFocuser::getDefaultName()
 {
-        return (char *)"Astroberry Focuser";
+        return channel > 0 ? channelName : (char *)"Astroberry Focuser";
 }
 
 bool AstroberryFocuser::Connect()
 {
-	chip = gpiod_chip_open("/dev/gpiochip0");
-	if (!chip)
+	// simulation drives a virtual motor on a mock chip
+	if (isSimulation())
+	{
+		unsigned int pins[AstroberrySimulator::PIN_COUNT];
+		for (int pin = 0; pin < AstroberrySimulator::PIN_COUNT; pin++)
+			pins[pin] = BCMpinsN[pin].value;
+		simulator.configure(IUFindOnSwitchIndex(&MotorBoardSP), pins);
+		chip = &simulator.getChip();
+	} else {
+		chip = &AstroberryGpiodChip::shared();
+	}
+
+	if (!chip->open())
 	{
 		DEBUG(INDI::Logger::DBG_ERROR, "Problem initiating Astroberry Focuser.");
 		return false;
@@ -146,26 +186,128 @@ bool AstroberryFocuser::Connect()
 	// verify BCM Pins are not used by other consumers
 	for (unsigned int pin = 0; pin < 6; pin++)
 	{
-		if (gpiod_line_is_used(gpiod_chip_get_line(chip, BCMpinsN[pin].value)))
+		if (chip->isUsed(BCMpinsN[pin].value))
 		{
 			DEBUGF(INDI::Logger::DBG_ERROR, "BCM Pin %0.0f already used", BCMpinsN[pin].value);
-			gpiod_chip_close(chip);
+			releaseGpio();
+			chip->close();
+			return false;
+		}
+	}
+
+	// encoder pins are checked up front, a conflict would only show as a failed event request
+	for (unsigned int pin = 0; pin < 2 && EncoderModeS[0].s != ISS_ON; pin++)
+	{
+		if (chip->isUsed(EncoderPinsN[pin].value))
+		{
+			DEBUGF(INDI::Logger::DBG_ERROR, "Encoder BCM Pin %0.0f already used", EncoderPinsN[pin].value);
+			releaseGpio();
+			chip->close();
+			return false;
+		}
+	}
+
+	// get microstep mode for selected resolution
+	uint8_t mode[3];
+	if (!AstroberryStepper::getModePins(IUFindOnSwitchIndex(&MotorBoardSP), resolution, mode))
+	{
+		DEBUGF(INDI::Logger::DBG_ERROR, "Resolution 1/%d is not supported by %s.", resolution, IUFindOnSwitch(&MotorBoardSP)->label);
+		releaseGpio();
+		chip->close();
+		return false;
+	}
+
+	// dir, step & sleep are always outputs and go in one request, default direction is outward & stepper starts awake
+	const unsigned int driveOffsets[3] = { (unsigned int) BCMpinsN[0].value, (unsigned int) BCMpinsN[1].value, (unsigned int) BCMpinsN[2].value };
+	const int driveLevels[3] = { 1, 0, 0 };
+	gpio_drive = chip->requestOutputs(driveOffsets, 3, "astroberry_focuser", driveLevels);
+	if (!gpio_drive)
+	{
+		DEBUG(INDI::Logger::DBG_ERROR, "Problem requesting DIR, STEP & SLEEP gpios.");
+		releaseGpio();
+		chip->close();
+		return false;
+	}
+	gpio_dir = gpio_drive->getLine(0);
+	gpio_step = gpio_drive->getLine(1);
+	gpio_sleep = gpio_drive->getLine(2);
+
+	// mode pins switch between input & output on their own
+	gpio_mode[0] = chip->getLine(BCMpinsN[3].value);
+	gpio_mode[1] = chip->getLine(BCMpinsN[4].value);
+	gpio_mode[2] = chip->getLine(BCMpinsN[5].value);
+	const char *modeConsumer[3] = { "m0@astroberry_focuser", "m1@astroberry_focuser", "m2@astroberry_focuser" };
+	for (int i = 0; i < 3; i++)
+	{
+		// floating mode pin is left as input
+		bool requested = gpio_mode[i] && (mode[i] == AstroberrySchedule::MODE_FLOAT ? gpio_mode[i]->requestInput(modeConsumer[i]) : gpio_mode[i]->requestOutput(modeConsumer[i], mode[i]));
+		if (!requested)
+		{
+			// only lines requested here are released
+			for (int j = i; j < 3; j++)
+				gpio_mode[j] = nullptr;
+			DEBUG(INDI::Logger::DBG_ERROR, "Problem requesting M0, M1 & M2 gpios.");
+			releaseGpio();
+			chip->close();
 			return false;
 		}
 	}
 
-	// Select gpios
-	gpio_dir = gpiod_chip_get_line(chip, BCMpinsN[0].value);
-	gpio_step = gpiod_chip_get_line(chip, BCMpinsN[1].value);
-	gpio_sleep = gpiod_chip_get_line(chip, BCMpinsN[2].value);
+	// recover last position from the journal & convert from MAX_RESOLUTION to current resolution
+	int savedPosition = loadPosition();
+	FocusAbsPosN[0].value = savedPosition != -1 ? savedPosition / getPositionScale() : 0;
+
+	// open focus history, the focuser works without it
+	char historyFileName[MAXRBUF];
+	getFileName(historyFileName, "history");
+	if (!history.open(historyFileName))
+		DEBUGF(INDI::Logger::DBG_WARNING, "Cannot open focus history %s.", historyFileName);
+	FocusPredictionN[2].value = history.size();
+
+	// reset position updates statistics
+	positionUpdatesSent = positionUpdatesSuppressed = 0;
 
-	// Set initial state for gpios
-	gpiod_line_request_output(gpio_dir, "dir@astroberry_focuser", 1); // default direction is outward
-	gpiod_line_request_output(gpio_step, "step@astroberry_focuser", 0);
-	gpiod_line_request_output(gpio_sleep, "sleep@astroberry_focuser", 0); // start stepper in wake up state
+	// hand over gpios to the stepper thread
+	stepper.setPosition((int) FocusAbsPosN[0].value * getPositionScale());
+	if (!stepper.start(gpio_dir, gpio_step, gpio_sleep, gpio_mode, mode))
+	{
+		DEBUG(INDI::Logger::DBG_ERROR, "Problem starting stepper thread.");
+		releaseGpio();
+		chip->close();
+		return false;
+	}
+	stepperDoneID = IEAddCallback(stepper.getNotifyFd(), stepperDoneHelper, this);
+	updateResolution();
+
+	// virtual motor starts where the focuser was left, the sensor follows a temperature profile
+	if (isSimulation())
+	{
+		updateSimulationModel();
+		simulator.setEncoder(EncoderPinsN[0].value, EncoderPinsN[1].value, EncoderModeS[0].s == ISS_ON ? 0 : EncoderSettingsN[0].value, EncoderMountS[1].s == ISS_ON);
+		simulator.setPosition(stepper.getPosition());
+		if (!simulator.startThermometer(SimulationModelN[1].value, SimulationModelN[2].value))
+			DEBUG(INDI::Logger::DBG_WARNING, "Cannot create simulated temperature sensor.");
+		simulationTimerID = IEAddTimer(1000, simulationTimerHelper, this);
+		DEBUG(INDI::Logger::DBG_SESSION, "Astroberry Focuser is running in simulation mode.");
+	}
 
-	//read last position from file & convert from MAX_RESOLUTION to current resolution
-	FocusAbsPosN[0].value = savePosition(-1) != -1 ? (int) savePosition(-1) : 0;
+	// encoder on the motor shaft is optional, the focuser runs open loop without it
+	encoderCorrections = 0;
+	if (EncoderModeS[0].s != ISS_ON)
+	{
+		const unsigned int encoderOffsets[2] = { (unsigned int) EncoderPinsN[0].value, (unsigned int) EncoderPinsN[1].value };
+		gpio_encoder = chip->requestEvents(encoderOffsets, 2, "encoder@astroberry_focuser");
+		if (gpio_encoder && encoder.start(gpio_encoder))
+		{
+			resetEncoder();
+			DEBUGF(INDI::Logger::DBG_SESSION, "Encoder reading BCM%0.0f & BCM%0.0f.", EncoderPinsN[0].value, EncoderPinsN[1].value);
+		} else {
+			if (gpio_encoder)
+				gpio_encoder->release();
+			gpio_encoder = nullptr;
+			DEBUG(INDI::Logger::DBG_WARNING, "Problem requesting encoder gpios, focuser runs open loop.");
+		}
+	}
 
 	// Lock Motor Board setting
 	MotorBoardSP.s=IPS_BUSY;
@@ -174,6 +316,12 @@ bool AstroberryFocuser::Connect()
 	// Lock BCM Pins setting
 	BCMpinsNP.s=IPS_BUSY;
 	IDSetNumber(&BCMpinsNP, nullptr);
+	EncoderPinsNP.s=IPS_BUSY;
+	IDSetNumber(&EncoderPinsNP, nullptr);
+
+	// Lock Resolution setting
+	FocusResolutionSP.s=IPS_BUSY;
+	IDSetSwitch(&FocusResolutionSP, nullptr);
 
 	// Update focuser parameters
 	getFocuserInfo();
@@ -196,14 +344,44 @@ bool AstroberryFocuser::Disconnect()
 {
 	// Stop timers
 	IERmTimer(stepperStandbyID);
-	IERmTimer(updateTemperatureID);
 	IERmTimer(temperatureCompensationID);
+	temperatureCompensationID = -1;
+	if (autofocus.isRunning())
+		stopAutofocus(IPS_IDLE);
+	if (calibration.isRunning())
+		stopCalibration(IPS_IDLE);
+
+	// Stop temperature sensor thread
+	IERmCallback(updateTemperatureID);
+	if (thermometerFd >= 0)
+		thermometer->unsubscribe(thermometerFd);
+	thermometerFd = -1;
+
+	// Stop stepper thread
+	IERmCallback(stepperDoneID);
+	stepper.stop();
+
+	// Stop encoder thread
+	encoder.stop();
+	if (gpio_encoder)
+		gpio_encoder->release();
+	gpio_encoder = nullptr;
+
+	// an aborted move has not been journaled at rest yet
+	if (journal.isOpen())
+		savePosition(stepper.getPosition());
+	journal.close();
+	history.close();
 
 	// Set stepper motor asleep
-	gpiod_line_set_value(gpio_sleep, 1);
+	gpio_sleep->setValue(1);
 
 	// Close device
-	gpiod_chip_close(chip);
+	releaseGpio();
+	chip->close();
+	IERmTimer(simulationTimerID);
+	simulationTimerID = -1;
+	simulator.stopThermometer();
 
 	// Unlock Motor Board setting
 	MotorBoardSP.s=IPS_IDLE;
@@ -212,12 +390,34 @@ bool AstroberryFocuser::Disconnect()
 	// Unlock BCM Pins setting
 	BCMpinsNP.s=IPS_IDLE;
 	IDSetNumber(&BCMpinsNP, nullptr);
+	EncoderPinsNP.s=IPS_IDLE;
+	IDSetNumber(&EncoderPinsNP, nullptr);
+
+	// Unlock Resolution setting
+	FocusResolutionSP.s=IPS_IDLE;
+	IDSetSwitch(&FocusResolutionSP, nullptr);
 
 	DEBUG(INDI::Logger::DBG_SESSION, "Astroberry Focuser disconnected successfully.");
 
 	return true;
 }
 
+void AstroberryFocuser::releaseGpio()
+{
+	// lines stay requested on a chip that is kept open by another channel
+	if (gpio_drive)
+		gpio_drive->release();
+	gpio_drive = nullptr;
+	gpio_dir = gpio_step = gpio_sleep = nullptr;
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (gpio_mode[i])
+			gpio_mode[i]->release();
+		gpio_mode[i] = nullptr;
+	}
+}
+
 bool AstroberryFocuser::initProperties()
 {
 	INDI::Focuser::initProperties();
@@ -235,13 +435,80 @@ bool AstroberryFocuser::initProperties()
 	// Focuser Stepper Controller
 	IUFillSwitch(&MotorBoardS[0],"DRV8834","DRV8834",ISS_ON);
 	IUFillSwitch(&MotorBoardS[1],"A4988","A4988",ISS_OFF);
-	IUFillSwitchVector(&MotorBoardSP,MotorBoardS,2,getDeviceName(),"MOTOR_BOARD","Control Board",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
+	IUFillSwitch(&MotorBoardS[2],"DRV8825","DRV8825",ISS_OFF);
+	IUFillSwitchVector(&MotorBoardSP,MotorBoardS,3,getDeviceName(),"MOTOR_BOARD","Control Board",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
+
+	// Focuser Resolution
+	IUFillSwitch(&FocusResolutionS[0],"FOCUS_RESOLUTION_1","Full Step",ISS_ON);
+	IUFillSwitch(&FocusResolutionS[1],"FOCUS_RESOLUTION_2","Half Step",ISS_OFF);
+	IUFillSwitch(&FocusResolutionS[2],"FOCUS_RESOLUTION_4","1/4 STEP",ISS_OFF);
+	IUFillSwitch(&FocusResolutionS[3],"FOCUS_RESOLUTION_8","1/8 STEP",ISS_OFF);
+	IUFillSwitch(&FocusResolutionS[4],"FOCUS_RESOLUTION_16","1/16 STEP",ISS_OFF);
+	IUFillSwitch(&FocusResolutionS[5],"FOCUS_RESOLUTION_32","1/32 STEP",ISS_OFF);
+	IUFillSwitchVector(&FocusResolutionSP,FocusResolutionS,6,getDeviceName(),"FOCUS_RESOLUTION","Resolution",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
+
+	// Adaptive resolution moves
+	IUFillSwitch(&AdaptiveMoveS[0],"ADAPTIVE_OFF","Off",ISS_ON);
+	IUFillSwitch(&AdaptiveMoveS[1],"ADAPTIVE_FULL","Full Step Slew",ISS_OFF);
+	IUFillSwitch(&AdaptiveMoveS[2],"ADAPTIVE_HALF","Half Step Slew",ISS_OFF);
+	IUFillSwitchVector(&AdaptiveMoveSP,AdaptiveMoveS,3,getDeviceName(),"ADAPTIVE_MOVE","Adaptive Move",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
+
+	// Final approach at full resolution
+	IUFillNumber(&AdaptiveApproachN[0], "ADAPTIVE_APPROACH_VALUE", "full steps", "%0.0f", 1, 100, 1, 4);
+	IUFillNumberVector(&AdaptiveApproachNP, AdaptiveApproachN, 1, getDeviceName(), "ADAPTIVE_APPROACH", "Final Approach", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Backlash strategy
+	IUFillSwitch(&BacklashModeS[0],"BACKLASH_TAKE_UP","Take up on reversal",ISS_ON);
+	IUFillSwitch(&BacklashModeS[1],"BACKLASH_OVERSHOOT_OUT","Overshoot, approach outward",ISS_OFF);
+	IUFillSwitch(&BacklashModeS[2],"BACKLASH_OVERSHOOT_IN","Overshoot, approach inward",ISS_OFF);
+	IUFillSwitchVector(&BacklashModeSP,BacklashModeS,3,getDeviceName(),"BACKLASH_MODE","Backlash Mode",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
+
+	// Overshoot past the target before the final approach
+	IUFillNumber(&OvershootN[0], "FOCUS_OVERSHOOT_VALUE", "steps", "%0.0f", 0, 10000, 10, 50);
+	IUFillNumberVector(&OvershootNP, OvershootN, 1, getDeviceName(), "FOCUS_OVERSHOOT", "Overshoot", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Backlash calibration - lost motion measured on reversals, by a drawtube encoder or from frames
+	IUFillSwitch(&BacklashCalibrationS[0], "BACKLASH_CALIBRATION_START", "Start", ISS_OFF);
+	IUFillSwitch(&BacklashCalibrationS[1], "BACKLASH_CALIBRATION_ABORT", "Abort", ISS_OFF);
+	IUFillSwitchVector(&BacklashCalibrationSP, BacklashCalibrationS, 2, getDeviceName(), "BACKLASH_CALIBRATION", "Calibrate Backlash", OPTIONS_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+	IUFillNumber(&BacklashCalibrationSettingsN[0], "BACKLASH_CALIBRATION_STROKE", "Stroke (steps)", "%0.0f", 10, 10000, 10, 200);
+	IUFillNumber(&BacklashCalibrationSettingsN[1], "BACKLASH_CALIBRATION_CYCLES", "Cycles", "%0.0f", 1, 10, 1, 3);
+	IUFillNumber(&BacklashCalibrationSettingsN[2], "BACKLASH_CALIBRATION_DEFOCUS", "Defocus for frames (steps)", "%0.0f", 0, 10000, 10, 300);
+	IUFillNumberVector(&BacklashCalibrationSettingsNP, BacklashCalibrationSettingsN, 3, getDeviceName(), "BACKLASH_CALIBRATION_SETTINGS", "Calibration", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	IUFillNumber(&BacklashCalibrationStatusN[0], "BACKLASH_CALIBRATION_POINT", "Point", "%0.0f", 0, 100, 0, 0);
+	IUFillNumber(&BacklashCalibrationStatusN[1], "BACKLASH_CALIBRATION_RESULT", "Backlash (steps)", "%0.0f", 0, 1e6, 0, 0);
+	IUFillNumber(&BacklashCalibrationStatusN[2], "BACKLASH_CALIBRATION_SPREAD", "Spread (steps)", "%0.0f", 0, 1e6, 0, 0);
+	IUFillNumberVector(&BacklashCalibrationStatusNP, BacklashCalibrationStatusN, 3, getDeviceName(), "BACKLASH_CALIBRATION_STATUS", "Calibration", OPTIONS_TAB, IP_RO, 0, IPS_IDLE);
 
 	// BCM PINs setting
 	IUFillNumber(&BCMpinsN[0], "BCMPIN_DIR", "DIR", "%0.0f", 1, 27, 0, 23); // BCM23 = PIN16
 	IUFillNumber(&BCMpinsN[1], "BCMPIN_STEP", "STEP", "%0.0f", 1, 27, 0, 25); // BCM24 = PIN18
 	IUFillNumber(&BCMpinsN[2], "BCMPIN_SLEEP", "SLEEP", "%0.0f", 1, 27, 0, 22); // BCM22 = PIN15
-	IUFillNumberVector(&BCMpinsNP, BCMpinsN, 3, getDeviceName(), "BCMPINS", "BCM Pins", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+	IUFillNumber(&BCMpinsN[3], "BCMPIN_M0", "M0", "%0.0f", 1, 27, 0, 5); // BCM5 = PIN29
+	IUFillNumber(&BCMpinsN[4], "BCMPIN_M1", "M1", "%0.0f", 1, 27, 0, 6); // BCM6 = PIN31
+	IUFillNumber(&BCMpinsN[5], "BCMPIN_M2", "M2", "%0.0f", 1, 27, 0, 13); // BCM13 = PIN33
+	IUFillNumberVector(&BCMpinsNP, BCMpinsN, 6, getDeviceName(), "BCMPINS", "BCM Pins", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Quadrature encoder on the motor shaft
+	IUFillSwitch(&EncoderModeS[0],"ENCODER_OFF","Off",ISS_ON);
+	IUFillSwitch(&EncoderModeS[1],"ENCODER_MONITOR","Monitor",ISS_OFF);
+	IUFillSwitch(&EncoderModeS[2],"ENCODER_CLOSED_LOOP","Closed loop",ISS_OFF);
+	IUFillSwitchVector(&EncoderModeSP,EncoderModeS,3,getDeviceName(),"ENCODER_MODE","Encoder",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
+
+	IUFillNumber(&EncoderPinsN[0], "ENCODER_PIN_A", "A", "%0.0f", 1, 27, 0, 20); // BCM20 = PIN38
+	IUFillNumber(&EncoderPinsN[1], "ENCODER_PIN_B", "B", "%0.0f", 1, 27, 0, 21); // BCM21 = PIN40
+	IUFillNumberVector(&EncoderPinsNP, EncoderPinsN, 2, getDeviceName(), "ENCODER_PINS", "Encoder Pins", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	IUFillNumber(&EncoderSettingsN[0], "ENCODER_COUNTS", "Counts per full step", "%0.0f", 1, 1000, 1, 4);
+	IUFillNumber(&EncoderSettingsN[1], "ENCODER_TOLERANCE", "Step loss alert (steps)", "%0.0f", 1, 10000, 1, 10);
+	IUFillNumber(&EncoderSettingsN[2], "ENCODER_CORRECTIONS", "Max corrections", "%0.0f", 0, 10, 1, 2);
+	IUFillNumberVector(&EncoderSettingsNP, EncoderSettingsN, 3, getDeviceName(), "ENCODER_SETTINGS", "Encoder", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	IUFillSwitch(&EncoderMountS[0],"ENCODER_ON_SHAFT","Motor shaft",ISS_ON);
+	IUFillSwitch(&EncoderMountS[1],"ENCODER_ON_DRAWTUBE","Drawtube",ISS_OFF);
+	IUFillSwitchVector(&EncoderMountSP,EncoderMountS,2,getDeviceName(),"ENCODER_MOUNT","Encoder Mount",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
 
 	// Stepper standby setting
 	IUFillSwitch(&StepperStandbyS[0],"STEPPER_STANDBY_ON","Enable",ISS_ON);
@@ -252,18 +519,104 @@ bool AstroberryFocuser::initProperties()
 	IUFillNumber(&StepperStandbyTimeN[0], "STEPPER_STANDBY_DELAY_VALUE", "seconds", "%0.0f", 0, 600, 10, 60);
 	IUFillNumberVector(&StepperStandbyTimeNP, StepperStandbyTimeN, 1, getDeviceName(), "STEPPER_STANDBY_DELAY", "Standby Delay", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);	
 
-	// Step delay setting
-	IUFillNumber(&FocusStepDelayN[0], "FOCUS_STEPDELAY_VALUE", "milliseconds", "%0.0f", 1, 10, 1, 1);
-	IUFillNumberVector(&FocusStepDelayNP, FocusStepDelayN, 1, getDeviceName(), "FOCUS_STEPDELAY", "Step Delay", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+	// Motion profile setting
+	IUFillNumber(&FocusMotionProfileN[0], "FOCUS_START_SPEED", "Start speed (steps/s)", "%0.0f", 10, 5000, 50, 500);
+	IUFillNumber(&FocusMotionProfileN[1], "FOCUS_MAX_SPEED", "Max speed (steps/s)", "%0.0f", 10, 20000, 100, 1000);
+	IUFillNumber(&FocusMotionProfileN[2], "FOCUS_ACCELERATION", "Acceleration (steps/s²)", "%0.0f", 0, 100000, 100, 2000);
+	IUFillNumberVector(&FocusMotionProfileNP, FocusMotionProfileN, 3, getDeviceName(), "FOCUS_MOTION_PROFILE", "Motion Profile", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Predicted move duration
+	IUFillNumber(&FocusMoveDurationN[0], "FOCUS_MOVE_DURATION_VALUE", "seconds", "%0.2f", 0, 3600, 0, 0);
+	IUFillNumberVector(&FocusMoveDurationNP, FocusMoveDurationN, 1, getDeviceName(), "FOCUS_MOVE_DURATION", "Move Duration", MAIN_CONTROL_TAB, IP_RO, 0, IPS_IDLE);
+
+	// Position update rate while moving
+	IUFillNumber(&PositionUpdateRateN[0], "POSITION_UPDATE_RATE_VALUE", "Hz", "%0.0f", 1, 20, 1, 5);
+	IUFillNumberVector(&PositionUpdateRateNP, PositionUpdateRateN, 1, getDeviceName(), "POSITION_UPDATE_RATE", "Position Updates", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Position update statistics
+	IUFillNumber(&PositionUpdateStatsN[0], "POSITION_UPDATES_SENT", "Sent", "%0.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&PositionUpdateStatsN[1], "POSITION_UPDATES_SUPPRESSED", "Suppressed", "%0.0f", 0, 1e12, 0, 0);
+	IUFillNumberVector(&PositionUpdateStatsNP, PositionUpdateStatsN, 2, getDeviceName(), "POSITION_UPDATE_STATS", "Position Updates", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+	// Position journal
+	IUFillSwitch(&JournalSyncS[0],"JOURNAL_SYNC_NONE","Never",ISS_OFF);
+	IUFillSwitch(&JournalSyncS[1],"JOURNAL_SYNC_AT_REST","At Rest",ISS_ON);
+	IUFillSwitch(&JournalSyncS[2],"JOURNAL_SYNC_ALWAYS","Every Record",ISS_OFF);
+	IUFillSwitchVector(&JournalSyncSP,JournalSyncS,3,getDeviceName(),"JOURNAL_SYNC","Journal Sync",OPTIONS_TAB,IP_RW,ISR_1OFMANY,0,IPS_IDLE);
+
+	IUFillNumber(&JournalCheckpointN[0], "JOURNAL_CHECKPOINT_VALUE", "seconds", "%0.1f", 0, 60, 0.5, 1);
+	IUFillNumberVector(&JournalCheckpointNP, JournalCheckpointN, 1, getDeviceName(), "JOURNAL_CHECKPOINT", "Move Checkpoints", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Dry run - compile a move without moving
+	IUFillNumber(&DryRunN[0], "DRY_RUN_TARGET", "Target", "%0.0f", 0, MINMAX_MAX_POS, 1, 0);
+	IUFillNumberVector(&DryRunNP, DryRunN, 1, getDeviceName(), "DRY_RUN", "Dry Run", DIAGNOSTICS_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Dump step schedule of every move
+	IUFillSwitch(&ScheduleDumpS[0], "SCHEDULE_DUMP_ON", "Enable", ISS_OFF);
+	IUFillSwitch(&ScheduleDumpS[1], "SCHEDULE_DUMP_OFF", "Disable", ISS_ON);
+	IUFillSwitchVector(&ScheduleDumpSP, ScheduleDumpS, 2, getDeviceName(), "SCHEDULE_DUMP", "Dump Schedule", DIAGNOSTICS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Step timing of the last move - lateness of step edges against their deadlines
+	IUFillNumber(&StepTimingN[0], "STEP_TIMING_EDGES", "Step edges", "%0.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&StepTimingN[1], "STEP_TIMING_LATENCY", "First step (us)", "%0.0f", 0, 1e9, 0, 0);
+	IUFillNumber(&StepTimingN[2], "STEP_TIMING_P50", "Lateness p50 (us)", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&StepTimingN[3], "STEP_TIMING_P99", "Lateness p99 (us)", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&StepTimingN[4], "STEP_TIMING_MAX", "Lateness max (us)", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&StepTimingN[5], "STEP_TIMING_MISSED", "Missed deadlines", "%0.0f", 0, 1e12, 0, 0);
+	IUFillNumberVector(&StepTimingNP, StepTimingN, 6, getDeviceName(), "STEP_TIMING", "Step Timing", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+	// Encoder against the commanded position
+	IUFillNumber(&EncoderStatusN[0], "ENCODER_COUNT", "Count", "%0.0f", -1e12, 1e12, 0, 0);
+	IUFillNumber(&EncoderStatusN[1], "ENCODER_POSITION", "Position (steps)", "%0.0f", -1e9, 1e9, 0, 0);
+	IUFillNumber(&EncoderStatusN[2], "ENCODER_DEVIATION", "Deviation (steps)", "%0.0f", -1e9, 1e9, 0, 0);
+	IUFillNumber(&EncoderStatusN[3], "ENCODER_ERRORS", "Lost edges", "%0.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&EncoderStatusN[4], "ENCODER_BATCH", "Edges per wakeup", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumberVector(&EncoderStatusNP, EncoderStatusN, 5, getDeviceName(), "ENCODER_STATUS", "Encoder", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+	// Dump raw step timing samples of every move
+	IUFillSwitch(&StepTimingDumpS[0], "STEP_TIMING_DUMP_ON", "Enable", ISS_OFF);
+	IUFillSwitch(&StepTimingDumpS[1], "STEP_TIMING_DUMP_OFF", "Disable", ISS_ON);
+	IUFillSwitchVector(&StepTimingDumpSP, StepTimingDumpS, 2, getDeviceName(), "STEP_TIMING_DUMP", "Dump Timing", DIAGNOSTICS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Recent motion history
+	IUFillSwitch(&TelemetryDumpS[0], "TELEMETRY_DUMP", "Dump", ISS_OFF);
+	IUFillSwitchVector(&TelemetryDumpSP, TelemetryDumpS, 1, getDeviceName(), "TELEMETRY_DUMP", "Motion History", DIAGNOSTICS_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
 
 	// Active telescope setting
-	IUFillText(&ActiveTelescopeT[0], "ACTIVE_TELESCOPE_NAME", "Telescope", "Telescope Simulator");
-	IUFillTextVector(&ActiveTelescopeTP, ActiveTelescopeT, 1, getDeviceName(), "ACTIVE_TELESCOPE", "Snoop devices", OPTIONS_TAB,IP_RW, 0, IPS_IDLE);
+	IUFillText(&ActiveDeviceT[0], "ACTIVE_TELESCOPE_NAME", "Telescope", "Telescope Simulator");
+	IUFillText(&ActiveDeviceT[1], "ACTIVE_CCD_NAME", "CCD", "CCD Simulator");
+	IUFillText(&ActiveDeviceT[2], "ACTIVE_FILTER_NAME", "Filter", "Filter Simulator");
+	IUFillTextVector(&ActiveDeviceTP, ActiveDeviceT, 3, getDeviceName(), "ACTIVE_TELESCOPE", "Snoop devices", OPTIONS_TAB,IP_RW, 0, IPS_IDLE);
 
 	// Focuser temperature
 	IUFillNumber(&FocusTemperatureN[0], "FOCUS_TEMPERATURE_VALUE", "°C", "%0.2f", -50, 50, 1, 0);
 	IUFillNumberVector(&FocusTemperatureNP, FocusTemperatureN, 1, getDeviceName(), "FOCUS_TEMPERATURE", "Temperature", MAIN_CONTROL_TAB, IP_RO, 0, IPS_IDLE);
 
+	// All temperature sensors on 1-Wire bus, labelled with sensor id once enumerated
+	for (int i = 0; i < THERMOMETER_MAX_SENSORS; i++)
+	{
+		char name[MAXINDINAME];
+		snprintf(name, MAXINDINAME, "TEMPERATURE_SENSOR_%d", i + 1);
+		snprintf(temperatureSensorIds[i], MAXINDILABEL, "Sensor %d", i + 1);
+		IUFillNumber(&TemperatureSensorsN[i], name, temperatureSensorIds[i], "%0.2f", -50, 50, 1, 0);
+		snprintf(name, MAXINDINAME, "TEMPERATURE_SOURCE_%d", i + 1);
+		IUFillSwitch(&TemperatureSourceS[i], name, temperatureSensorIds[i], i == 0 ? ISS_ON : ISS_OFF);
+	}
+	IUFillNumberVector(&TemperatureSensorsNP, TemperatureSensorsN, 1, getDeviceName(), "TEMPERATURE_SENSORS", "Sensors", MAIN_CONTROL_TAB, IP_RO, 0, IPS_IDLE);
+	IUFillSwitchVector(&TemperatureSourceSP, TemperatureSourceS, 1, getDeviceName(), "TEMPERATURE_SOURCE", "Compensation Source", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Temperature conversion resolution - 94 ms at 9 bit up to 750 ms at 12 bit
+	IUFillSwitch(&TemperatureResolutionS[0], "TEMPERATURE_RESOLUTION_9", "9 bit", ISS_OFF);
+	IUFillSwitch(&TemperatureResolutionS[1], "TEMPERATURE_RESOLUTION_10", "10 bit", ISS_OFF);
+	IUFillSwitch(&TemperatureResolutionS[2], "TEMPERATURE_RESOLUTION_11", "11 bit", ISS_OFF);
+	IUFillSwitch(&TemperatureResolutionS[3], "TEMPERATURE_RESOLUTION_12", "12 bit", ISS_ON);
+	IUFillSwitchVector(&TemperatureResolutionSP, TemperatureResolutionS, 4, getDeviceName(), "TEMPERATURE_RESOLUTION", "Sensor Resolution", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Temperature sampling interval and oversampling with median
+	IUFillNumber(&TemperatureSamplingN[0], "TEMPERATURE_INTERVAL", "Interval (s)", "%0.0f", 1, 600, 1, 60);
+	IUFillNumber(&TemperatureSamplingN[1], "TEMPERATURE_OVERSAMPLING", "Median of", "%0.0f", 1, THERMOMETER_MAX_OVERSAMPLING, 2, 1);
+	IUFillNumberVector(&TemperatureSamplingNP, TemperatureSamplingN, 2, getDeviceName(), "TEMPERATURE_SAMPLING", "Temperature Sampling", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
 	// Temperature Coefficient
 	IUFillNumber(&TemperatureCoefN[0], "μm/m°C", "", "%.1f", 0, 50, 1, 0);
 	IUFillNumberVector(&TemperatureCoefNP, TemperatureCoefN, 1, getDeviceName(), "Temperature Coefficient", "", MAIN_CONTROL_TAB, IP_RW, 0, IPS_IDLE);
@@ -273,10 +626,99 @@ bool AstroberryFocuser::initProperties()
 	IUFillSwitch(&TemperatureCompensateS[1], "Disable", "", ISS_ON);
 	IUFillSwitchVector(&TemperatureCompensateSP, TemperatureCompensateS, 2, getDeviceName(), "Temperature Compensate", "", MAIN_CONTROL_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
 
+	// Temperature compensation model
+	IUFillSwitch(&CompensationModeS[0], "COMPENSATION_COEFFICIENT", "Coefficient", ISS_ON);
+	IUFillSwitch(&CompensationModeS[1], "COMPENSATION_LEARNED", "Learned", ISS_OFF);
+	IUFillSwitch(&CompensationModeS[2], "COMPENSATION_LEARNED_TIME", "Learned + Time", ISS_OFF);
+	IUFillSwitchVector(&CompensationModeSP, CompensationModeS, 3, getDeviceName(), "COMPENSATION_MODE", "Compensation", MAIN_CONTROL_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Least squares sums of the learned model, saved with the config
+	const char *statNames[AstroberryCompensation::STAT_COUNT] = { "N", "T", "H", "P", "TT", "HH", "TH", "TP", "HP" };
+	for (int i = 0; i < AstroberryCompensation::STAT_COUNT; i++)
+	{
+		char name[MAXINDINAME];
+		snprintf(name, MAXINDINAME, "COMPENSATION_SUM_%s", statNames[i]);
+		IUFillNumber(&CompensationModelN[i], name, statNames[i], "%g", -1e18, 1e18, 0, 0);
+	}
+	IUFillNumber(&CompensationModelN[AstroberryCompensation::STAT_COUNT], "COMPENSATION_NIGHT_START", "Night Start", "%0.0f", 0, 1e12, 0, 0);
+	IUFillNumberVector(&CompensationModelNP, CompensationModelN, AstroberryCompensation::STAT_COUNT + 1, getDeviceName(), "COMPENSATION_MODEL", "Compensation Model", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+	IUFillNumber(&CompensationInfoN[0], "COMPENSATION_SAMPLES", "Samples", "%0.1f", 0, 1000, 0, 0);
+	IUFillNumber(&CompensationInfoN[1], "COMPENSATION_SLOPE", "Steps/°C", "%0.2f", -1e6, 1e6, 0, 0);
+	IUFillNumber(&CompensationInfoN[2], "COMPENSATION_DRIFT", "Steps/hour", "%0.2f", -1e6, 1e6, 0, 0);
+	IUFillNumberVector(&CompensationInfoNP, CompensationInfoN, 3, getDeviceName(), "COMPENSATION_INFO", "Learned Model", MAIN_CONTROL_TAB, IP_RO, 0, IPS_IDLE);
+
+	IUFillSwitch(&CompensationResetS[0], "COMPENSATION_RESET", "Reset", ISS_OFF);
+	IUFillSwitchVector(&CompensationResetSP, CompensationResetS, 1, getDeviceName(), "COMPENSATION_MODEL_RESET", "Learned Model", OPTIONS_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
 	// Snooping params
 	IUFillNumber(&ScopeParametersN[0], "TELESCOPE_APERTURE", "Aperture (mm)", "%g", 10, 5000, 0, 0.0);
 	IUFillNumber(&ScopeParametersN[1], "TELESCOPE_FOCAL_LENGTH", "Focal Length (mm)", "%g", 10, 10000, 0, 0.0);
-	IUFillNumberVector(&ScopeParametersNP, ScopeParametersN, 2, ActiveTelescopeT[0].text, "TELESCOPE_INFO", "Scope Properties", OPTIONS_TAB, IP_RW, 60, IPS_OK);
+	IUFillNumberVector(&ScopeParametersNP, ScopeParametersN, 2, ActiveDeviceT[0].text, "TELESCOPE_INFO", "Scope Properties", OPTIONS_TAB, IP_RW, 60, IPS_OK);
+	IUFillNumber(&CcdExposureN[0], "CCD_EXPOSURE_VALUE", "Duration (s)", "%5.2f", 0, 36000, 0, 0);
+	IUFillNumberVector(&CcdExposureNP, CcdExposureN, 1, ActiveDeviceT[1].text, "CCD_EXPOSURE", "Expose", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+	IUFillNumber(&FilterSlotN[0], "FILTER_SLOT_VALUE", "Filter", "%3.0f", -1, 100, 1, -1); // -1 until a filter wheel reports
+	IUFillNumberVector(&FilterSlotNP, FilterSlotN, 1, ActiveDeviceT[2].text, "FILTER_SLOT", "Filter Slot", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+	IUFillNumber(&HorizontalCoordN[0], "AZ", "Az D:M:S", "%10.6m", 0, 360, 0, NAN);
+	IUFillNumber(&HorizontalCoordN[1], "ALT", "Alt D:M:S", "%10.6m", -90, 90, 0, NAN); // NAN until the mount reports
+	IUFillNumberVector(&HorizontalCoordNP, HorizontalCoordN, 2, ActiveDeviceT[0].text, "HORIZONTAL_COORD", "Horizontal Coord", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillBLOB(&CcdImageB[0], "CCD1", "Image", "");
+	IUFillBLOBVector(&CcdImageBP, CcdImageB, 1, ActiveDeviceT[1].text, "CCD1", "Image Data", MAIN_CONTROL_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Focus offsets per filter slot
+	IUFillSwitch(&FilterOffsetModeS[0], "FILTER_OFFSET_ENABLE", "Enable", ISS_OFF);
+	IUFillSwitch(&FilterOffsetModeS[1], "FILTER_OFFSET_DISABLE", "Disable", ISS_ON);
+	IUFillSwitchVector(&FilterOffsetModeSP, FilterOffsetModeS, 2, getDeviceName(), "FILTER_OFFSET_MODE", "Filter Offsets", FILTER_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+	for (int slot = 0; slot < FILTER_OFFSET_SLOTS; slot++)
+	{
+		char name[MAXINDINAME], label[MAXINDILABEL];
+		snprintf(name, sizeof(name), "FILTER_OFFSET_%d", slot + 1);
+		snprintf(label, sizeof(label), "Slot %d (steps)", slot + 1);
+		IUFillNumber(&FilterOffsetN[slot], name, label, "%0.0f", -10000, 10000, 10, 0);
+	}
+	IUFillNumberVector(&FilterOffsetNP, FilterOffsetN, FILTER_OFFSET_SLOTS, getDeviceName(), "FILTER_OFFSET", "Offsets", FILTER_TAB, IP_RW, 0, IPS_IDLE);
+
+	// Simulation
+	IUFillNumber(&SimulationModelN[0], "SIM_BACKLASH", "Backlash (steps)", "%0.0f", 0, 1000, 1, 0);
+	IUFillNumber(&SimulationModelN[1], "SIM_TEMPERATURE", "Temperature (°C)", "%0.2f", -50, 50, 1, 10);
+	IUFillNumber(&SimulationModelN[2], "SIM_TEMPERATURE_RATE", "Temperature change (°C/h)", "%0.2f", -10, 10, 0.1, -1);
+	IUFillNumber(&SimulationModelN[3], "SIM_STEP_LOSS", "Step loss (%)", "%0.0f", 0, 50, 1, 0);
+	IUFillNumberVector(&SimulationModelNP, SimulationModelN, 4, getDeviceName(), "SIMULATION_MODEL", "Simulated Focuser", DIAGNOSTICS_TAB, IP_RW, 0, IPS_IDLE);
+
+	IUFillNumber(&SimulationStatsN[0], "SIM_POSITION", "Drawtube (steps)", "%0.0f", -1e9, 1e9, 0, 0);
+	IUFillNumber(&SimulationStatsN[1], "SIM_POSITION_ERROR", "Position error (steps)", "%0.0f", -1e9, 1e9, 0, 0);
+	IUFillNumber(&SimulationStatsN[2], "SIM_STEPS", "Steps", "%0.0f", 0, 1e9, 0, 0);
+	IUFillNumber(&SimulationStatsN[3], "SIM_MISSED", "Steps asleep", "%0.0f", 0, 1e9, 0, 0);
+	IUFillNumber(&SimulationStatsN[4], "SIM_LATENCY", "Start latency (µs)", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&SimulationStatsN[5], "SIM_MIN_PERIOD", "Min step period (µs)", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&SimulationStatsN[6], "SIM_MAX_PERIOD", "Max step period (µs)", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&SimulationStatsN[7], "SIM_MEAN_PERIOD", "Mean step period (µs)", "%0.1f", 0, 1e9, 0, 0);
+	IUFillNumberVector(&SimulationStatsNP, SimulationStatsN, 8, getDeviceName(), "SIMULATION_STATS", "Last Move", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
+	// Autofocus
+	IUFillSwitch(&AutofocusS[0], "AUTOFOCUS_START", "Start", ISS_OFF);
+	IUFillSwitch(&AutofocusS[1], "AUTOFOCUS_ABORT", "Abort", ISS_OFF);
+	IUFillSwitchVector(&AutofocusSP, AutofocusS, 2, getDeviceName(), "AUTOFOCUS", "Autofocus", AUTOFOCUS_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+	IUFillNumber(&AutofocusSettingsN[0], "AUTOFOCUS_STEP", "Step size", "%0.0f", 1, 10000, 10, 50);
+	IUFillNumber(&AutofocusSettingsN[1], "AUTOFOCUS_POINTS", "Points", "%0.0f", 3, 21, 2, 7);
+	IUFillNumberVector(&AutofocusSettingsNP, AutofocusSettingsN, 2, getDeviceName(), "AUTOFOCUS_SETTINGS", "Sweep", AUTOFOCUS_TAB, IP_RW, 0, IPS_IDLE);
+
+	IUFillNumber(&AutofocusStatusN[0], "AUTOFOCUS_POINT", "Point", "%0.0f", 0, 100, 0, 0);
+	IUFillNumber(&AutofocusStatusN[1], "AUTOFOCUS_HFR", "HFR (px)", "%0.2f", 0, 100, 0, 0);
+	IUFillNumber(&AutofocusStatusN[2], "AUTOFOCUS_STARS", "Stars", "%0.0f", 0, 1000, 0, 0);
+	IUFillNumber(&AutofocusStatusN[3], "AUTOFOCUS_BEST", "Best position", "%0.0f", 0, MINMAX_MAX_POS * MAX_RESOLUTION, 0, 0);
+	IUFillNumberVector(&AutofocusStatusNP, AutofocusStatusN, 4, getDeviceName(), "AUTOFOCUS_STATUS", "Status", AUTOFOCUS_TAB, IP_RO, 0, IPS_IDLE);
+
+	// Focus history
+	IUFillSwitch(&FocusPredictS[0], "FOCUS_PREDICT_MOVE", "Predict", ISS_OFF);
+	IUFillSwitchVector(&FocusPredictSP, FocusPredictS, 1, getDeviceName(), "FOCUS_PREDICT", "Focus History", MAIN_CONTROL_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+	IUFillNumber(&FocusPredictionN[0], "PREDICTED_POSITION", "Position", "%0.0f", 0, MINMAX_MAX_POS * MAX_RESOLUTION, 0, 0);
+	IUFillNumber(&FocusPredictionN[1], "PREDICTION_MATCHES", "Matches", "%0.0f", 0, 100, 0, 0);
+	IUFillNumber(&FocusPredictionN[2], "HISTORY_RECORDS", "Records", "%0.0f", 0, 1e9, 0, 0);
+	IUFillNumberVector(&FocusPredictionNP, FocusPredictionN, 3, getDeviceName(), "FOCUS_PREDICTION", "Prediction", MAIN_CONTROL_TAB, IP_RO, 0, IPS_IDLE);
 
 	// initial values at resolution 1/1
 	FocusMaxPosN[0].min = MINMAX_MIN_POS; // 0
@@ -307,16 +749,24 @@ bool AstroberryFocuser::initProperties()
 	// Add default properties
 	// addAuxControls(); // enable simulation mode
 	addDebugControl ();
+	addSimulationControl();
 	addConfigurationControl();
 	removeProperty("POLLING_PERIOD", nullptr);
 
 	// Load some custom properties before connecting
 	defineSwitch(&MotorBoardSP);
 	defineNumber(&BCMpinsNP);
+	defineSwitch(&EncoderModeSP);
+	defineNumber(&EncoderPinsNP);
+	defineSwitch(&FocusResolutionSP);
 
 	// Load config values, which cannot be changed after we are connected
 	loadConfig(false, "MOTOR_BOARD"); // load stepper motor controller
 	loadConfig(false, "BCMPINS"); // load BCM Pins assignment
+	loadConfig(false, "ENCODER_MODE"); // load encoder mode
+	loadConfig(false, "ENCODER_PINS"); // load encoder BCM Pins assignment
+	loadConfig(false, "FOCUS_RESOLUTION"); // load focuser resolution
+	resolution = 1 << IUFindOnSwitchIndex(&FocusResolutionSP);
 
 	return true;
 }
@@ -335,34 +785,120 @@ bool AstroberryFocuser::updateProperties()
 	{
 		defineSwitch(&StepperStandbySP);
 		defineNumber(&StepperStandbyTimeNP);
-		defineText(&ActiveTelescopeTP);
+		defineSwitch(&AdaptiveMoveSP);
+		defineNumber(&AdaptiveApproachNP);
+		defineSwitch(&BacklashModeSP);
+		defineNumber(&OvershootNP);
+		defineSwitch(&BacklashCalibrationSP);
+		defineNumber(&BacklashCalibrationSettingsNP);
+		defineNumber(&BacklashCalibrationStatusNP);
+		defineNumber(&EncoderSettingsNP);
+		defineSwitch(&EncoderMountSP);
+		defineText(&ActiveDeviceTP);
+		defineSwitch(&FilterOffsetModeSP);
+		defineNumber(&FilterOffsetNP);
 		defineNumber(&FocuserTravelNP);
 		defineNumber(&FocuserInfoNP);
-		defineNumber(&FocusStepDelayNP);
-
-		IDSnoopDevice(ActiveTelescopeT[0].text, "TELESCOPE_INFO");
+		defineNumber(&FocusMotionProfileNP);
+		defineNumber(&FocusMoveDurationNP);
+		defineNumber(&PositionUpdateRateNP);
+		defineNumber(&PositionUpdateStatsNP);
+		defineSwitch(&JournalSyncSP);
+		defineNumber(&JournalCheckpointNP);
+		defineNumber(&DryRunNP);
+		defineSwitch(&ScheduleDumpSP);
+		defineNumber(&StepTimingNP);
+		defineSwitch(&StepTimingDumpSP);
+		if (encoder.isRunning())
+			defineNumber(&EncoderStatusNP);
+		defineSwitch(&TelemetryDumpSP);
+		defineSwitch(&FocusPredictSP);
+		defineNumber(&FocusPredictionNP);
+		defineSwitch(&AutofocusSP);
+		defineNumber(&AutofocusSettingsNP);
+		defineNumber(&AutofocusStatusNP);
+		if (isSimulation())
+		{
+			defineNumber(&SimulationModelNP);
+			defineNumber(&SimulationStatsNP);
+		}
 
-		if (readDS18B20())
+		IDSnoopDevice(ActiveDeviceT[0].text, "TELESCOPE_INFO");
+		IDSnoopDevice(ActiveDeviceT[0].text, "HORIZONTAL_COORD");
+		IDSnoopDevice(ActiveDeviceT[1].text, "CCD_EXPOSURE");
+		IDSnoopDevice(ActiveDeviceT[2].text, "FILTER_SLOT");
+		filterOffsetSlot = -1; // next slot reported is where offsets count from
+
+		// temperature properties are defined with the first reading
+		temperatureDefined = false;
+		temperatureSensorsVersion = 0;
+		defineSwitch(&TemperatureResolutionSP);
+		defineNumber(&TemperatureSamplingNP);
+		defineNumber(&CompensationModelNP);
+		defineSwitch(&CompensationResetSP);
+
+		// one sensor thread per bus for all channels, a channel joining later takes its resolution
+		thermometer = &AstroberryThermometer::shared(isSimulation() ? simulator.getDevicesPath() : THERMOMETER_W1_DEVICES);
+		if (!thermometer->isRunning())
+			thermometer->setResolution(9 + IUFindOnSwitchIndex(&TemperatureResolutionSP));
+		thermometerFd = thermometer->subscribe(getTemperatureInterval(), TemperatureSamplingN[1].value);
+		if (thermometerFd >= 0)
 		{
-			defineNumber(&FocusTemperatureNP);
-			defineNumber(&TemperatureCoefNP);
-			defineSwitch(&TemperatureCompensateSP);
-			readDS18B20(); // update immediately
-			lastTemperature = FocusTemperatureN[0].value; // init last temperature
-			IERmTimer(updateTemperatureID);
-			updateTemperatureID = IEAddTimer(TEMPERATURE_UPDATE_TIMEOUT, updateTemperatureHelper, this); // set temperature update timer
-			IERmTimer(temperatureCompensationID);
-			temperatureCompensationID = IEAddTimer(TEMPERATURE_COMPENSATION_TIMEOUT, temperatureCompensationHelper, this); // set temperature compensation timer
+			syncTemperatureResolution();
+			updateTemperatureID = IEAddCallback(thermometerFd, updateTemperatureHelper, this);
+			if (!thermometer->isAvailable())
+			{
+				DEBUG(INDI::Logger::DBG_WARNING, "Temperature sensor not available.");
+			}
+		} else {
+			DEBUG(INDI::Logger::DBG_WARNING, "Temperature sensor disabled. 1-Wire interface is not available.");
 		}
 
 	} else {
 		deleteProperty(StepperStandbySP.name);
 		deleteProperty(StepperStandbyTimeNP.name);
-		deleteProperty(ActiveTelescopeTP.name);
+		deleteProperty(AdaptiveMoveSP.name);
+		deleteProperty(AdaptiveApproachNP.name);
+		deleteProperty(BacklashModeSP.name);
+		deleteProperty(OvershootNP.name);
+		deleteProperty(BacklashCalibrationSP.name);
+		deleteProperty(BacklashCalibrationSettingsNP.name);
+		deleteProperty(BacklashCalibrationStatusNP.name);
+		deleteProperty(EncoderSettingsNP.name);
+		deleteProperty(EncoderMountSP.name);
+		deleteProperty(ActiveDeviceTP.name);
+		deleteProperty(FilterOffsetModeSP.name);
+		deleteProperty(FilterOffsetNP.name);
 		deleteProperty(FocuserTravelNP.name);
 		deleteProperty(FocuserInfoNP.name);
-		deleteProperty(FocusStepDelayNP.name);
+		deleteProperty(FocusMotionProfileNP.name);
+		deleteProperty(FocusMoveDurationNP.name);
+		deleteProperty(PositionUpdateRateNP.name);
+		deleteProperty(PositionUpdateStatsNP.name);
+		deleteProperty(JournalSyncSP.name);
+		deleteProperty(JournalCheckpointNP.name);
+		deleteProperty(DryRunNP.name);
+		deleteProperty(ScheduleDumpSP.name);
+		deleteProperty(StepTimingNP.name);
+		deleteProperty(StepTimingDumpSP.name);
+		deleteProperty(EncoderStatusNP.name);
+		deleteProperty(TelemetryDumpSP.name);
+		deleteProperty(FocusPredictSP.name);
+		deleteProperty(FocusPredictionNP.name);
+		deleteProperty(AutofocusSP.name);
+		deleteProperty(AutofocusSettingsNP.name);
+		deleteProperty(AutofocusStatusNP.name);
+		deleteProperty(SimulationModelNP.name);
+		deleteProperty(SimulationStatsNP.name);
 		deleteProperty(FocusTemperatureNP.name);
+		deleteProperty(TemperatureSensorsNP.name);
+		deleteProperty(TemperatureSourceSP.name);
+		deleteProperty(TemperatureResolutionSP.name);
+		deleteProperty(CompensationModelNP.name);
+		deleteProperty(CompensationResetSP.name);
+		deleteProperty(CompensationModeSP.name);
+		deleteProperty(CompensationInfoNP.name);
+		deleteProperty(TemperatureSamplingNP.name);
 		deleteProperty(TemperatureCoefNP.name);
 		deleteProperty(TemperatureCompensateSP.name);
 	}
@@ -396,6 +932,15 @@ bool AstroberryFocuser::ISNewNumber (const char *dev, const char *name, double v
 						return false;
 					}
 
+					// a fitted encoder reads its own pins
+					if ( EncoderModeS[0].s != ISS_ON && (values[i] == EncoderPinsN[0].value || values[i] == EncoderPinsN[1].value) )
+					{
+						BCMpinsNP.s=IPS_ALERT;
+						IDSetNumber(&BCMpinsNP, nullptr);
+						DEBUGF(INDI::Logger::DBG_ERROR, "BCM Pin %0.0f is read by the encoder!", values[i]);
+						return false;
+					}
+
 					// Verify unique BCM Pin assignement
 					for (unsigned j = i + 1; j < valcount; j++)
 					{
@@ -407,37 +952,90 @@ bool AstroberryFocuser::ISNewNumber (const char *dev, const char *name, double v
 							return false;
 						}
 					}
+				}
 
-					// verify BCM Pins are not used by other consumers
-					chip = gpiod_chip_open("/dev/gpiochip0");
-					if (chip)
+				// verify BCM Pins are not used by other consumers, there is nothing to check in simulation
+				if (!isSimulation())
+				{
+					AstroberryGpioChip &gpio = AstroberryGpiodChip::shared();
+					if (!gpio.open())
 					{
-						struct gpiod_line *line = gpiod_chip_get_line(chip, values[i]);
-						bool line_status = gpiod_line_is_used(line);
-						gpiod_chip_close(chip);
+						DEBUG(INDI::Logger::DBG_ERROR, "Problem initiating Astroberry Focuser.");
+						return false;
+					}
 
-						if (line_status)
+					for (unsigned int i = 0; i < valcount; i++)
+					{
+						if (gpio.isUsed(values[i]))
 						{
+							gpio.close();
 							BCMpinsNP.s=IPS_ALERT;
 							IDSetNumber(&BCMpinsNP, nullptr);
 							DEBUGF(INDI::Logger::DBG_ERROR, "BCM Pin %0.0f already used!", values[i]);
 							return false;
 						}
-					} else {
-						DEBUG(INDI::Logger::DBG_ERROR, "Problem initiating Astroberry Focuser.");
-						return false;
 					}
+					gpio.close();
 				}
 
 				IUUpdateNumber(&BCMpinsNP,values,names,n);
 
 				BCMpinsNP.s=IPS_OK;
 				IDSetNumber(&BCMpinsNP, nullptr);
-				DEBUGF(INDI::Logger::DBG_SESSION, "BCM Pins set to DIR: BCM%0.0f, STEP: BCM%0.0f, SLEEP: BCM%0.0f, M1: BCM%0.0f, M2: BCM%0.0f, M3: BCM%0.0f", BCMpinsN[0].value, BCMpinsN[1].value, BCMpinsN[2].value, BCMpinsN[3].value, BCMpinsN[4].value, BCMpinsN[5].value);
+				DEBUGF(INDI::Logger::DBG_SESSION, "BCM Pins set to DIR: BCM%0.0f, STEP: BCM%0.0f, SLEEP: BCM%0.0f, M0: BCM%0.0f, M1: BCM%0.0f, M2: BCM%0.0f", BCMpinsN[0].value, BCMpinsN[1].value, BCMpinsN[2].value, BCMpinsN[3].value, BCMpinsN[4].value, BCMpinsN[5].value);
 				return true;
 			}
 		}
 
+		// handle encoder pins
+		if (!strcmp(name, EncoderPinsNP.name))
+		{
+			if (isConnected())
+			{
+				DEBUG(INDI::Logger::DBG_WARNING, "Cannot set encoder BCM Pins while device is connected.");
+				return false;
+			}
+
+			for (int i = 0; i < n; i++)
+			{
+				// verify a number is a valid BCM Pin, not driving the motor already
+				bool taken = values[i] == values[1 - i] && n == 2;
+				for (int pin = 0; pin < 6; pin++)
+					taken = taken || values[i] == BCMpinsN[pin].value;
+				if ( values[i] < 1 || values[i] > 27 || taken )
+				{
+					EncoderPinsNP.s=IPS_ALERT;
+					IDSetNumber(&EncoderPinsNP, nullptr);
+					DEBUGF(INDI::Logger::DBG_ERROR, "Value %0.0f is not a free BCM Pin number!", values[i]);
+					return false;
+				}
+			}
+
+			IUUpdateNumber(&EncoderPinsNP,values,names,n);
+			EncoderPinsNP.s=IPS_OK;
+			IDSetNumber(&EncoderPinsNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Encoder BCM Pins set to A: BCM%0.0f, B: BCM%0.0f", EncoderPinsN[0].value, EncoderPinsN[1].value);
+			return true;
+		}
+
+		// handle encoder resolution & closed loop limits
+		if (!strcmp(name, EncoderSettingsNP.name))
+		{
+			IUUpdateNumber(&EncoderSettingsNP,values,names,n);
+
+			// counts taken so far were at the old resolution
+			if (!stepper.isMoving())
+			{
+				if (isSimulation() && encoder.isRunning())
+					simulator.setEncoder(EncoderPinsN[0].value, EncoderPinsN[1].value, EncoderSettingsN[0].value, EncoderMountS[1].s == ISS_ON);
+				resetEncoder();
+			}
+			EncoderSettingsNP.s=IPS_OK;
+			IDSetNumber(&EncoderSettingsNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Encoder set to %0.0f counts per full step, step loss alert at %0.0f steps, up to %0.0f corrections.", EncoderSettingsN[0].value, EncoderSettingsN[1].value, EncoderSettingsN[2].value);
+			return true;
+		}
+
 		// handle stepper standby delay
 		if (!strcmp(name, StepperStandbyTimeNP.name))
 		{
@@ -455,6 +1053,107 @@ bool AstroberryFocuser::ISNewNumber (const char *dev, const char *name, double v
 			getFocuserInfo();
 		}
 
+		// handle simulated focuser
+		if (!strcmp(name, SimulationModelNP.name))
+		{
+			IUUpdateNumber(&SimulationModelNP,values,names,n);
+			updateSimulationModel();
+			SimulationModelNP.s=IPS_OK;
+			IDSetNumber(&SimulationModelNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Simulated backlash %0.0f steps, %0.0f%% steps lost, temperature %0.2f°C changing by %0.2f°C/h.", SimulationModelN[0].value, SimulationModelN[3].value, SimulationModelN[1].value, SimulationModelN[2].value);
+			return true;
+		}
+
+		// handle backlash calibration pattern
+		if (!strcmp(name, BacklashCalibrationSettingsNP.name))
+		{
+			IUUpdateNumber(&BacklashCalibrationSettingsNP,values,names,n);
+			BacklashCalibrationSettingsNP.s=IPS_OK;
+			IDSetNumber(&BacklashCalibrationSettingsNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Backlash calibration runs %0.0f cycles of %0.0f steps, %0.0f steps out of focus with frames.", BacklashCalibrationSettingsN[1].value, BacklashCalibrationSettingsN[0].value, BacklashCalibrationSettingsN[2].value);
+			return true;
+		}
+
+		// handle autofocus sweep
+		if (!strcmp(name, AutofocusSettingsNP.name))
+		{
+			IUUpdateNumber(&AutofocusSettingsNP,values,names,n);
+			AutofocusSettingsNP.s=IPS_OK;
+			IDSetNumber(&AutofocusSettingsNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Autofocus sweeps %0.0f points %0.0f steps apart.", AutofocusSettingsN[1].value, AutofocusSettingsN[0].value);
+			return true;
+		}
+
+		// handle adaptive move final approach
+		if (!strcmp(name, AdaptiveApproachNP.name))
+		{
+			IUUpdateNumber(&AdaptiveApproachNP,values,names,n);
+			if (!updateResolution())
+			{
+				AdaptiveApproachNP.s=IPS_ALERT;
+				IDSetNumber(&AdaptiveApproachNP, nullptr);
+				return false;
+			}
+			AdaptiveApproachNP.s=IPS_OK;
+			IDSetNumber(&AdaptiveApproachNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Final approach set to %0.0f full steps.", AdaptiveApproachN[0].value);
+			return true;
+		}
+
+		// handle overshoot
+		if (!strcmp(name, OvershootNP.name))
+		{
+			IUUpdateNumber(&OvershootNP,values,names,n);
+			OvershootNP.s=IPS_OK;
+			IDSetNumber(&OvershootNP, nullptr);
+			if (OvershootN[0].value < FocusBacklashN[0].value)
+				DEBUGF(INDI::Logger::DBG_WARNING, "Overshoot is shorter than backlash, %0.0f steps are used instead.", FocusBacklashN[0].value);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Overshoot set to %0.0f steps.", OvershootN[0].value);
+			return true;
+		}
+
+		// handle filter offsets
+		if (!strcmp(name, FilterOffsetNP.name))
+		{
+			IUUpdateNumber(&FilterOffsetNP,values,names,n);
+			FilterOffsetNP.s=IPS_OK;
+			IDSetNumber(&FilterOffsetNP, nullptr);
+			DEBUG(INDI::Logger::DBG_SESSION, "Filter offsets updated.");
+			return true;
+		}
+
+		// handle learned compensation model loaded from config
+		if (!strcmp(name, CompensationModelNP.name))
+		{
+			IUUpdateNumber(&CompensationModelNP,values,names,n);
+			double stats[AstroberryCompensation::STAT_COUNT];
+			for (int i = 0; i < AstroberryCompensation::STAT_COUNT; i++)
+				stats[i] = CompensationModelN[i].value;
+			compensationModel.setStatistics(stats);
+			updateCompensationModel();
+			return true;
+		}
+
+		// handle temperature sampling
+		if (!strcmp(name, TemperatureSamplingNP.name))
+		{
+			IUUpdateNumber(&TemperatureSamplingNP,values,names,n);
+			if (thermometerFd >= 0)
+				thermometer->setSampling(thermometerFd, getTemperatureInterval(), TemperatureSamplingN[1].value);
+
+			// compensate as often as we sample
+			if (temperatureCompensationID >= 0)
+			{
+				IERmTimer(temperatureCompensationID);
+				temperatureCompensationID = IEAddTimer(getTemperatureInterval(), temperatureCompensationHelper, this);
+			}
+
+			TemperatureSamplingNP.s=IPS_OK;
+			IDSetNumber(&TemperatureSamplingNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Temperature sampled every %0.0f seconds, median of %0.0f readings.", TemperatureSamplingN[0].value, TemperatureSamplingN[1].value);
+			return true;
+		}
+
 		// handle focuser travel
 		if (!strcmp(name, FocuserTravelNP.name))
 		{
@@ -466,15 +1165,83 @@ bool AstroberryFocuser::ISNewNumber (const char *dev, const char *name, double v
 			return true;
 		}
 
-		// handle focus step delay
-		if (!strcmp(name, FocusStepDelayNP.name))
+		// handle focus motion profile
+		if (!strcmp(name, FocusMotionProfileNP.name))
+		{
+			INumber *startSpeed = IUFindNumber(&FocusMotionProfileNP, "FOCUS_START_SPEED");
+			INumber *maxSpeed = IUFindNumber(&FocusMotionProfileNP, "FOCUS_MAX_SPEED");
+			double start = startSpeed->value, max = maxSpeed->value;
+
+			for (int i = 0; i < n; i++)
+			{
+				if (!strcmp(names[i], startSpeed->name))
+					start = values[i];
+				if (!strcmp(names[i], maxSpeed->name))
+					max = values[i];
+			}
+
+			if (start > max)
+			{
+				FocusMotionProfileNP.s=IPS_ALERT;
+				IDSetNumber(&FocusMotionProfileNP, nullptr);
+				DEBUG(INDI::Logger::DBG_ERROR, "Start speed cannot be higher than max speed!");
+				return false;
+			}
+
+			IUUpdateNumber(&FocusMotionProfileNP,values,names,n);
+			FocusMotionProfileNP.s=IPS_OK;
+			IDSetNumber(&FocusMotionProfileNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Motion profile set to start speed %0.0f steps/s, max speed %0.0f steps/s, acceleration %0.0f steps/s².", FocusMotionProfileN[0].value, FocusMotionProfileN[1].value, FocusMotionProfileN[2].value);
+			return true;
+		}
+
+		// handle position update rate
+		if (!strcmp(name, PositionUpdateRateNP.name))
+		{
+			IUUpdateNumber(&PositionUpdateRateNP,values,names,n);
+			PositionUpdateRateNP.s=IPS_OK;
+			IDSetNumber(&PositionUpdateRateNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Position update rate set to %0.0f Hz.", PositionUpdateRateN[0].value);
+			return true;
+		}
+
+		// handle journal checkpoint interval
+		if (!strcmp(name, JournalCheckpointNP.name))
+		{
+			IUUpdateNumber(&JournalCheckpointNP,values,names,n);
+			JournalCheckpointNP.s=IPS_OK;
+			IDSetNumber(&JournalCheckpointNP, nullptr);
+			if (JournalCheckpointN[0].value > 0)
+			{
+				DEBUGF(INDI::Logger::DBG_SESSION, "Position checkpoints every %0.1f seconds while moving.", JournalCheckpointN[0].value);
+			} else {
+				DEBUG(INDI::Logger::DBG_SESSION, "Position checkpoints disabled.");
+			}
+			return true;
+		}
+
+		// handle dry run
+		if (!strcmp(name, DryRunNP.name))
 		{
-			IUUpdateNumber(&FocusStepDelayNP,values,names,n);
-			FocusStepDelayNP.s=IPS_BUSY;
-			IDSetNumber(&FocusStepDelayNP, nullptr);
-			FocusStepDelayNP.s=IPS_OK;
-			IDSetNumber(&FocusStepDelayNP, nullptr);
-			DEBUGF(INDI::Logger::DBG_SESSION, "Step delay set to %0.0f ms.", FocusStepDelayN[0].value);
+			IUUpdateNumber(&DryRunNP,values,names,n);
+
+			int dryRunTarget = (int) DryRunN[0].value;
+			int position = stepper.getPosition() / getPositionScale();
+			int backlashTicks = 0;
+			if (FocusBacklashS[INDI_ENABLED].s == ISS_ON && BacklashModeS[0].s == ISS_ON)
+				backlashTicks = stepper.getBacklash(dryRunTarget * getPositionScale(), FocusBacklashN[0].value);
+
+			updateApproach();
+			AstroberrySchedule dryRun;
+			dryRun.setResolution(stepper.getSchedule().getResolution());
+			planner.setProfile(FocusMotionProfileN[0].value, FocusMotionProfileN[1].value, FocusMotionProfileN[2].value);
+			dryRun.compile(position * getPositionScale(), dryRunTarget * getPositionScale(), backlashTicks, FocusReverseS[INDI_ENABLED].s == ISS_ON, planner, 0, true,
+				stepper.getOvershoot(position * getPositionScale(), dryRunTarget * getPositionScale()));
+			dumpSchedule(dryRun);
+
+			DryRunNP.s=IPS_OK;
+			IDSetNumber(&DryRunNP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Dry run from %d to %d: %zu events, %d backlash steps, %d steps (%d coarse, %d overshoot), %0.3f seconds.", position, dryRunTarget, dryRun.size(), dryRun.getBacklash(), dryRun.getSteps(), dryRun.getCoarseSteps(), dryRun.getOvershoot(), dryRun.duration() / 1e9);
 			return true;
 		}
 
@@ -522,12 +1289,72 @@ bool AstroberryFocuser::ISNewSwitch (const char *dev, const char *name, ISState
 					DEBUG(INDI::Logger::DBG_SESSION, "Control Board set to A4988.");
 				}
 
+				if ( MotorBoardS[2].s == ISS_ON)
+				{
+					DEBUG(INDI::Logger::DBG_SESSION, "Control Board set to DRV8825.");
+				}
+
 				MotorBoardSP.s = IPS_OK;
 				IDSetSwitch(&MotorBoardSP, nullptr);
 				return true;
 			}
 		}
 
+		// handle focuser resolution
+		if(!strcmp(name, FocusResolutionSP.name))
+		{
+			int current_switch = IUFindOnSwitchIndex(&FocusResolutionSP);
+
+			if (isConnected())
+			{
+				// reset switch to previous state
+				IUResetSwitch(&FocusResolutionSP);
+				FocusResolutionS[current_switch].s = ISS_ON;
+				IDSetSwitch(&FocusResolutionSP, nullptr);
+				DEBUG(INDI::Logger::DBG_WARNING, "Cannot set Resolution while device is connected.");
+				return false;
+			}
+
+			IUUpdateSwitch(&FocusResolutionSP, states, names, n);
+			resolution = 1 << IUFindOnSwitchIndex(&FocusResolutionSP);
+			FocusResolutionSP.s = IPS_OK;
+			IDSetSwitch(&FocusResolutionSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Resolution set to 1/%d step.", resolution);
+			return true;
+		}
+
+		// handle adaptive moves
+		if(!strcmp(name, AdaptiveMoveSP.name))
+		{
+			int current_switch = IUFindOnSwitchIndex(&AdaptiveMoveSP);
+			IUUpdateSwitch(&AdaptiveMoveSP, states, names, n);
+
+			if (!updateResolution())
+			{
+				// reset switch to previous state
+				IUResetSwitch(&AdaptiveMoveSP);
+				AdaptiveMoveS[current_switch].s = ISS_ON;
+				AdaptiveMoveSP.s = IPS_ALERT;
+				IDSetSwitch(&AdaptiveMoveSP, nullptr);
+				return false;
+			}
+
+			AdaptiveMoveSP.s = AdaptiveMoveS[0].s == ISS_ON ? IPS_IDLE : IPS_OK;
+			IDSetSwitch(&AdaptiveMoveSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Adaptive move set to %s.", IUFindOnSwitch(&AdaptiveMoveSP)->label);
+			return true;
+		}
+
+		// handle backlash mode
+		if(!strcmp(name, BacklashModeSP.name))
+		{
+			IUUpdateSwitch(&BacklashModeSP, states, names, n);
+			BacklashModeSP.s = BacklashModeS[0].s == ISS_ON ? IPS_IDLE : IPS_OK;
+			IDSetSwitch(&BacklashModeSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Backlash mode set to %s.", IUFindOnSwitch(&BacklashModeSP)->label);
+			return true;
+		}
+
 		// handle stepper standby
 		if(!strcmp(name, StepperStandbySP.name))
 		{
@@ -549,158 +1376,572 @@ bool AstroberryFocuser::ISNewSwitch (const char *dev, const char *name, ISState
 			return true;
 		}
 
-		// handle temperature compensation
-		if(!strcmp(name, TemperatureCompensateSP.name))
+		// handle schedule dump
+		if(!strcmp(name, ScheduleDumpSP.name))
 		{
-			IUUpdateSwitch(&TemperatureCompensateSP, states, names, n);
+			IUUpdateSwitch(&ScheduleDumpSP, states, names, n);
 
-			if ( TemperatureCompensateS[0].s == ISS_ON)
+			if ( ScheduleDumpS[0].s == ISS_ON)
 			{
-				if (!temperatureCompensationID)
-					temperatureCompensationID = IEAddTimer(TEMPERATURE_COMPENSATION_TIMEOUT, temperatureCompensationHelper, this);
-				TemperatureCompensateSP.s = IPS_OK;
-				DEBUG(INDI::Logger::DBG_SESSION, "Temperature compensation enabled.");
+				ScheduleDumpSP.s = IPS_OK;
+				DEBUG(INDI::Logger::DBG_SESSION, "Step schedule dump enabled.");
 			}
 
-			if ( TemperatureCompensateS[1].s == ISS_ON)
+			if ( ScheduleDumpS[1].s == ISS_ON)
 			{
-				IERmTimer(temperatureCompensationID);
-				TemperatureCompensateSP.s = IPS_IDLE;
-				DEBUG(INDI::Logger::DBG_SESSION, "Temperature compensation disabled.");
+				ScheduleDumpSP.s = IPS_IDLE;
+				DEBUG(INDI::Logger::DBG_SESSION, "Step schedule dump disabled.");
 			}
 
-			IDSetSwitch(&TemperatureCompensateSP, nullptr);
+			IDSetSwitch(&ScheduleDumpSP, nullptr);
 			return true;
 		}
-	}
 
-	return INDI::Focuser::ISNewSwitch(dev,name,states,names,n);
-}
+		// handle position journal sync
+		if(!strcmp(name, JournalSyncSP.name))
+		{
+			IUUpdateSwitch(&JournalSyncSP, states, names, n);
+			journal.setSyncPolicy(IUFindOnSwitchIndex(&JournalSyncSP));
+			JournalSyncSP.s = IPS_OK;
+			IDSetSwitch(&JournalSyncSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Position journal sync set to %s.", IUFindOnSwitch(&JournalSyncSP)->label);
+			return true;
+		}
 
-bool AstroberryFocuser::ISNewText (const char *dev, const char *name, char *texts[], char *names[], int n)
-{
-	// first we check if it's for our device
-	if (!strcmp(dev, getDeviceName()))
-	{
-		// handle active devices
-		if (!strcmp(name, ActiveTelescopeTP.name))
+		// handle step timing dump
+		if(!strcmp(name, StepTimingDumpSP.name))
 		{
-			IUUpdateText(&ActiveTelescopeTP,texts,names,n);
+			IUUpdateSwitch(&StepTimingDumpSP, states, names, n);
+
+			if ( StepTimingDumpS[0].s == ISS_ON)
+			{
+				StepTimingDumpSP.s = IPS_OK;
+				DEBUG(INDI::Logger::DBG_SESSION, "Step timing dump enabled.");
+			}
 
-			IUFillNumberVector(&ScopeParametersNP, ScopeParametersN, 2, ActiveTelescopeT[0].text, "TELESCOPE_INFO", "Scope Properties", OPTIONS_TAB, IP_RW, 60, IPS_OK);
-			IDSnoopDevice(ActiveTelescopeT[0].text, "TELESCOPE_INFO");
+			if ( StepTimingDumpS[1].s == ISS_ON)
+			{
+				StepTimingDumpSP.s = IPS_IDLE;
+				DEBUG(INDI::Logger::DBG_SESSION, "Step timing dump disabled.");
+			}
 
-			ActiveTelescopeTP.s=IPS_OK;
-			IDSetText(&ActiveTelescopeTP, nullptr);
-			DEBUGF(INDI::Logger::DBG_SESSION, "Active telescope set to %s.", ActiveTelescopeT[0].text);
+			stepper.setTimingSamples(StepTimingDumpS[0].s == ISS_ON);
+			IDSetSwitch(&StepTimingDumpSP, nullptr);
 			return true;
 		}
-	}
 
-	return INDI::Focuser::ISNewText(dev,name,texts,names,n);
-}
+		// handle temperature sensor resolution
+		if(!strcmp(name, TemperatureResolutionSP.name))
+		{
+			IUUpdateSwitch(&TemperatureResolutionSP, states, names, n);
+			TemperatureResolutionSP.s = IPS_BUSY; // until set on the sensors
+			IDSetSwitch(&TemperatureResolutionSP, nullptr);
+			if (thermometerFd < 0)
+				return true;
 
-bool AstroberryFocuser::ISSnoopDevice (XMLEle *root)
-{
-	if (IUSnoopNumber(root, &ScopeParametersNP) == 0)
-	{
-		getFocuserInfo();
-		DEBUGF(INDI::Logger::DBG_DEBUG, "Telescope parameters: %0.0f, %0.0f.", ScopeParametersN[0].value, ScopeParametersN[1].value);
-		return true;
-	}
+			// sensors are shared, the other channels follow in their next reading
+			thermometer->setResolution(9 + IUFindOnSwitchIndex(&TemperatureResolutionSP));
+			DEBUGF(INDI::Logger::DBG_SESSION, "Temperature sensor resolution set to %s, conversion takes %d ms.", IUFindOnSwitch(&TemperatureResolutionSP)->label, thermometer->getConversionTime());
+			return true;
+		}
 
-	return INDI::Focuser::ISSnoopDevice(root);
-}
+		// handle temperature compensation source
+		if(!strcmp(name, TemperatureSourceSP.name))
+		{
+			IUUpdateSwitch(&TemperatureSourceSP, states, names, n);
+			int source = IUFindOnSwitchIndex(&TemperatureSourceSP);
 
-bool AstroberryFocuser::saveConfigItems(FILE *fp)
-{
-	IUSaveConfigSwitch(fp, &MotorBoardSP);
-	IUSaveConfigNumber(fp, &BCMpinsNP);
-	IUSaveConfigSwitch(fp, &StepperStandbySP);
-	IUSaveConfigNumber(fp, &StepperStandbyTimeNP);
+			// do not compensate the step between two sensors
+			if (!isnan(TemperatureSensorsN[source].value))
+			{
+				FocusTemperatureN[0].value = TemperatureSensorsN[source].value;
+				lastTemperature = FocusTemperatureN[0].value;
+				IDSetNumber(&FocusTemperatureNP, nullptr);
+			}
+
+			TemperatureSourceSP.s = IPS_OK;
+			IDSetSwitch(&TemperatureSourceSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Temperature compensation source set to %s.", TemperatureSourceS[source].label);
+			return true;
+		}
+
+		// handle compensation mode
+		if(!strcmp(name, CompensationModeSP.name))
+		{
+			IUUpdateSwitch(&CompensationModeSP, states, names, n);
+			updateCompensationModel();
+			CompensationModeSP.s = IPS_OK;
+			IDSetSwitch(&CompensationModeSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Temperature compensation uses %s model.", IUFindOnSwitch(&CompensationModeSP)->label);
+			return true;
+		}
+
+		// handle autofocus
+		if(!strcmp(name, AutofocusSP.name))
+		{
+			IUUpdateSwitch(&AutofocusSP, states, names, n);
+			if (AutofocusS[0].s == ISS_ON)
+				startAutofocus();
+			else if (AutofocusS[1].s == ISS_ON && autofocus.isRunning())
+				stopAutofocus(IPS_IDLE);
+			IUResetSwitch(&AutofocusSP);
+			IDSetSwitch(&AutofocusSP, nullptr);
+			return true;
+		}
+
+		// handle backlash calibration
+		if(!strcmp(name, BacklashCalibrationSP.name))
+		{
+			IUUpdateSwitch(&BacklashCalibrationSP, states, names, n);
+			if (BacklashCalibrationS[0].s == ISS_ON)
+				startCalibration();
+			else if (BacklashCalibrationS[1].s == ISS_ON && calibration.isRunning())
+				stopCalibration(IPS_IDLE);
+			IUResetSwitch(&BacklashCalibrationSP);
+			IDSetSwitch(&BacklashCalibrationSP, nullptr);
+			return true;
+		}
+
+		// handle encoder mount, the reference the encoder is compared against
+		if(!strcmp(name, EncoderMountSP.name))
+		{
+			IUUpdateSwitch(&EncoderMountSP, states, names, n);
+			if (!stepper.isMoving())
+			{
+				if (isSimulation() && encoder.isRunning())
+					simulator.setEncoder(EncoderPinsN[0].value, EncoderPinsN[1].value, EncoderSettingsN[0].value, EncoderMountS[1].s == ISS_ON);
+				resetEncoder();
+			}
+			EncoderMountSP.s = IPS_OK;
+			IDSetSwitch(&EncoderMountSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Encoder is mounted on the %s.", EncoderMountS[1].s == ISS_ON ? "drawtube" : "motor shaft");
+			return true;
+		}
+
+		// handle focus prediction
+		if(!strcmp(name, FocusPredictSP.name))
+		{
+			FocusPredictS[0].s = ISS_OFF;
+			predictPosition();
+			IDSetSwitch(&FocusPredictSP, nullptr);
+			return true;
+		}
+
+		// dump recent motion history
+		if(!strcmp(name, TelemetryDumpSP.name))
+		{
+			char fileName[MAXRBUF];
+			getFileName(fileName, "telemetry.csv");
+			AstroberryTelemetry &telemetry = stepper.getTelemetry();
+			telemetry.drain();
+			TelemetryDumpS[0].s = ISS_OFF;
+			TelemetryDumpSP.s = telemetry.dump(fileName) ? IPS_OK : IPS_ALERT;
+			IDSetSwitch(&TelemetryDumpSP, nullptr);
+			if (TelemetryDumpSP.s == IPS_OK)
+				DEBUGF(INDI::Logger::DBG_SESSION, "Motion history of %zu records saved to %s, %lu records dropped.", telemetry.getHistorySize(), fileName, telemetry.getDropped());
+			else
+				DEBUGF(INDI::Logger::DBG_WARNING, "Cannot save motion history to %s.", fileName);
+			return true;
+		}
+
+		// handle compensation model reset
+		if(!strcmp(name, CompensationResetSP.name))
+		{
+			compensationModel.reset();
+			CompensationModelN[AstroberryCompensation::STAT_COUNT].value = 0;
+			updateCompensationModel();
+			saveConfig(true, CompensationModelNP.name);
+			CompensationResetS[0].s = ISS_OFF;
+			CompensationResetSP.s = IPS_OK;
+			IDSetSwitch(&CompensationResetSP, nullptr);
+			DEBUG(INDI::Logger::DBG_SESSION, "Learned temperature compensation model reset.");
+			return true;
+		}
+
+		// handle temperature compensation
+		if(!strcmp(name, TemperatureCompensateSP.name))
+		{
+			IUUpdateSwitch(&TemperatureCompensateSP, states, names, n);
+
+			if ( TemperatureCompensateS[0].s == ISS_ON)
+			{
+				// the timer runs from the first reading on, it also watches the sensor
+				if (temperatureCompensationID < 0 && temperatureDefined)
+					temperatureCompensationID = IEAddTimer(getTemperatureInterval(), temperatureCompensationHelper, this);
+				TemperatureCompensateSP.s = IPS_OK;
+				DEBUG(INDI::Logger::DBG_SESSION, "Temperature compensation enabled.");
+			}
+
+			if ( TemperatureCompensateS[1].s == ISS_ON)
+			{
+				TemperatureCompensateSP.s = IPS_IDLE;
+				DEBUG(INDI::Logger::DBG_SESSION, "Temperature compensation disabled.");
+			}
+
+			IDSetSwitch(&TemperatureCompensateSP, nullptr);
+			return true;
+		}
+
+		// handle encoder mode, the encoder lines are requested on connect
+		if(!strcmp(name, EncoderModeSP.name))
+		{
+			int current_switch = IUFindOnSwitchIndex(&EncoderModeSP);
+			IUUpdateSwitch(&EncoderModeSP, states, names, n);
+
+			if (isConnected() && (EncoderModeS[0].s == ISS_ON) != (current_switch == 0))
+			{
+				// reset switch to previous state
+				IUResetSwitch(&EncoderModeSP);
+				EncoderModeS[current_switch].s = ISS_ON;
+				IDSetSwitch(&EncoderModeSP, nullptr);
+				DEBUG(INDI::Logger::DBG_WARNING, "Cannot fit or remove the encoder while device is connected.");
+				return false;
+			}
+
+			encoderCorrections = 0;
+			EncoderModeSP.s = EncoderModeS[0].s == ISS_ON ? IPS_IDLE : IPS_OK;
+			IDSetSwitch(&EncoderModeSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Encoder mode set to %s.", IUFindOnSwitch(&EncoderModeSP)->label);
+			return true;
+		}
+
+		// handle filter offsets
+		if(!strcmp(name, FilterOffsetModeSP.name))
+		{
+			IUUpdateSwitch(&FilterOffsetModeSP, states, names, n);
+			FilterOffsetModeSP.s = FilterOffsetModeS[0].s == ISS_ON ? IPS_OK : IPS_IDLE;
+			IDSetSwitch(&FilterOffsetModeSP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Filter offsets %s.", FilterOffsetModeS[0].s == ISS_ON ? "enabled" : "disabled");
+			return true;
+		}
+	}
+
+	return INDI::Focuser::ISNewSwitch(dev,name,states,names,n);
+}
+
+bool AstroberryFocuser::ISNewText (const char *dev, const char *name, char *texts[], char *names[], int n)
+{
+	// first we check if it's for our device
+	if (!strcmp(dev, getDeviceName()))
+	{
+		// handle active devices
+		if (!strcmp(name, ActiveDeviceTP.name))
+		{
+			// autofocus snoops frames of the previous CCD
+			if (autofocus.isRunning())
+				stopAutofocus(IPS_ALERT);
+			if (calibration.isRunning() && !calibrationByEncoder)
+				stopCalibration(IPS_ALERT);
+
+			IUUpdateText(&ActiveDeviceTP,texts,names,n);
+
+			IUFillNumberVector(&ScopeParametersNP, ScopeParametersN, 2, ActiveDeviceT[0].text, "TELESCOPE_INFO", "Scope Properties", OPTIONS_TAB, IP_RW, 60, IPS_OK);
+			IDSnoopDevice(ActiveDeviceT[0].text, "TELESCOPE_INFO");
+			IUFillNumberVector(&CcdExposureNP, CcdExposureN, 1, ActiveDeviceT[1].text, "CCD_EXPOSURE", "Expose", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+			IDSnoopDevice(ActiveDeviceT[1].text, "CCD_EXPOSURE");
+			IUFillBLOBVector(&CcdImageBP, CcdImageB, 1, ActiveDeviceT[1].text, "CCD1", "Image Data", MAIN_CONTROL_TAB, IP_RO, 60, IPS_IDLE);
+			IUFillNumberVector(&HorizontalCoordNP, HorizontalCoordN, 2, ActiveDeviceT[0].text, "HORIZONTAL_COORD", "Horizontal Coord", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+			IDSnoopDevice(ActiveDeviceT[0].text, "HORIZONTAL_COORD");
+			IUFillNumberVector(&FilterSlotNP, FilterSlotN, 1, ActiveDeviceT[2].text, "FILTER_SLOT", "Filter Slot", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+			IDSnoopDevice(ActiveDeviceT[2].text, "FILTER_SLOT");
+			filterOffsetSlot = -1;
+
+			ActiveDeviceTP.s=IPS_OK;
+			IDSetText(&ActiveDeviceTP, nullptr);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Active telescope set to %s, active CCD set to %s, active filter wheel set to %s.", ActiveDeviceT[0].text, ActiveDeviceT[1].text, ActiveDeviceT[2].text);
+			return true;
+		}
+	}
+
+	return INDI::Focuser::ISNewText(dev,name,texts,names,n);
+}
+
+bool AstroberryFocuser::ISSnoopDevice (XMLEle *root)
+{
+	if (IUSnoopNumber(root, &ScopeParametersNP) == 0)
+	{
+		getFocuserInfo();
+		DEBUGF(INDI::Logger::DBG_DEBUG, "Telescope parameters: %0.0f, %0.0f.", ScopeParametersN[0].value, ScopeParametersN[1].value);
+		return true;
+	}
+
+	if (IUSnoopNumber(root, &HorizontalCoordNP) == 0)
+		return true;
+
+	if (IUSnoopNumber(root, &FilterSlotNP) == 0)
+	{
+		DEBUGF(INDI::Logger::DBG_DEBUG, "Filter slot: %0.0f.", FilterSlotN[0].value);
+		applyFilterOffset();
+		return true;
+	}
+
+	if (IUSnoopBLOB(root, &CcdImageBP) == 0)
+	{
+		if (calibration.isRunning())
+			calibrationFrame();
+		else
+			autofocusFrame();
+		return true;
+	}
+
+	IPState exposureState = CcdExposureNP.s;
+	if (IUSnoopNumber(root, &CcdExposureNP) == 0)
+	{
+		lastExposureUpdate = time(nullptr);
+
+		// only frames exposed at rest on a sweep position are measured
+		if (exposureState != IPS_BUSY && CcdExposureNP.s == IPS_BUSY)
+			frameExposure = isMeasuring() && !stepper.isMoving();
+
+		// exposure done - apply compensation held back in one move before the next one starts
+		if (exposureState == IPS_BUSY && CcdExposureNP.s != IPS_BUSY && deferredCompensation != 0 && !stepper.isMoving() && !isMeasuring())
+		{
+			DEBUGF(INDI::Logger::DBG_SESSION, "Exposure done, applying deferred temperature compensation of %d steps.", deferredCompensation);
+			moveCompensation(deferredCompensation);
+			deferredCompensation = 0;
+		}
+		return true;
+	}
+
+	return INDI::Focuser::ISSnoopDevice(root);
+}
+
+bool AstroberryFocuser::saveConfigItems(FILE *fp)
+{
+	IUSaveConfigSwitch(fp, &MotorBoardSP);
+	IUSaveConfigNumber(fp, &BCMpinsNP);
+	IUSaveConfigSwitch(fp, &EncoderModeSP);
+	IUSaveConfigNumber(fp, &EncoderPinsNP);
+	IUSaveConfigNumber(fp, &EncoderSettingsNP);
+	IUSaveConfigSwitch(fp, &EncoderMountSP);
+	IUSaveConfigSwitch(fp, &FocusResolutionSP);
+	IUSaveConfigSwitch(fp, &AdaptiveMoveSP);
+	IUSaveConfigNumber(fp, &AdaptiveApproachNP);
+	IUSaveConfigSwitch(fp, &StepperStandbySP);
+	IUSaveConfigNumber(fp, &StepperStandbyTimeNP);
 	IUSaveConfigSwitch(fp, &FocusReverseSP);
 	IUSaveConfigNumber(fp, &FocusMaxPosNP);
 	IUSaveConfigSwitch(fp, &FocusBacklashSP);
 	IUSaveConfigNumber(fp, &FocusBacklashNP);
-	IUSaveConfigNumber(fp, &FocusStepDelayNP);
+	IUSaveConfigSwitch(fp, &BacklashModeSP);
+	IUSaveConfigNumber(fp, &OvershootNP);
+	IUSaveConfigNumber(fp, &BacklashCalibrationSettingsNP);
+	IUSaveConfigNumber(fp, &FocusMotionProfileNP);
+	IUSaveConfigNumber(fp, &PositionUpdateRateNP);
+	IUSaveConfigSwitch(fp, &JournalSyncSP);
+	IUSaveConfigNumber(fp, &JournalCheckpointNP);
 	IUSaveConfigNumber(fp, &FocuserTravelNP);
 	IUSaveConfigSwitch(fp, &TemperatureCompensateSP);
+	IUSaveConfigSwitch(fp, &TemperatureSourceSP);
+	IUSaveConfigSwitch(fp, &CompensationModeSP);
+	IUSaveConfigNumber(fp, &CompensationModelNP);
+	IUSaveConfigSwitch(fp, &TemperatureResolutionSP);
+	IUSaveConfigNumber(fp, &TemperatureSamplingNP);
 	IUSaveConfigNumber(fp, &TemperatureCoefNP);
-	IUSaveConfigText(fp, &ActiveTelescopeTP);
+	IUSaveConfigText(fp, &ActiveDeviceTP);
+	IUSaveConfigSwitch(fp, &FilterOffsetModeSP);
+	IUSaveConfigNumber(fp, &FilterOffsetNP);
+	IUSaveConfigNumber(fp, &AutofocusSettingsNP);
+	IUSaveConfigNumber(fp, &SimulationModelNP);
 	IUSaveConfigNumber(fp, &PresetNP);
 	return true;
 }
 
 void AstroberryFocuser::TimerHit()
 {
-	if (backlashTicksRemaining == 0 && focuserTicksRemaining == 0)
+	if (!stepper.isMoving())
+		return;
+
+	// update absolute position while moving, coalesced to the update rate
+	AstroberryTelemetryRecord last;
+	if (stepper.getTelemetry().drain(&last) > 0)
+		publishPosition(last.position);
+	updateMoveDuration();
+
+	// journal a checkpoint, so a long move survives power loss
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - lastCheckpoint.tv_sec) + (now.tv_nsec - lastCheckpoint.tv_nsec) / 1e9;
+	if (JournalCheckpointN[0].value > 0 && elapsed >= JournalCheckpointN[0].value)
 	{
-		//save position to file
-		savePosition((int) FocusAbsPosN[0].value); // always save at MAX_RESOLUTION
+		savePosition(stepper.getPosition(), false);
+		lastCheckpoint = now;
+	}
+
+	SetTimer(1000 / PositionUpdateRateN[0].value);
+}
+
+void AstroberryFocuser::updateMoveDuration()
+{
+	// a retarget replanned the move, it now ends with the new schedule
+	if (stepper.getReplans() == moveReplans)
+		return;
 
-		// update abspos value and status
-		FocusAbsPosNP.s = IPS_OK;
-		IDSetNumber(&FocusAbsPosNP, nullptr);
-		FocusRelPosNP.s = IPS_OK;
-		IDSetNumber(&FocusRelPosNP, nullptr);
-		DEBUGF(INDI::Logger::DBG_SESSION, "Focuser at the position %0.0f.", FocusAbsPosN[0].value);
+	moveReplans = stepper.getReplans();
+	uint64_t start = (uint64_t) moveStart.tv_sec * 1000000000ULL + moveStart.tv_nsec;
+	FocusMoveDurationN[0].value = stepper.getPlannedEnd() > start ? (stepper.getPlannedEnd() - start) / 1e9 : 0;
+	FocusMoveDurationNP.s = IPS_OK;
+	IDSetNumber(&FocusMoveDurationNP, nullptr);
+}
 
-		// reset last temperature
-		lastTemperature = FocusTemperatureN[0].value; // register last temperature
+void AstroberryFocuser::publishPosition(int motorPosition, bool force)
+{
+	int position = motorPosition / getPositionScale();
+	int stepsDone = abs(position - (int) FocusAbsPosN[0].value);
 
-		// set motor standby timer
-		if ( StepperStandbyS[0].s == ISS_ON)
-		{
-			if (stepperStandbyID)
-				IERmTimer(stepperStandbyID);
-			stepperStandbyID = IEAddTimer(StepperStandbyTimeN[0].value * 1000, stepperStandbyHelper, this);
-			DEBUGF(INDI::Logger::DBG_SESSION, "Focuser going standby in %d seconds", (int) IERemainingTimer(stepperStandbyID) /  1000);
-		}
+	if (stepsDone == 0 && !force)
 		return;
-	}
 
-	// handle reverse motion
-	if (stepperDirection == 1)
+	// every step not sent on its own counts as a suppressed update
+	positionUpdatesSent++;
+	if (stepsDone > 1)
+		positionUpdatesSuppressed += stepsDone - 1;
+
+	FocusAbsPosN[0].value = position;
+	IDSetNumber(&FocusAbsPosNP, nullptr);
+}
+
+void AstroberryFocuser::resetEncoder()
+{
+	// the encoder counts from where its reference is now, motor shaft or drawtube
+	encoderOrigin = encoder.getCount();
+	encoderPositionOrigin = getEncoderReference();
+}
+
+int AstroberryFocuser::getEncoderPosition()
+{
+	// reverse motion turns the motor the other way
+	int sign = FocusReverseS[INDI_ENABLED].s == ISS_ON ? -1 : 1;
+	return encoderPositionOrigin + lround(sign * (double) (encoder.getCount() - encoderOrigin) * MAX_RESOLUTION / EncoderSettingsN[0].value);
+}
+
+IPState AstroberryFocuser::reconcileEncoder()
+{
+	// backlash take-up turns the shaft without moving the focuser position
+	int position = stepper.getPosition();
+	int lost = getEncoderPosition() - getEncoderReference();
+	int encoderPosition = position + lost;
+	int deviation = lost / getPositionScale();
+	unsigned long wakeups = encoder.getWakeups();
+
+	EncoderStatusN[0].value = encoder.getCount();
+	EncoderStatusN[1].value = encoderPosition / getPositionScale();
+	EncoderStatusN[2].value = deviation;
+	EncoderStatusN[3].value = encoder.getErrors();
+	EncoderStatusN[4].value = wakeups > 0 ? (double) encoder.getEdges() / wakeups : 0;
+	EncoderStatusNP.s = abs(deviation) >= EncoderSettingsN[1].value ? IPS_ALERT : IPS_OK;
+	IDSetNumber(&EncoderStatusNP, nullptr);
+
+	if (EncoderStatusNP.s != IPS_ALERT)
+		return IPS_OK;
+
+	DEBUGF(INDI::Logger::DBG_WARNING, "Step loss detected, encoder is %d steps off the focuser position %d.", deviation, position / getPositionScale());
+	if (EncoderModeS[2].s != ISS_ON)
+		return IPS_OK;
+
+	if (encoderCorrections >= EncoderSettingsN[2].value)
 	{
-		// outward
-		if (FocusReverseS[INDI_ENABLED].s == ISS_ON) {
-			gpiod_line_set_value(gpio_dir, 0); // Reverse Motion
-		} else {
-			gpiod_line_set_value(gpio_dir, 1); // Normal Motion
-		}
-	} else {
-		// inward
-		if (FocusReverseS[INDI_ENABLED].s == ISS_ON) {
-			gpiod_line_set_value(gpio_dir, 1); // Reverse Motion
-		} else {
-			gpiod_line_set_value(gpio_dir, 0); // Normal Motion
-		}
+		DEBUGF(INDI::Logger::DBG_ERROR, "Focuser did not reach position %d after %d corrections.", stepper.getTarget() / getPositionScale(), encoderCorrections);
+		return IPS_ALERT;
 	}
 
-	bool isBacklash = false;
-	if (backlashTicksRemaining > 0)
+	// take the encoder position as the true one and move to the target again
+	int target = stepper.getTarget() / getPositionScale();
+	stepper.setPosition(encoderPosition / getPositionScale() * getPositionScale());
+	resetEncoder();
+	encoderCorrections++;
+	DEBUGF(INDI::Logger::DBG_SESSION, "Correcting position, move %d of %0.0f.", encoderCorrections, EncoderSettingsN[2].value);
+
+	// the correction belongs to whoever issued the move
+	correctionPending = true;
+	compensationPending = compensationMove;
+	autofocusPending = autofocus.isRunning();
+	IPState state = MoveAbsFocuser(target);
+	if (state == IPS_BUSY)
+		return state;
+
+	// already there or out of range, the move is done as it is
+	correctionPending = false;
+	return state == IPS_ALERT ? IPS_ALERT : IPS_OK;
+}
+
+void AstroberryFocuser::stepperDone()
+{
+	stepper.clearNotify();
+
+	// a new move may have been started already
+	stepper.getTelemetry().drain();
+	if (stepper.isMoving())
+		return;
+
+	// the encoder tells where the motor went, closed loop moves again to make up for lost steps
+	IPState encoderState = encoder.isRunning() && !calibration.isRunning() ? reconcileEncoder() : IPS_OK;
+	if (encoderState == IPS_BUSY)
+		return;
+
+	//save position to file
+	savePosition(stepper.getPosition()); // always save at MAX_RESOLUTION
+
+	// update abspos value and status - final position is always sent immediately
+	FocusAbsPosNP.s = encoderState;
+	publishPosition(stepper.getPosition(), true);
+	updateMoveDuration();
+	if (FocusMoveDurationNP.s == IPS_BUSY)
 	{
-		isBacklash = true;
+		FocusMoveDurationNP.s = IPS_OK; // retargeted to where the move stopped
+		IDSetNumber(&FocusMoveDurationNP, nullptr);
 	}
+	FocusRelPosNP.s = IPS_OK;
+	IDSetNumber(&FocusRelPosNP, nullptr);
+	DEBUGF(INDI::Logger::DBG_SESSION, "Focuser at the position %0.0f.", FocusAbsPosN[0].value);
+
+	// dump executed schedule for offline timing analysis
+	if ( ScheduleDumpS[0].s == ISS_ON )
+		dumpSchedule(stepper.getSchedule());
 
-	// make a single step
-	stepMotor();
+	updateStepTiming();
 
-	// update absolute position only if processing real steps not backlash
-	if (isBacklash)
+	if (isSimulation())
+		updateSimulationStats();
+
+	// update position updates statistics
+	PositionUpdateStatsN[0].value = positionUpdatesSent;
+	PositionUpdateStatsN[1].value = positionUpdatesSuppressed;
+	PositionUpdateStatsNP.s = IPS_OK;
+	IDSetNumber(&PositionUpdateStatsNP, nullptr);
+	DEBUGF(INDI::Logger::DBG_DEBUG, "Position updates sent: %lu, suppressed: %lu.", positionUpdatesSent, positionUpdatesSuppressed);
+
+	// reset last temperature
+	lastTemperature = FocusTemperatureN[0].value; // register last temperature
+	lastCompensationHours = getCompensationHours();
+
+	// learn from positions a client settled on, compensation moves are our own prediction
+	if (!compensationMove && !isMeasuring())
 	{
-		backlashTicksRemaining -= 1;
-	}  else {
-		focuserTicksRemaining -= 1;
-		FocusAbsPosN[0].value += 1 * stepperDirection;
-		IDSetNumber(&FocusAbsPosNP, nullptr);
+		deferredCompensation = 0; // focus was set by the client from now on
+		IERmTimer(focusSettledID);
+		focusSettledID = IEAddTimer(FOCUS_SETTLE_TIMEOUT, focusSettledHelper, this);
 	}
 
-	SetTimer(FocusStepDelayN[0].value);
+	// set motor standby timer
+	if ( StepperStandbyS[0].s == ISS_ON)
+	{
+		if (stepperStandbyID)
+			IERmTimer(stepperStandbyID);
+		stepperStandbyID = IEAddTimer(StepperStandbyTimeN[0].value * 1000, stepperStandbyHelper, this);
+		DEBUGF(INDI::Logger::DBG_SESSION, "Focuser going standby in %d seconds", (int) IERemainingTimer(stepperStandbyID) /  1000);
+	}
+
+	// the encoder is read where the move ends, frames are waited for except on the preload
+	if (calibration.isRunning() && (calibrationByEncoder || calibration.isPreload()))
+		calibrationSample(calibrationByEncoder ? (double) getEncoderPosition() / getPositionScale() : NAN);
 }
 
 bool AstroberryFocuser::ReverseFocuser(bool enabled)
 {
+	// the encoder turns the other way from here on
+	resetEncoder();
+
 	if (enabled)
 	{
 		DEBUG(INDI::Logger::DBG_SESSION, "Reverse direction enabled.");
@@ -712,7 +1953,15 @@ bool AstroberryFocuser::ReverseFocuser(bool enabled)
 
 bool AstroberryFocuser::SyncFocuser(uint32_t ticks)
 {
-	savePosition((int) ticks); // always save at MAX_RESOLUTION
+	if (stepper.isMoving())
+	{
+		DEBUG(INDI::Logger::DBG_WARNING, "Cannot sync while focuser is moving.");
+		return false;
+	}
+
+	stepper.setPosition((int) ticks * getPositionScale());
+	savePosition((int) ticks * getPositionScale()); // always save at MAX_RESOLUTION
+	resetEncoder();
 	DEBUGF(INDI::Logger::DBG_SESSION, "Focuser absolute position sync to %d", ticks);
     return true;
 }
@@ -725,27 +1974,80 @@ bool AstroberryFocuser::SetFocuserBacklash(int32_t steps)
 
 bool AstroberryFocuser::AbortFocuser()
 {
-	backlashTicksRemaining = 0;
-	focuserTicksRemaining = 0;
+	stepper.abort();
+	if (autofocus.isRunning())
+		stopAutofocus(IPS_IDLE);
+	if (calibration.isRunning())
+		stopCalibration(IPS_IDLE);
 	DEBUG(INDI::Logger::DBG_SESSION, "Focuser motion aborted.");
 	return true;
 }
 
 IPState AstroberryFocuser::MoveAbsFocuser(uint32_t targetTicks)
 {
-	if (backlashTicksRemaining > 0 || focuserTicksRemaining > 0)
+	if (targetTicks < FocusAbsPosN[0].min || targetTicks > FocusAbsPosN[0].max)
+	{
+		DEBUG(INDI::Logger::DBG_WARNING, "Requested position is out of range.");
+		return IPS_ALERT;
+	}
+
+	// a client moving the focuser did not settle yet
+	IERmTimer(focusSettledID);
+	focusSettledID = -1;
+	compensationMove = compensationPending;
+	compensationPending = false;
+
+	// closed loop corrections count against the target they are made for
+	if (!correctionPending)
+		encoderCorrections = 0;
+	correctionPending = false;
+
+	// a client moving the focuser takes over from autofocus
+	if (autofocus.isRunning() && !autofocusPending)
+	{
+		DEBUG(INDI::Logger::DBG_WARNING, "Focuser moved by a client, autofocus aborted.");
+		stopAutofocus(IPS_ALERT);
+	}
+	autofocusPending = false;
+	if (calibration.isRunning() && !calibrationPending)
+	{
+		DEBUG(INDI::Logger::DBG_WARNING, "Focuser moved by a client, backlash calibration aborted.");
+		stopCalibration(IPS_ALERT);
+	}
+	frameExposure = false;
+
+	// update the running move in place, the stepper reverses with backlash if needed
+	int backlashTicks = FocusBacklashS[INDI_ENABLED].s == ISS_ON && BacklashModeS[0].s == ISS_ON ? FocusBacklashN[0].value : 0;
+	updateApproach();
+
+	// calibration measures the bare lost motion, without compensation or overshoot
+	if (calibrationPending)
+	{
+		backlashTicks = 0;
+		stepper.setApproach(0, 0, 0, 0);
+	}
+	calibrationPending = false;
+	if (stepper.isMoving() && stepper.retarget((int) targetTicks * getPositionScale(), backlashTicks))
 	{
-		DEBUG(INDI::Logger::DBG_WARNING, "Focuser movement still in progress.");
+		DEBUGF(INDI::Logger::DBG_SESSION, "Focuser is moving to new position %d.", targetTicks);
+
+		// the stepper thread replans between two steps, the new duration follows then
+		FocusMoveDurationNP.s = IPS_BUSY;
+		IDSetNumber(&FocusMoveDurationNP, nullptr);
 		return IPS_BUSY;
 	}
 
-	if (targetTicks < FocusAbsPosN[0].min || targetTicks > FocusAbsPosN[0].max)
+	// an abort cannot be retargeted, the motor has to come to rest first
+	if (stepper.isMoving())
 	{
-		DEBUG(INDI::Logger::DBG_WARNING, "Requested position is out of range.");
+		DEBUGF(INDI::Logger::DBG_WARNING, "Focuser is stopping, move to position %d not started.", targetTicks);
 		return IPS_ALERT;
 	}
 
-	if (targetTicks == FocusAbsPosN[0].value)
+	// the last move may have finished before its completion was handled
+	int position = stepper.getPosition() / getPositionScale();
+
+	if ((int) targetTicks == position)
 	{
 		DEBUG(INDI::Logger::DBG_SESSION, "Already at the requested position.");
 		return IPS_OK;
@@ -758,180 +2060,239 @@ IPState AstroberryFocuser::MoveAbsFocuser(uint32_t targetTicks)
 	IDSetNumber(&FocusRelPosNP, nullptr);
 
 	// motor wake up
-	if ( gpiod_line_get_value(gpio_sleep) == 1 )
+	IERmTimer(stepperStandbyID);
+	if ( stepper.isStandby() )
 	{
-		IERmTimer(stepperStandbyID);
-		gpiod_line_set_value(gpio_sleep, 0);
 		DEBUG(INDI::Logger::DBG_SESSION, "Stepper motor waking up.");
 	}
 
 	// set direction
-	const char* directionName;
-	int newDirection;
-	if (targetTicks > FocusAbsPosN[0].value)
-	{
-		newDirection = 1;
-		directionName = "outward";
-	} else {
-		newDirection = -1;
-		directionName = "inward";
-	}
+	const char* directionName = (int) targetTicks > position ? "outward" : "inward";
 
 	// if direction changed do backlash adjustment
-	if (newDirection != stepperDirection && FocusBacklashN[0].value != 0  && FocusBacklashS[INDI_ENABLED].s == ISS_ON)
+	backlashTicks = stepper.getBacklash((int) targetTicks * getPositionScale(), backlashTicks);
+	if (backlashTicks != 0)
 	{
-		DEBUGF(INDI::Logger::DBG_SESSION, "Compensating backlash by %0.0f steps.", FocusBacklashN[0].value);
-		backlashTicksRemaining = FocusBacklashN[0].value;
-	} else {
-		backlashTicksRemaining = 0;
+		DEBUGF(INDI::Logger::DBG_SESSION, "Compensating backlash by %d steps.", backlashTicks);
 	}
 
-	// update last stepper direction
-	stepperDirection = newDirection;
+	// an overshoot comes back the other way
+	int overshootTicks = stepper.getOvershoot(position * getPositionScale(), (int) targetTicks * getPositionScale());
+	if (overshootTicks > 0)
+		DEBUGF(INDI::Logger::DBG_SESSION, "Overshooting target by %d steps.", overshootTicks);
+
+	// plan acceleration, cruise and deceleration
+	planner.setProfile(FocusMotionProfileN[0].value, FocusMotionProfileN[1].value, FocusMotionProfileN[2].value);
 
-	// process targetTicks
-	focuserTicksRemaining = abs(targetTicks - FocusAbsPosN[0].value);
+	// statistics of the virtual motor cover this move
+	if (isSimulation())
+	{
+		simulator.beginMove();
+		simulationMoveStart[0] = stepper.getPosition();
+		simulationMoveStart[1] = simulator.getDrawtubePosition();
+	}
+
+	// hand the move over to the stepper thread, which compiles the step schedule
+	if (!stepper.move((int) targetTicks * getPositionScale(), backlashTicks, FocusReverseS[INDI_ENABLED].s == ISS_ON, planner))
+	{
+		DEBUG(INDI::Logger::DBG_ERROR, "Stepper thread is not running.");
+		return IPS_ALERT;
+	}
 	DEBUGF(INDI::Logger::DBG_SESSION, "Focuser is moving %s to position %d.", directionName, targetTicks);
+	clock_gettime(CLOCK_MONOTONIC, &lastCheckpoint);
+
+	// predicted move duration
+	moveStart = lastCheckpoint;
+	moveReplans = stepper.getReplans();
+	FocusMoveDurationN[0].value = stepper.getSchedule().duration() / 1e9;
+	FocusMoveDurationNP.s = IPS_OK;
+	IDSetNumber(&FocusMoveDurationNP, nullptr);
 
-	SetTimer(FocusStepDelayN[0].value);
+	SetTimer(1000 / PositionUpdateRateN[0].value);
 
 	return IPS_BUSY;
 }
 
 IPState AstroberryFocuser::MoveRelFocuser(FocusDirection dir, uint32_t ticks)
 {
-	uint32_t targetTicks = (uint32_t) FocusAbsPosN[0].value + (ticks * (dir == FOCUS_INWARD ? -1 : 1));
+	// relative to the target of a running move, so repeated requests add up
+	int position = stepper.isMoving() ? stepper.getTarget() / getPositionScale() : FocusAbsPosN[0].value;
+	uint32_t targetTicks = (uint32_t) position + (ticks * (dir == FOCUS_INWARD ? -1 : 1));
 	return MoveAbsFocuser(targetTicks);
 }
 
-void AstroberryFocuser::stepMotor()
+void AstroberryFocuser::updateApproach()
 {
-	// step on
-	gpiod_line_set_value(gpio_step, 1);
-	// wait
-	msleep(FocusStepDelayN[0].value);
-	// step off
-	gpiod_line_set_value(gpio_step, 0);
+	int direction = 0;
+	if (BacklashModeS[1].s == ISS_ON)
+		direction = 1;
+	else if (BacklashModeS[2].s == ISS_ON)
+		direction = -1;
+
+	// overshoot must at least take up the backlash
+	int overshootTicks = std::max(OvershootN[0].value, FocusBacklashN[0].value);
+	stepper.setApproach(direction, overshootTicks, 0, FocusAbsPosN[0].max * getPositionScale());
 }
 
-int AstroberryFocuser::savePosition(int pos)
+bool AstroberryFocuser::updateResolution()
 {
-	FILE * pFile;
-	char posFileName[MAXRBUF];
-	char buf [100];
+	AstroberryResolution res;
+	int board = IUFindOnSwitchIndex(&MotorBoardSP);
+	int coarse = AdaptiveMoveS[1].s == ISS_ON ? 1 : AdaptiveMoveS[2].s == ISS_ON ? 2 : 0;
 
-	if (getenv("INDICONFIG"))
-	{
-		snprintf(posFileName, MAXRBUF, "%s.position", getenv("INDICONFIG"));
-	} else {
-		snprintf(posFileName, MAXRBUF, "%s/.indi/%s.position", getenv("HOME"), getDeviceName());
-	}
+	res.fineStep = getPositionScale();
+	res.approach = AdaptiveApproachN[0].value * resolution;
+	AstroberryStepper::getModePins(board, resolution, res.fineMode);
 
-
-	if (pos == -1)
+	// slew with coarse steps only if coarser than selected resolution
+	if (coarse > 0 && coarse < resolution)
 	{
-		pFile = fopen (posFileName,"r");
-		if (pFile == NULL)
+		if (!AstroberryStepper::getModePins(board, coarse, res.coarseMode))
 		{
-			DEBUGF(INDI::Logger::DBG_ERROR, "Failed to open file %s.", posFileName);
-			return -1;
+			DEBUGF(INDI::Logger::DBG_ERROR, "Resolution 1/%d is not supported by %s.", coarse, IUFindOnSwitch(&MotorBoardSP)->label);
+			return false;
 		}
+		res.coarseStep = MAX_RESOLUTION / coarse;
+	}
 
-		fgets (buf , 100, pFile);
-		pos = atoi (buf);
-		DEBUGF(INDI::Logger::DBG_DEBUG, "Reading position %d from %s.", pos, posFileName);
-	} else {
-		pFile = fopen (posFileName,"w");
-		if (pFile == NULL)
-		{
-			DEBUGF(INDI::Logger::DBG_ERROR, "Failed to open file %s.", posFileName);
-			return -1;
-		}
+	if (!stepper.setResolution(res))
+	{
+		DEBUG(INDI::Logger::DBG_WARNING, "Cannot change resolution while focuser is moving.");
+		return false;
+	}
+
+	return true;
+}
 
-		sprintf(buf, "%d", pos);
-		fputs (buf, pFile);
-		DEBUGF(INDI::Logger::DBG_DEBUG, "Writing position %s to %s.", buf, posFileName);
+void AstroberryFocuser::getFileName(char *fileName, const char *extension)
+{
+	if (getenv("INDICONFIG") && channel > 0)
+	{
+		snprintf(fileName, MAXRBUF, "%s.%d.%s", getenv("INDICONFIG"), channel + 1, extension);
+	} else if (getenv("INDICONFIG")) {
+		snprintf(fileName, MAXRBUF, "%s.%s", getenv("INDICONFIG"), extension);
+	} else {
+		snprintf(fileName, MAXRBUF, "%s/.indi/%s.%s", getenv("HOME"), getDeviceName(), extension);
 	}
+}
 
-	fclose (pFile);
+void AstroberryFocuser::updateStepTiming()
+{
+	const AstroberryStepTiming &timing = stepper.getTiming();
+
+	StepTimingN[0].value = timing.getCount();
+	StepTimingN[1].value = timing.getLatency();
+	StepTimingN[2].value = timing.getPercentile(50);
+	StepTimingN[3].value = timing.getPercentile(99);
+	StepTimingN[4].value = timing.getMax();
+	StepTimingN[5].value = timing.getMissed();
+	StepTimingNP.s = timing.getMissed() > 0 ? IPS_ALERT : IPS_OK;
+	IDSetNumber(&StepTimingNP, nullptr);
+	DEBUGF(INDI::Logger::DBG_DEBUG, "Step timing: %zu edges, first step after %0.0f us, lateness p50 %0.1f us, p99 %0.1f us, max %0.1f us, %zu missed deadlines.",
+		timing.getCount(), StepTimingN[1].value, StepTimingN[2].value, StepTimingN[3].value, StepTimingN[4].value, timing.getMissed());
+
+	// raw samples for offline analysis
+	if (StepTimingDumpS[0].s == ISS_ON)
+	{
+		char timingFileName[MAXRBUF];
+		getFileName(timingFileName, "timing.csv");
 
-	return pos;
+		if (!timing.dump(timingFileName))
+			DEBUGF(INDI::Logger::DBG_ERROR, "Failed to open file %s.", timingFileName);
+		else
+			DEBUGF(INDI::Logger::DBG_DEBUG, "Step timing written to %s.", timingFileName);
+	}
 }
 
-bool AstroberryFocuser::readDS18B20()
+void AstroberryFocuser::dumpSchedule(const AstroberrySchedule &schedule)
 {
-	DIR *dir;
-	struct dirent *dirent;
-	char dev[16];      // Dev ID
-	char devPath[128]; // Path to device
-	char buf[256]; // Data from device
-	char temperatureData[6]; // Temp C * 1000 reported by device
-	char path[] = "/sys/bus/w1/devices";
-	ssize_t numRead;
-	float tempC, tempF;
+	char scheduleFileName[MAXRBUF];
+	getFileName(scheduleFileName, "schedule.csv");
 
-	dir = opendir (path);
+	if (!schedule.dump(scheduleFileName))
+	{
+		DEBUGF(INDI::Logger::DBG_ERROR, "Failed to open file %s.", scheduleFileName);
+		return;
+	}
+
+	DEBUGF(INDI::Logger::DBG_DEBUG, "Step schedule written to %s.", scheduleFileName);
+}
 
-	// search for --the first-- DS18B20 device
-	if (dir != NULL)
+bool AstroberryFocuser::savePosition(int pos, bool atRest)
+{
+	if (!journal.append(pos, MAX_RESOLUTION, atRest))
 	{
-		while ((dirent = readdir (dir)))
-		{
-			// DS18B20 device is family code beginning with 28-
-			if (dirent->d_type == DT_LNK && strstr(dirent->d_name, "28-") != NULL)
-			{
-				strcpy(dev, dirent->d_name);
-				break;
-			}
-		}
-		(void) closedir (dir);
-	} else {
-		DEBUG(INDI::Logger::DBG_WARNING, "Temperature sensor disabled. 1-Wire interface is not available.");
+		DEBUGF(INDI::Logger::DBG_ERROR, "Failed to journal position %d.", pos);
 		return false;
 	}
 
-	// Assemble path to --the first-- DS18B20 device
-	sprintf(devPath, "%s/%s/w1_slave", path, dev);
+	DEBUGF(INDI::Logger::DBG_DEBUG, "Journaled position %d (record %u).", pos, journal.getSequence() - 1);
+	return true;
+}
+
+int AstroberryFocuser::loadPosition()
+{
+	char journalFileName[MAXRBUF];
+	getFileName(journalFileName, "journal");
 
-	// Opening the device's file triggers new reading
-	int fd = open(devPath, O_RDONLY);
-	if(fd == -1)
+	if (!journal.open(journalFileName))
 	{
-		DEBUG(INDI::Logger::DBG_WARNING, "Temperature sensor not available.");
-		return false;
+		DEBUGF(INDI::Logger::DBG_ERROR, "Failed to open position journal %s.", journalFileName);
+		return -1;
 	}
+	journal.setSyncPolicy(IUFindOnSwitchIndex(&JournalSyncSP));
 
-	// set busy
-	FocusTemperatureNP.s=IPS_BUSY;
-	IDSetNumber(&FocusTemperatureNP, nullptr);
+	AstroberryJournalRecord record;
+	if (journal.recover(record))
+	{
+		int pos = record.position * (MAX_RESOLUTION / record.resolution);
+		if (!(record.flags & AstroberryJournal::JOURNAL_AT_REST))
+		{
+			DEBUG(INDI::Logger::DBG_WARNING, "Focuser was moving when last position was journaled. Position may be inaccurate, consider syncing.");
+		}
+		DEBUGF(INDI::Logger::DBG_DEBUG, "Recovered position %d from %s.", pos, journalFileName);
+		return pos;
+	}
 
-	// read sensor output
-	while((numRead = read(fd, buf, 256)) > 0);
-	close(fd);
+	// first start with the journal - migrate position file
+	int pos = loadLegacyPosition();
+	if (pos != -1)
+		savePosition(pos);
 
-	// parse temperature value from sensor output
-	strncpy(temperatureData, strstr(buf, "t=") + 2, 5);
-	DEBUGF(INDI::Logger::DBG_DEBUG, "Temperature sensor raw output: %s", buf);
-	DEBUGF(INDI::Logger::DBG_DEBUG, "Temperature string: %s", temperatureData);
+	return pos;
+}
 
-	tempC = strtof(temperatureData, NULL) / 1000;
-	// tempF = (tempC / 1000) * 9 / 5 + 32;
+int AstroberryFocuser::loadLegacyPosition()
+{
+	FILE * pFile;
+	char posFileName[MAXRBUF];
+	char buf [100];
+	int pos;
 
-	// check if temperature is reasonable
-	if(abs(tempC) > 100)
+	getFileName(posFileName, "position");
+
+	pFile = fopen (posFileName,"r");
+	if (pFile == NULL)
 	{
-		DEBUG(INDI::Logger::DBG_DEBUG, "Temperature reading out of range.");
-		return false;
+		DEBUGF(INDI::Logger::DBG_ERROR, "Failed to open file %s.", posFileName);
+		return -1;
 	}
 
-	FocusTemperatureN[0].value = tempC;
+	// legacy files hold a single full step position
+	int posResolution = 1;
+	fgets (buf , 100, pFile);
+	if (sscanf(buf, "%d %d", &pos, &posResolution) < 1 || posResolution < 1)
+	{
+		DEBUGF(INDI::Logger::DBG_ERROR, "Invalid position in file %s.", posFileName);
+		fclose (pFile);
+		return -1;
+	}
+	pos = pos * (MAX_RESOLUTION / posResolution);
+	DEBUGF(INDI::Logger::DBG_DEBUG, "Reading position %d from %s.", pos, posFileName);
 
-	// set OK
-	FocusTemperatureNP.s=IPS_OK;
-	IDSetNumber(&FocusTemperatureNP, nullptr);
-	DEBUGF(INDI::Logger::DBG_DEBUG, "Temperature: %.2f°C", tempC);
+	fclose (pFile);
 
-	return true;
+	return pos;
 }
 
 void AstroberryFocuser::getFocuserInfo()
@@ -977,13 +2338,20 @@ void AstroberryFocuser::getFocuserInfo()
 	DEBUGF(INDI::Logger::DBG_DEBUG, "Focuser Info: %0.2f %0.2f %0.2f.", FocuserInfoN[0].value, FocuserInfoN[1].value, FocuserInfoN[2].value);
 }
 
+void AstroberryFocuser::stepperDoneHelper(int fd, void *context)
+{
+	INDI_UNUSED(fd);
+	static_cast<AstroberryFocuser*>(context)->stepperDone();
+}
+
 void AstroberryFocuser::stepperStandbyHelper(void *context)
 {
 	static_cast<AstroberryFocuser*>(context)->stepperStandby();
 }
 
-void AstroberryFocuser::updateTemperatureHelper(void *context)
+void AstroberryFocuser::updateTemperatureHelper(int fd, void *context)
 {
+	INDI_UNUSED(fd);
 	static_cast<AstroberryFocuser*>(context)->updateTemperature();
 }
 
@@ -992,45 +2360,618 @@ void AstroberryFocuser::temperatureCompensationHelper(void *context)
 	static_cast<AstroberryFocuser*>(context)->temperatureCompensation();
 }
 
+void AstroberryFocuser::focusSettledHelper(void *context)
+{
+	static_cast<AstroberryFocuser*>(context)->focusSettled();
+}
+
 void AstroberryFocuser::stepperStandby()
 {
 	if (!isConnected())
 		return;
 
-	gpiod_line_set_value(gpio_sleep, 1); // set stepper motor asleep
+	stepper.standby(); // set stepper motor asleep
 	DEBUG(INDI::Logger::DBG_SESSION, "Stepper motor going standby.");
 }
 
+void AstroberryFocuser::defineTemperatureSensors()
+{
+	std::vector<std::string> ids = thermometer->getSensorIds();
+	int count = ids.size() > 0 ? ids.size() : 1;
+
+	deleteProperty(TemperatureSensorsNP.name);
+	deleteProperty(TemperatureSourceSP.name);
+
+	for (size_t i = 0; i < ids.size(); i++)
+		snprintf(temperatureSensorIds[i], MAXINDILABEL, "%s", ids[i].c_str());
+
+	// keep selected source if the sensor is still there
+	int source = IUFindOnSwitchIndex(&TemperatureSourceSP);
+	IUResetSwitch(&TemperatureSourceSP);
+	TemperatureSourceS[source >= 0 && source < count ? source : 0].s = ISS_ON;
+
+	TemperatureSensorsNP.nnp = count;
+	TemperatureSourceSP.nsp = count;
+	defineNumber(&TemperatureSensorsNP);
+	defineSwitch(&TemperatureSourceSP);
+	loadConfig(true, TemperatureSourceSP.name);
+
+	DEBUGF(INDI::Logger::DBG_SESSION, "Found %d temperature sensors.", (int) ids.size());
+}
+
+void AstroberryFocuser::syncTemperatureResolution()
+{
+	// another channel on the same bus may have changed it
+	int index = thermometer->getResolutionSetting() - 9;
+	if (index == IUFindOnSwitchIndex(&TemperatureResolutionSP))
+		return;
+
+	IUResetSwitch(&TemperatureResolutionSP);
+	TemperatureResolutionS[index].s = ISS_ON;
+	IDSetSwitch(&TemperatureResolutionSP, nullptr);
+	DEBUGF(INDI::Logger::DBG_SESSION, "Temperature sensor resolution is %s, shared with the other focusers.", IUFindOnSwitch(&TemperatureResolutionSP)->label);
+}
+
 void AstroberryFocuser::updateTemperature()
 {
-	if (!isConnected())
+	if (thermometerFd < 0)
 		return;
+	thermometer->clearNotify(thermometerFd);
+
+	AstroberryTemperature reading;
+	if (!isConnected() || !thermometer->getTemperature(reading))
+		return;
+
+	// resolution is applied by the sensor thread, report if the sensors did not take it
+	syncTemperatureResolution();
+	int bits = 9 + IUFindOnSwitchIndex(&TemperatureResolutionSP);
+	IPState resolutionState = thermometer->getResolution() == bits ? IPS_OK : IPS_ALERT;
+	if (TemperatureResolutionSP.s != resolutionState)
+	{
+		TemperatureResolutionSP.s = resolutionState;
+		IDSetSwitch(&TemperatureResolutionSP, nullptr);
+		if (resolutionState == IPS_ALERT)
+		{
+			DEBUGF(INDI::Logger::DBG_WARNING, "Temperature sensor resolution could not be set to %d bit.", bits);
+		}
+	}
 
-	readDS18B20();
-	updateTemperatureID = IEAddTimer(TEMPERATURE_UPDATE_TIMEOUT, updateTemperatureHelper, this);
+	// sensors plugged in or removed
+	if (thermometer->getSensorsVersion() != temperatureSensorsVersion)
+	{
+		temperatureSensorsVersion = thermometer->getSensorsVersion();
+		defineTemperatureSensors();
+	}
+
+	for (int i = 0; i < TemperatureSensorsNP.nnp; i++)
+		TemperatureSensorsN[i].value = i < reading.count ? reading.celsius[i] : NAN;
+	TemperatureSensorsNP.s=IPS_OK;
+	IDSetNumber(&TemperatureSensorsNP, nullptr);
+
+	float temperature = TemperatureSensorsN[IUFindOnSwitchIndex(&TemperatureSourceSP)].value;
+	if (isnan(temperature))
+	{
+		FocusTemperatureNP.s=IPS_ALERT;
+		IDSetNumber(&FocusTemperatureNP, nullptr);
+		DEBUG(INDI::Logger::DBG_WARNING, "Temperature compensation source sensor not available.");
+		return;
+	}
+
+	FocusTemperatureN[0].value = temperature;
+
+	// first reading, the sensor may have been plugged in after connecting
+	if (!temperatureDefined)
+	{
+		defineNumber(&FocusTemperatureNP);
+		defineNumber(&TemperatureCoefNP);
+		defineSwitch(&TemperatureCompensateSP);
+		defineSwitch(&CompensationModeSP);
+		defineNumber(&CompensationInfoNP);
+		lastTemperature = FocusTemperatureN[0].value; // init last temperature
+		lastCompensationHours = getCompensationHours();
+		IERmTimer(temperatureCompensationID);
+		temperatureCompensationID = IEAddTimer(getTemperatureInterval(), temperatureCompensationHelper, this); // set temperature compensation timer
+		temperatureDefined = true;
+	}
+
+	FocusTemperatureNP.s=IPS_OK;
+	IDSetNumber(&FocusTemperatureNP, nullptr);
+	DEBUGF(INDI::Logger::DBG_DEBUG, "Temperature: %.2f°C", temperature);
+}
+
+float AstroberryFocuser::getHistoryTemperature()
+{
+	return temperatureDefined && FocusTemperatureNP.s == IPS_OK ? FocusTemperatureN[0].value : NAN;
+}
+
+void AstroberryFocuser::predictPosition()
+{
+	double position;
+	int matches;
+
+	if (!history.predict(getHistoryTemperature(), HorizontalCoordN[1].value, FilterSlotN[0].value, position, matches))
+	{
+		FocusPredictSP.s = FocusPredictionNP.s = IPS_ALERT;
+		IDSetNumber(&FocusPredictionNP, nullptr);
+		DEBUG(INDI::Logger::DBG_WARNING, "Focus history has no position to predict from.");
+		return;
+	}
+
+	// history is in MAX_RESOLUTION units, without filter offsets
+	position = position / getPositionScale() + getAppliedFilterOffset();
+	FocusPredictionN[0].value = std::max(FocusAbsPosN[0].min, std::min(round(position), FocusAbsPosN[0].max));
+	FocusPredictionN[1].value = matches;
+	FocusPredictionNP.s = IPS_OK;
+	IDSetNumber(&FocusPredictionNP, nullptr);
+	DEBUGF(INDI::Logger::DBG_SESSION, "Predicted focus position %0.0f from %d history records.", FocusPredictionN[0].value, matches);
+
+	// a prediction is our own guess, only focus settled on by a client is learned
+	compensationPending = true;
+	FocusPredictSP.s = MoveAbsFocuser(FocusPredictionN[0].value) == IPS_ALERT ? IPS_ALERT : IPS_OK;
+}
+
+void AstroberryFocuser::simulationTriggered(bool enabled)
+{
+	if (isConnected())
+		DEBUGF(INDI::Logger::DBG_WARNING, "Simulation will be %s on next connection.", enabled ? "enabled" : "disabled");
+}
+
+void AstroberryFocuser::simulationTimerHelper(void *context)
+{
+	AstroberryFocuser *focuser = static_cast<AstroberryFocuser*>(context);
+	focuser->simulator.updateTemperature();
+	focuser->simulationTimerID = IEAddTimer(1000, simulationTimerHelper, context);
+}
+
+void AstroberryFocuser::updateSimulationModel()
+{
+	// model works in MAX_RESOLUTION units
+	simulator.setBacklash(SimulationModelN[0].value * getPositionScale());
+	simulator.setStepLoss(SimulationModelN[3].value);
+	if (isConnected() && isSimulation())
+		simulator.startThermometer(SimulationModelN[1].value, SimulationModelN[2].value);
+}
+
+void AstroberryFocuser::updateSimulationStats()
+{
+	// reverse motion turns the motor the other way
+	int sign = FocusReverseS[INDI_ENABLED].s == ISS_ON ? -1 : 1;
+	int moved = stepper.getPosition() - simulationMoveStart[0];
+	int drawtubeMoved = sign * (simulator.getDrawtubePosition() - simulationMoveStart[1]);
+	AstroberrySimulatorStats stats = simulator.getStats();
+
+	SimulationStatsN[0].value = sign * simulator.getDrawtubePosition() / getPositionScale();
+	SimulationStatsN[1].value += (double) (drawtubeMoved - moved) / getPositionScale();
+	SimulationStatsN[2].value = stats.steps;
+	SimulationStatsN[3].value = stats.missed;
+	SimulationStatsN[4].value = stats.latency;
+	SimulationStatsN[5].value = stats.minPeriod;
+	SimulationStatsN[6].value = stats.maxPeriod;
+	SimulationStatsN[7].value = stats.meanPeriod;
+	SimulationStatsNP.s = SimulationStatsN[1].value != 0 || stats.missed > 0 ? IPS_ALERT : IPS_OK;
+	IDSetNumber(&SimulationStatsNP, nullptr);
+
+	if (drawtubeMoved != moved)
+		DEBUGF(INDI::Logger::DBG_WARNING, "Simulated drawtube moved %0.0f steps, focuser expected %0.0f.", (double) drawtubeMoved / getPositionScale(), (double) moved / getPositionScale());
+}
+
+void AstroberryFocuser::startAutofocus()
+{
+	if (autofocus.isRunning())
+	{
+		DEBUG(INDI::Logger::DBG_WARNING, "Autofocus is already running.");
+		return;
+	}
+
+	autofocus.start(FocusAbsPosN[0].value, AutofocusSettingsN[0].value, AutofocusSettingsN[1].value, FocusAbsPosN[0].min, FocusAbsPosN[0].max);
+
+	// frames are measured here, the client does not need to download them
+	IDSnoopBLOBs(ActiveDeviceT[1].text, "CCD1", B_ALSO);
+
+	AutofocusSP.s = IPS_BUSY;
+	AutofocusStatusNP.s = IPS_BUSY;
+	DEBUGF(INDI::Logger::DBG_SESSION, "Autofocus started around position %0.0f, waiting for frames from %s.", FocusAbsPosN[0].value, ActiveDeviceT[1].text);
+
+	autofocusMove();
+}
+
+void AstroberryFocuser::stopAutofocus(IPState state)
+{
+	autofocus.abort();
+	frameExposure = false;
+	IDSnoopBLOBs(ActiveDeviceT[1].text, "CCD1", B_NEVER);
+
+	AutofocusSP.s = state;
+	IDSetSwitch(&AutofocusSP, nullptr);
+	AutofocusStatusNP.s = state;
+	IDSetNumber(&AutofocusStatusNP, nullptr);
+
+	if (state != IPS_OK)
+		DEBUG(INDI::Logger::DBG_SESSION, "Autofocus stopped.");
+}
+
+void AstroberryFocuser::autofocusMove()
+{
+	AutofocusStatusN[0].value = autofocus.getPoint() + 1;
+	IDSetNumber(&AutofocusStatusNP, nullptr);
+
+	autofocusPending = true;
+	if (MoveAbsFocuser(autofocus.getTarget()) == IPS_ALERT)
+		stopAutofocus(IPS_ALERT);
+}
+
+bool AstroberryFocuser::measureFrame(double &hfr, int &stars)
+{
+	if (strcmp(CcdImageB[0].format, ".fits"))
+	{
+		DEBUGF(INDI::Logger::DBG_ERROR, "Measuring focus needs uncompressed FITS frames, got %s.", CcdImageB[0].format);
+		return false;
+	}
+
+	AstroberryFrame frame;
+	stars = 0;
+	hfr = NAN;
+	if (AstroberryMetrics::loadFITS(CcdImageB[0].blob, CcdImageB[0].bloblen, frame))
+		hfr = AstroberryMetrics::measureHFR(frame, stars);
+	else
+		DEBUG(INDI::Logger::DBG_WARNING, "Cannot read the frame.");
+	return true;
+}
+
+void AstroberryFocuser::autofocusFrame()
+{
+	if (!autofocus.isRunning())
+		return;
+
+	// frame was exposed, at least in part, while moving
+	if (!frameExposure || stepper.isMoving())
+	{
+		DEBUG(INDI::Logger::DBG_DEBUG, "Autofocus skipped a frame exposed while moving.");
+		return;
+	}
+	frameExposure = false;
+
+	int stars = 0;
+	double hfr = NAN;
+	if (!measureFrame(hfr, stars))
+	{
+		stopAutofocus(IPS_ALERT);
+		return;
+	}
+
+	AutofocusStatusN[1].value = isnan(hfr) ? 0 : hfr;
+	AutofocusStatusN[2].value = stars;
+	IDSetNumber(&AutofocusStatusNP, nullptr);
+	DEBUGF(INDI::Logger::DBG_SESSION, "Autofocus point %d/%d at %d: HFR %0.2f px from %d stars.", autofocus.getPoint() + 1, autofocus.getPoints(), autofocus.getTarget(), hfr, stars);
+
+	switch (autofocus.addSample(hfr))
+	{
+		case AstroberryAutofocus::AUTOFOCUS_MEASURE:
+			autofocusMove();
+			break;
+		case AstroberryAutofocus::AUTOFOCUS_DONE:
+			AutofocusStatusN[1].value = autofocus.getBestMetric();
+			AutofocusStatusN[3].value = autofocus.getBest();
+			stopAutofocus(IPS_OK);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Autofocus done, best position %d with HFR %0.2f px.", autofocus.getBest(), autofocus.getBestMetric());
+			MoveAbsFocuser(autofocus.getBest());
+			break;
+		default:
+			DEBUG(INDI::Logger::DBG_ERROR, "Autofocus failed, no stars found in the sweep.");
+			stopAutofocus(IPS_ALERT);
+	}
+}
+
+void AstroberryFocuser::startCalibration()
+{
+	if (isMeasuring() || stepper.isMoving())
+	{
+		DEBUG(INDI::Logger::DBG_WARNING, "Cannot calibrate backlash while the focuser is busy.");
+		return;
+	}
+
+	// an encoder on the motor shaft does not see the gear train lash
+	calibrationByEncoder = encoder.isRunning() && EncoderMountS[1].s == ISS_ON;
+	calibrationStart = FocusAbsPosN[0].value;
+	int stroke = BacklashCalibrationSettingsN[0].value;
+	int origin = calibrationStart + (calibrationByEncoder ? 0 : BacklashCalibrationSettingsN[2].value);
+
+	if (!calibration.start(origin, stroke, BacklashCalibrationSettingsN[1].value, FocusAbsPosN[0].min, FocusAbsPosN[0].max))
+	{
+		DEBUG(INDI::Logger::DBG_ERROR, "Calibration stroke does not fit in the focuser travel.");
+		BacklashCalibrationSP.s = IPS_ALERT;
+		return;
+	}
+
+	// frames out of focus change size with every step, in focus they barely do
+	if (!calibrationByEncoder)
+		IDSnoopBLOBs(ActiveDeviceT[1].text, "CCD1", B_ALSO);
+
+	BacklashCalibrationSP.s = IPS_BUSY;
+	BacklashCalibrationStatusNP.s = IPS_BUSY;
+	if (calibrationByEncoder)
+		DEBUGF(INDI::Logger::DBG_SESSION, "Backlash calibration started around position %d, measured by the drawtube encoder.", calibration.getTarget() + stroke);
+	else
+		DEBUGF(INDI::Logger::DBG_SESSION, "Backlash calibration started around position %d, waiting for frames from %s.", calibration.getTarget() + stroke, ActiveDeviceT[1].text);
+
+	calibrationMove();
+}
+
+void AstroberryFocuser::stopCalibration(IPState state)
+{
+	calibration.abort();
+	frameExposure = false;
+	if (!calibrationByEncoder)
+		IDSnoopBLOBs(ActiveDeviceT[1].text, "CCD1", B_NEVER);
+
+	BacklashCalibrationSP.s = state;
+	IDSetSwitch(&BacklashCalibrationSP, nullptr);
+	BacklashCalibrationStatusNP.s = state;
+	IDSetNumber(&BacklashCalibrationStatusNP, nullptr);
+
+	if (state != IPS_OK)
+		DEBUG(INDI::Logger::DBG_SESSION, "Backlash calibration stopped.");
+}
+
+void AstroberryFocuser::calibrationMove()
+{
+	BacklashCalibrationStatusN[0].value = calibration.getPoint() + 1;
+	IDSetNumber(&BacklashCalibrationStatusNP, nullptr);
+
+	calibrationPending = true;
+	IPState state = MoveAbsFocuser(calibration.getTarget());
+	calibrationPending = false;
+	if (state == IPS_ALERT)
+		stopCalibration(IPS_ALERT);
+	else if (state == IPS_OK && (calibrationByEncoder || calibration.isPreload()))
+		calibrationSample(calibrationByEncoder ? (double) getEncoderPosition() / getPositionScale() : NAN);
+}
+
+void AstroberryFocuser::calibrationSample(double value)
+{
+	DEBUGF(INDI::Logger::DBG_DEBUG, "Backlash calibration point %d/%d at %d: %0.2f.", calibration.getPoint() + 1, calibration.getPoints(), calibration.getTarget(), value);
+
+	switch (calibration.addSample(value))
+	{
+		case AstroberryBacklash::BACKLASH_MEASURE:
+			calibrationMove();
+			break;
+		case AstroberryBacklash::BACKLASH_DONE:
+		{
+			int backlash = calibration.getBacklash();
+			BacklashCalibrationStatusN[1].value = backlash;
+			BacklashCalibrationStatusN[2].value = calibration.getSpread();
+			stopCalibration(IPS_OK);
+			DEBUGF(INDI::Logger::DBG_SESSION, "Backlash calibration done, %d steps lost on reversal, spread %d steps.", backlash, calibration.getSpread());
+
+			if (backlash > FocusBacklashN[0].max)
+			{
+				DEBUGF(INDI::Logger::DBG_WARNING, "Measured backlash is more than the maximum of %0.0f steps.", FocusBacklashN[0].max);
+				backlash = FocusBacklashN[0].max;
+			}
+
+			// the minimum that takes up the slop makes every reversal as short as it can be
+			FocusBacklashN[0].value = backlash;
+			FocusBacklashNP.s = IPS_OK;
+			IDSetNumber(&FocusBacklashNP, nullptr);
+			FocusBacklashS[INDI_ENABLED].s = backlash > 0 ? ISS_ON : ISS_OFF;
+			FocusBacklashS[INDI_DISABLED].s = backlash > 0 ? ISS_OFF : ISS_ON;
+			FocusBacklashSP.s = IPS_OK;
+			IDSetSwitch(&FocusBacklashSP, nullptr);
+			saveConfig(true, FocusBacklashNP.name);
+			saveConfig(true, FocusBacklashSP.name);
+
+			resetEncoder();
+			MoveAbsFocuser(calibrationStart);
+			break;
+		}
+		default:
+			DEBUG(INDI::Logger::DBG_ERROR, "Backlash calibration failed, the stroke barely changed the measurement, try a longer stroke or more defocus.");
+			stopCalibration(IPS_ALERT);
+	}
+}
+
+void AstroberryFocuser::calibrationFrame()
+{
+	if (!calibration.isRunning())
+		return;
+
+	// frame was exposed, at least in part, while moving
+	if (!frameExposure || stepper.isMoving())
+	{
+		DEBUG(INDI::Logger::DBG_DEBUG, "Backlash calibration skipped a frame exposed while moving.");
+		return;
+	}
+	frameExposure = false;
+
+	int stars = 0;
+	double hfr = NAN;
+	if (!measureFrame(hfr, stars))
+	{
+		stopCalibration(IPS_ALERT);
+		return;
+	}
+	if (stars == 0)
+		hfr = NAN;
+
+	calibrationSample(hfr);
+}
+
+void AstroberryFocuser::applyFilterOffset()
+{
+	int slot = FilterSlotN[0].value;
+	int previous = filterOffsetSlot;
+	if (slot == previous)
+		return;
+	filterOffsetSlot = slot;
+
+	// the first slot reported is where we start from, autofocus owns the focuser while it runs
+	if (previous < 1 || slot < 1 || FilterOffsetModeS[0].s != ISS_ON || !isConnected() || isMeasuring())
+		return;
+
+	int offset = getFilterOffset(slot) - getFilterOffset(previous);
+	if (offset == 0)
+		return;
+
+	// the slot is reported once the wheel is there, a move still running is retargeted
+	int target = stepper.getTarget() / getPositionScale() + offset;
+	target = std::max((int) FocusAbsPosN[0].min, std::min((int) FocusAbsPosN[0].max, target));
+	DEBUGF(INDI::Logger::DBG_SESSION, "Filter slot %d to %d, moving focuser by %d steps.", previous, slot, offset);
+
+	// offsets are our own prediction, like compensation moves
+	compensationPending = true;
+	MoveAbsFocuser(target);
+}
+
+bool AstroberryFocuser::isExposing()
+{
+	if (CcdExposureNP.s != IPS_BUSY)
+		return false;
+
+	// snooped CCD may have gone away in the middle of an exposure
+	return time(nullptr) - lastExposureUpdate < CcdExposureN[0].value + EXPOSURE_STALE_TIMEOUT;
+}
+
+double AstroberryFocuser::getCompensationHours()
+{
+	double nightStart = CompensationModelN[AstroberryCompensation::STAT_COUNT].value;
+	return nightStart > 0 ? (time(nullptr) - nightStart) / 3600.0 : 0;
+}
+
+void AstroberryFocuser::updateCompensationModel()
+{
+	compensationModel.solve(CompensationModeS[2].s == ISS_ON);
+
+	const double *stats = compensationModel.getStatistics();
+	for (int i = 0; i < AstroberryCompensation::STAT_COUNT; i++)
+		CompensationModelN[i].value = stats[i];
+	CompensationModelNP.s = IPS_OK;
+	IDSetNumber(&CompensationModelNP, nullptr);
+
+	// model is in MAX_RESOLUTION units, show it in focuser steps
+	CompensationInfoN[0].value = compensationModel.getSamples();
+	CompensationInfoN[1].value = compensationModel.getSlope() / getPositionScale();
+	CompensationInfoN[2].value = compensationModel.getDrift() / getPositionScale();
+	CompensationInfoNP.s = compensationModel.isValid() ? IPS_OK : IPS_IDLE;
+	IDSetNumber(&CompensationInfoNP, nullptr);
+}
+
+void AstroberryFocuser::focusSettled()
+{
+	focusSettledID = -1;
+
+	if (!isConnected() || stepper.isMoving())
+		return;
+
+	// history is kept in MAX_RESOLUTION units, so it survives resolution changes, offsets of the filter in use are not learned
+	int position = stepper.getPosition() - getAppliedFilterOffset() * getPositionScale();
+	if (history.append(position, getHistoryTemperature(), HorizontalCoordN[1].value, FilterSlotN[0].value))
+	{
+		FocusPredictionN[2].value = history.size();
+		IDSetNumber(&FocusPredictionNP, nullptr);
+		DEBUGF(INDI::Logger::DBG_DEBUG, "Focus position %0.0f recorded in history (filter %0.0f, altitude %0.1f).", FocusAbsPosN[0].value, FilterSlotN[0].value, HorizontalCoordN[1].value);
+	}
+
+	if (FocusTemperatureNP.s != IPS_OK)
+		return;
+
+	// first sample of the night starts the time axis
+	time_t now = time(nullptr);
+	double &nightStart = CompensationModelN[AstroberryCompensation::STAT_COUNT].value;
+	if (nightStart <= 0 || now - nightStart > COMPENSATION_NIGHT_GAP)
+		nightStart = now;
+
+	compensationModel.addSample(FocusTemperatureN[0].value, getCompensationHours(), position);
+	updateCompensationModel();
+	saveConfig(true, CompensationModelNP.name);
+
+	DEBUGF(INDI::Logger::DBG_SESSION, "Focus position %0.0f at %0.2f°C added to compensation model.", FocusAbsPosN[0].value, FocusTemperatureN[0].value);
+}
+
+void AstroberryFocuser::moveCompensation(int steps)
+{
+	// a correction past the end of travel goes as far as it can rather than being dropped
+	int target = FocusAbsPosN[0].value + steps;
+	int clamped = std::max((int) FocusAbsPosN[0].min, std::min((int) FocusAbsPosN[0].max, target));
+	if (clamped != target)
+		DEBUGF(INDI::Logger::DBG_WARNING, "Temperature compensation of %d steps is limited to %d steps by the focuser travel.", steps, clamped - (int) FocusAbsPosN[0].value);
+
+	compensationPending = true;
+	MoveAbsFocuser(clamped);
 }
 
 void AstroberryFocuser::temperatureCompensation()
 {
+	temperatureCompensationID = -1;
 	if (!isConnected())
 		return;
 
-	if ( TemperatureCompensateS[0].s == ISS_ON && FocusTemperatureN[0].value != lastTemperature )
+	// do not compensate on readings from a sensor which stopped responding
+	if ( thermometerFd < 0 || thermometer->getAge() > 3 * TemperatureSamplingN[0].value + 1 )
+	{
+		if (FocusTemperatureNP.s != IPS_ALERT)
+		{
+			FocusTemperatureNP.s=IPS_ALERT;
+			IDSetNumber(&FocusTemperatureNP, nullptr);
+			DEBUG(INDI::Logger::DBG_WARNING, "Temperature sensor stopped responding.");
+		}
+	}
+	else if ( TemperatureCompensateS[0].s == ISS_ON && FocusTemperatureN[0].value != lastTemperature && !stepper.isMoving() && !isMeasuring() )
 	{
 		float deltaTemperature = FocusTemperatureN[0].value - lastTemperature; // change of temperature from last focuser movement
-		float thermalExpansionRatio = TemperatureCoefN[0].value * ScopeParametersN[1].value / 1000; // termal expansion in micrometers per 1 celcius degree
-		float thermalExpansion = thermalExpansionRatio * deltaTemperature; // actual thermal expansion
+		double hours = getCompensationHours();
+		int thermalAdjustment = 0;
+
+		if ( CompensationModeS[0].s == ISS_ON )
+		{
+			float thermalExpansionRatio = TemperatureCoefN[0].value * ScopeParametersN[1].value / 1000; // termal expansion in micrometers per 1 celcius degree
+			float thermalExpansion = thermalExpansionRatio * deltaTemperature; // actual thermal expansion
+
+			DEBUGF(INDI::Logger::DBG_DEBUG, "Thermal expansion of %0.1f μm due to temperature change of %0.2f°C", thermalExpansion, deltaTemperature);
+
+			if ( abs(thermalExpansion) > FocuserInfoN[1].value / 2)
+				thermalAdjustment = round((thermalExpansion / FocuserInfoN[0].value) / 2); // adjust focuser by half number of steps to keep it in the center of cfz
+		}
+		else if (!compensationModel.isValid())
+		{
+			DEBUG(INDI::Logger::DBG_DEBUG, "Learned compensation model needs more samples.");
+		} else {
+			// learned model predicts the change of focus since the last move
+			double shift = compensationModel.predict(FocusTemperatureN[0].value, hours) - compensationModel.predict(lastTemperature, lastCompensationHours);
+			int threshold = FocuserInfoN[2].value > 2 ? FocuserInfoN[2].value / 2 : 1; // half of critical focus zone
 
-		DEBUGF(INDI::Logger::DBG_DEBUG, "Thermal expansion of %0.1f μm due to temperature change of %0.2f°C", thermalExpansion, deltaTemperature);
+			DEBUGF(INDI::Logger::DBG_DEBUG, "Learned model predicts focus shift of %0.1f steps", shift / getPositionScale());
+
+			if ( fabs(round(shift / getPositionScale())) >= threshold )
+				thermalAdjustment = round(shift / getPositionScale());
+		}
 
-		if ( abs(thermalExpansion) > FocuserInfoN[1].value / 2)
+		if ( thermalAdjustment != 0 )
 		{
-			int thermalAdjustment = round((thermalExpansion / FocuserInfoN[0].value) / 2); // adjust focuser by half number of steps to keep it in the center of cfz
-			MoveAbsFocuser(FocusAbsPosN[0].value + thermalAdjustment); // adjust focuser position
 			lastTemperature = FocusTemperatureN[0].value; // register last temperature
-			DEBUGF(INDI::Logger::DBG_SESSION, "Focuser adjusted by %d steps due to temperature change by %0.2f°C", thermalAdjustment, deltaTemperature);
+			lastCompensationHours = hours;
+
+			if (isExposing())
+			{
+				// do not smear the running exposure, move in the readout gap
+				deferredCompensation += thermalAdjustment;
+				DEBUGF(INDI::Logger::DBG_SESSION, "Exposure in progress, deferring temperature compensation of %d steps (%d in total).", thermalAdjustment, deferredCompensation);
+			} else {
+				thermalAdjustment += deferredCompensation;
+				deferredCompensation = 0;
+				moveCompensation(thermalAdjustment); // adjust focuser position
+				DEBUGF(INDI::Logger::DBG_SESSION, "Focuser adjusted by %d steps due to temperature change by %0.2f°C", thermalAdjustment, deltaTemperature);
+			}
 		}
 	}
 
-	temperatureCompensationID = IEAddTimer(TEMPERATURE_COMPENSATION_TIMEOUT, temperatureCompensationHelper, this);
+	// deferred compensation left over from an exposure we missed the end of
+	if ( deferredCompensation != 0 && !isExposing() && !stepper.isMoving() && !isMeasuring() )
+	{
+		DEBUGF(INDI::Logger::DBG_SESSION, "Applying deferred temperature compensation of %d steps.", deferredCompensation);
+		moveCompensation(deferredCompensation);
+		deferredCompensation = 0;
+	}
+
+	temperatureCompensationID = IEAddTimer(getTemperatureInterval(), temperatureCompensationHelper, this);
 }
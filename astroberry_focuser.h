@@ -21,10 +21,25 @@
 
 #include <indifocuser.h>
 
+#include "astroberry_autofocus.h"
+#include "astroberry_backlash.h"
+#include "astroberry_compensation.h"
+#include "astroberry_encoder.h"
+#include "astroberry_gpio.h"
+#include "astroberry_history.h"
+#include "astroberry_journal.h"
+#include "astroberry_simulator.h"
+#include "astroberry_stepper.h"
+#include "astroberry_thermometer.h"
+
+#define MAX_RESOLUTION 32 // highest microstep resolution, position is saved in these units
+#define FOCUSER_MAX_CHANNELS 4 // focusers one driver process can host
+#define FILTER_OFFSET_SLOTS 10 // filter slots with a focus offset
+
 class AstroberryFocuser : public INDI::Focuser
 {
 public:
-	AstroberryFocuser();
+	AstroberryFocuser(int channel = 0);
 	virtual ~AstroberryFocuser();
 	const char *getDefaultName();
 	virtual bool initProperties();
@@ -35,8 +50,11 @@ public:
 	virtual bool ISNewText (const char *dev, const char *name, char *texts[], char *names[], int n);
 	virtual bool ISSnoopDevice(XMLEle *root);
 	static void stepperStandbyHelper(void *context);
-	static void updateTemperatureHelper(void *context);
+	static void updateTemperatureHelper(int fd, void *context);
 	static void temperatureCompensationHelper(void *context);
+	static void focusSettledHelper(void *context);
+	static void stepperDoneHelper(int fd, void *context);
+	static void simulationTimerHelper(void *context);
 protected:
 	virtual IPState MoveAbsFocuser(uint32_t ticks) override;
 	virtual IPState MoveRelFocuser(FocusDirection dir, uint32_t ticks) override;
@@ -46,23 +64,73 @@ protected:
 	virtual bool AbortFocuser() override;
 	virtual void TimerHit() override;
 	virtual bool saveConfigItems(FILE *fp) override;
+	virtual void simulationTriggered(bool enabled) override;
 private:
 	virtual bool Connect();
 	virtual bool Disconnect();
 
-	virtual void stepMotor();
-	virtual int savePosition(int pos);
-	virtual bool readDS18B20();
+	bool savePosition(int pos, bool atRest = true);
+	int loadPosition();
+	int loadLegacyPosition();
+	void getFileName(char *fileName, const char *extension);
+	bool updateResolution();
+	void updateApproach();
+	int getPositionScale() { return MAX_RESOLUTION / resolution; }
+	void dumpSchedule(const AstroberrySchedule &schedule);
+	void updateStepTiming();
 	void getFocuserInfo();
 	int stepperStandbyID { -1 };
 	void stepperStandby();
 	int updateTemperatureID { -1 };
+	bool temperatureDefined { false };
+	uint32_t temperatureSensorsVersion { 0 };
+	void defineTemperatureSensors();
+	int getTemperatureInterval() { return TemperatureSamplingN[0].value * 1000; }
+	void syncTemperatureResolution();
 	void updateTemperature();
 	int temperatureCompensationID { -1 };
 	void temperatureCompensation();
+	int focusSettledID { -1 };
+	void focusSettled();
+	double getCompensationHours();
+	void updateCompensationModel();
+	int stepperDoneID { -1 };
+	void stepperDone();
+	void publishPosition(int motorPosition, bool force = false); // MAX_RESOLUTION units
+	void updateMoveDuration(); // after a retarget
+	void resetEncoder();
+	int getEncoderReference() { return EncoderMountS[1].s == ISS_ON ? stepper.getPosition() : stepper.getShaftPosition(); } // where the encoder should be
+	int getEncoderPosition(); // MAX_RESOLUTION units
+	IPState reconcileEncoder();
 
-	ISwitch MotorBoardS[2];
+	ISwitch MotorBoardS[3];
 	ISwitchVectorProperty MotorBoardSP;
+	ISwitch FocusResolutionS[6];
+	ISwitchVectorProperty FocusResolutionSP;
+	ISwitch AdaptiveMoveS[3];
+	ISwitchVectorProperty AdaptiveMoveSP;
+	INumber AdaptiveApproachN[1];
+	INumberVectorProperty AdaptiveApproachNP;
+	ISwitch BacklashModeS[3];
+	ISwitchVectorProperty BacklashModeSP;
+	INumber OvershootN[1];
+	INumberVectorProperty OvershootNP;
+	ISwitch EncoderModeS[3];
+	ISwitchVectorProperty EncoderModeSP;
+	ISwitch EncoderMountS[2];
+	ISwitchVectorProperty EncoderMountSP;
+	INumber EncoderPinsN[2];
+	INumberVectorProperty EncoderPinsNP;
+	INumber EncoderSettingsN[3];
+	INumberVectorProperty EncoderSettingsNP;
+	INumber EncoderStatusN[5];
+	INumberVectorProperty EncoderStatusNP;
+	ISwitch BacklashCalibrationS[2];
+	ISwitchVectorProperty BacklashCalibrationSP;
+	INumber BacklashCalibrationSettingsN[3];
+	INumberVectorProperty BacklashCalibrationSettingsNP;
+	INumber BacklashCalibrationStatusN[3];
+	INumberVectorProperty BacklashCalibrationStatusNP;
 	ISwitch TemperatureCompensateS[2];
 	ISwitchVectorProperty TemperatureCompensateSP;
 	ISwitch StepperStandbyS[2];
@@ -73,30 +141,149 @@ private:
 	INumberVectorProperty BCMpinsNP;
 	INumber StepperStandbyTimeN[1];
 	INumberVectorProperty StepperStandbyTimeNP;	
-	INumber FocusStepDelayN[1];
-	INumberVectorProperty FocusStepDelayNP;
+	INumber FocusMotionProfileN[3];
+	INumberVectorProperty FocusMotionProfileNP;
+	INumber FocusMoveDurationN[1];
+	INumberVectorProperty FocusMoveDurationNP;
+	INumber DryRunN[1];
+	INumberVectorProperty DryRunNP;
+	ISwitch ScheduleDumpS[2];
+	ISwitchVectorProperty ScheduleDumpSP;
+	INumber StepTimingN[6];
+	INumberVectorProperty StepTimingNP;
+	ISwitch StepTimingDumpS[2];
+	ISwitchVectorProperty StepTimingDumpSP;
+	ISwitch TelemetryDumpS[1];
+	ISwitchVectorProperty TelemetryDumpSP;
+	INumber PositionUpdateRateN[1];
+	INumberVectorProperty PositionUpdateRateNP;
+	INumber PositionUpdateStatsN[2];
+	INumberVectorProperty PositionUpdateStatsNP;
+	ISwitch JournalSyncS[3];
+	ISwitchVectorProperty JournalSyncSP;
+	INumber JournalCheckpointN[1];
+	INumberVectorProperty JournalCheckpointNP;
 	INumber FocuserTravelN[1];
 	INumberVectorProperty FocuserTravelNP;
 	INumber ScopeParametersN[2];
 	INumberVectorProperty ScopeParametersNP;
 	INumber FocusTemperatureN[1];
 	INumberVectorProperty FocusTemperatureNP;
+	INumber TemperatureSensorsN[THERMOMETER_MAX_SENSORS];
+	INumberVectorProperty TemperatureSensorsNP;
+	ISwitch TemperatureSourceS[THERMOMETER_MAX_SENSORS];
+	ISwitchVectorProperty TemperatureSourceSP;
+	char temperatureSensorIds[THERMOMETER_MAX_SENSORS][MAXINDILABEL];
+	ISwitch CompensationModeS[3];
+	ISwitchVectorProperty CompensationModeSP;
+	INumber CompensationModelN[AstroberryCompensation::STAT_COUNT + 1];
+	INumberVectorProperty CompensationModelNP;
+	INumber CompensationInfoN[3];
+	INumberVectorProperty CompensationInfoNP;
+	ISwitch CompensationResetS[1];
+	ISwitchVectorProperty CompensationResetSP;
+	ISwitch TemperatureResolutionS[4];
+	ISwitchVectorProperty TemperatureResolutionSP;
+	INumber TemperatureSamplingN[2];
+	INumberVectorProperty TemperatureSamplingNP;
 	INumber TemperatureCoefN[1];
 	INumberVectorProperty TemperatureCoefNP;
-	IText ActiveTelescopeT[1];
-	ITextVectorProperty ActiveTelescopeTP;
+	IText ActiveDeviceT[3];
+	ITextVectorProperty ActiveDeviceTP;
+	INumber CcdExposureN[1];
+	INumberVectorProperty CcdExposureNP;
+	INumber FilterSlotN[1];
+	INumberVectorProperty FilterSlotNP;
+	ISwitch FilterOffsetModeS[2];
+	ISwitchVectorProperty FilterOffsetModeSP;
+	INumber FilterOffsetN[FILTER_OFFSET_SLOTS];
+	INumberVectorProperty FilterOffsetNP;
+	INumber HorizontalCoordN[2];
+	INumberVectorProperty HorizontalCoordNP;
+	ISwitch FocusPredictS[1];
+	ISwitchVectorProperty FocusPredictSP;
+	INumber FocusPredictionN[3];
+	INumberVectorProperty FocusPredictionNP;
+	ISwitch AutofocusS[2];
+	ISwitchVectorProperty AutofocusSP;
+	INumber AutofocusSettingsN[2];
+	INumberVectorProperty AutofocusSettingsNP;
+	INumber AutofocusStatusN[4];
+	INumberVectorProperty AutofocusStatusNP;
+	IBLOB CcdImageB[1];
+	IBLOBVectorProperty CcdImageBP;
+	INumber SimulationModelN[4];
+	INumberVectorProperty SimulationModelNP;
+	INumber SimulationStatsN[8];
+	INumberVectorProperty SimulationStatsNP;
 
-	struct gpiod_chip *chip;
-	struct gpiod_line *gpio_dir;
-	struct gpiod_line *gpio_step;
-	struct gpiod_line *gpio_sleep;
+	AstroberryGpioChip *chip { nullptr };
+	AstroberryGpioBulk *gpio_drive { nullptr }; // dir, step & sleep
+	AstroberryGpioLine *gpio_dir { nullptr };
+	AstroberryGpioLine *gpio_step { nullptr };
+	AstroberryGpioLine *gpio_sleep { nullptr };
+	AstroberryGpioLine *gpio_mode[3] { nullptr, nullptr, nullptr };
+	AstroberryGpioEvents *gpio_encoder { nullptr }; // A & B
+	void releaseGpio(); // the chip may stay open for another channel
 
-	int backlashTicksRemaining;
-	int focuserTicksRemaining;
-	int stepperDirection = 1;
+	int channel; // 0 for the first focuser of the driver
+	char channelName[MAXINDIDEVICE] { 0 };
+	AstroberryStepper stepper;
+	AstroberryPlanner planner;
+	AstroberryJournal journal;
+	AstroberryThermometer *thermometer { nullptr }; // shared by the channels on the same bus
+	int thermometerFd { -1 }; // notify fd of this channel, -1 while not reading
+	AstroberryHistory history;
+	AstroberryEncoder encoder;
+	long encoderOrigin { 0 }; // encoder count where the stepper was at encoderPositionOrigin
+	int encoderPositionOrigin { 0 };
+	int encoderCorrections { 0 }; // closed loop moves made for the current target
+	bool correctionPending { false }; // next move is issued by the closed loop
+	struct timespec lastCheckpoint;
+	struct timespec moveStart; // FOCUS_MOVE_DURATION counts from here
+	unsigned long moveReplans { 0 }; // stepper replans included in FOCUS_MOVE_DURATION
+	unsigned long positionUpdatesSent = 0;
+	unsigned long positionUpdatesSuppressed = 0;
 	
 	int resolution = 1;
 	float lastTemperature;
+	double lastCompensationHours { 0 };
+	AstroberryCompensation compensationModel;
+	bool compensationPending { false }; // next move is issued by temperature compensation
+	bool compensationMove { false }; // current move was issued by temperature compensation
+	int deferredCompensation { 0 }; // steps held back until the running exposure ends
+	void moveCompensation(int steps); // relative, clamped to the focuser travel
+	time_t lastExposureUpdate { 0 };
+	bool isExposing();
+	float getHistoryTemperature();
+	void predictPosition();
+	int filterOffsetSlot { -1 }; // slot whose offset the focuser position includes
+	int getFilterOffset(int slot) { return slot >= 1 && slot <= FILTER_OFFSET_SLOTS ? FilterOffsetN[slot - 1].value : 0; }
+	int getAppliedFilterOffset() { return FilterOffsetModeS[0].s == ISS_ON ? getFilterOffset(filterOffsetSlot) : 0; } // steps the focuser position includes
+	void applyFilterOffset();
+	AstroberryAutofocus autofocus;
+	bool autofocusPending { false }; // next move is issued by autofocus
+	bool frameExposure { false }; // snooped exposure started after the last autofocus or calibration move
+	bool isMeasuring() { return autofocus.isRunning() || calibration.isRunning(); } // focuser is busy with a measurement of its own
+	bool measureFrame(double &hfr, int &stars);
+	void startAutofocus();
+	void stopAutofocus(IPState state);
+	void autofocusMove();
+	void autofocusFrame();
+	AstroberryBacklash calibration;
+	bool calibrationPending { false }; // next move is issued by backlash calibration
+	bool calibrationByEncoder { false }; // drawtube encoder instead of frames
+	int calibrationStart { 0 }; // position to return to
+	void startCalibration();
+	void stopCalibration(IPState state);
+	void calibrationMove();
+	void calibrationSample(double value);
+	void calibrationFrame();
+	AstroberrySimulator simulator;
+	int simulationTimerID { -1 };
+	int simulationMoveStart[2] { 0, 0 }; // stepper & drawtube position when the move started
+	void updateSimulationModel();
+	void updateSimulationStats();
 };
 
 #endif
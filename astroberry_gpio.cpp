@@ -0,0 +1,871 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gpiod.h>
+
+#include "config.h"
+#include "astroberry_gpio.h"
+
+#define GPIO_EVENT_BUFFER 64 // edges taken from the kernel per read and line
+#define GPIO_EVENT_QUEUE 1024 // edges the kernel or mock chip keeps until they are read, v1 kernels keep 16 per line
+
+// one line of a bulk, writes go through the bulk so the other levels are kept
+class AstroberryGpioBulkLine : public AstroberryGpioLine
+{
+public:
+	AstroberryGpioBulkLine(AstroberryGpioBulk *bulk, unsigned int index) : bulk(bulk), index(index) {}
+	bool isUsed() override { return true; }
+	bool requestOutput(const char *consumer, int value) override { (void) consumer; (void) value; return false; }
+	bool requestInput(const char *consumer) override { (void) consumer; return false; }
+	void release() override {}
+	int getValue() override
+	{
+		std::vector<int> values(bulk->size());
+		return bulk->getValues(values.data()) ? values[index] : -1;
+	}
+	bool setValue(int value) override { return bulk->setValue(index, value); }
+private:
+	AstroberryGpioBulk *bulk;
+	unsigned int index;
+};
+
+AstroberryGpioBulk::AstroberryGpioBulk(unsigned int count, const int *values)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		levels.push_back(values[i] != 0);
+		views.emplace_back(new AstroberryGpioBulkLine(this, i));
+	}
+}
+
+AstroberryGpioBulk::~AstroberryGpioBulk()
+{
+}
+
+bool AstroberryGpioBulk::setValues(const int *values)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (!write(values))
+		return false;
+
+	for (unsigned int i = 0; i < levels.size(); i++)
+		levels[i] = values[i] != 0;
+
+	return true;
+}
+
+bool AstroberryGpioBulk::setValue(unsigned int index, int value)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (index >= levels.size())
+		return false;
+
+	// the kernel takes the levels of all lines of a request at once
+	const int previous = levels[index];
+	levels[index] = value != 0;
+	if (!write(levels.data()))
+	{
+		levels[index] = previous;
+		return false;
+	}
+
+	return true;
+}
+
+bool AstroberryGpioBulk::getValues(int *values)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return read(values);
+}
+
+AstroberryGpioLine *AstroberryGpioBulk::getLine(unsigned int index)
+{
+	return index < views.size() ? views[index].get() : nullptr;
+}
+
+bool AstroberryGpioChip::open()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (users == 0)
+	{
+		// other consumers may have come and gone while the chip was closed
+		usedIndex.clear();
+		if (!openChip())
+			return false;
+	}
+
+	users++;
+	return true;
+}
+
+void AstroberryGpioChip::close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (users > 0 && --users == 0)
+		closeChip();
+}
+
+bool AstroberryGpioChip::isUsed(unsigned int offset)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::map<unsigned int, bool>::iterator it = usedIndex.find(offset);
+	if (it == usedIndex.end())
+		it = usedIndex.insert(std::make_pair(offset, queryUsed(offset))).first;
+
+	return it->second;
+}
+
+void AstroberryGpioChip::setUsed(unsigned int offset, bool used)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	usedIndex[offset] = used;
+}
+
+#ifdef HAVE_GPIOD_V2
+// libgpiod v2 requests lines through a config, one request may hold several lines
+static struct gpiod_line_request *requestLines(struct gpiod_chip *chip, const unsigned int *offsets, unsigned int count, const char *consumer, const int *values, bool edges = false)
+{
+	struct gpiod_line_settings *settings = gpiod_line_settings_new();
+	struct gpiod_line_config *lineConfig = gpiod_line_config_new();
+	struct gpiod_request_config *requestConfig = gpiod_request_config_new();
+	struct gpiod_line_request *request = nullptr;
+
+	if (settings && lineConfig && requestConfig)
+	{
+		bool configured = true;
+		gpiod_line_settings_set_direction(settings, values ? GPIOD_LINE_DIRECTION_OUTPUT : GPIOD_LINE_DIRECTION_INPUT);
+		if (edges)
+			gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_BOTH);
+		for (unsigned int i = 0; i < count && configured; i++)
+		{
+			if (values)
+				gpiod_line_settings_set_output_value(settings, values[i] ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE);
+			configured = gpiod_line_config_add_line_settings(lineConfig, &offsets[i], 1, settings) == 0;
+		}
+		gpiod_request_config_set_consumer(requestConfig, consumer);
+		if (edges)
+			gpiod_request_config_set_event_buffer_size(requestConfig, GPIO_EVENT_QUEUE);
+		if (configured)
+			request = gpiod_chip_request_lines(chip, requestConfig, lineConfig);
+	}
+
+	if (requestConfig)
+		gpiod_request_config_free(requestConfig);
+	if (lineConfig)
+		gpiod_line_config_free(lineConfig);
+	if (settings)
+		gpiod_line_settings_free(settings);
+
+	return request;
+}
+
+class AstroberryGpiodLine : public AstroberryGpioLine
+{
+public:
+	AstroberryGpiodLine(AstroberryGpiodChip *chip, unsigned int offset) : chip(chip), offset(offset) {}
+	~AstroberryGpiodLine()
+	{
+		// requests outlive the chip in v2, the usage index goes with the closing chip
+		if (line)
+			gpiod_line_request_release(line);
+	}
+	bool isUsed() override
+	{
+		struct gpiod_line_info *info = gpiod_chip_get_line_info(chip->chip, offset);
+		if (!info)
+			return true;
+		bool used = gpiod_line_info_is_used(info);
+		gpiod_line_info_free(info);
+		return used;
+	}
+	bool requestOutput(const char *consumer, int value) override { return request(consumer, &value); }
+	bool requestInput(const char *consumer) override { return request(consumer, nullptr); }
+	void release() override
+	{
+		if (!line)
+			return;
+		gpiod_line_request_release(line);
+		line = nullptr;
+		chip->setUsed(offset, false);
+	}
+	int getValue() override { return line ? (int) gpiod_line_request_get_value(line, offset) : -1; }
+	bool setValue(int value) override
+	{
+		return line && gpiod_line_request_set_value(line, offset, value ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE) == 0;
+	}
+private:
+	bool request(const char *consumer, const int *value)
+	{
+		if (line)
+			return false;
+		line = requestLines(chip->chip, &offset, 1, consumer, value);
+		if (line)
+			chip->setUsed(offset, true);
+		return line != nullptr;
+	}
+
+	AstroberryGpiodChip *chip;
+	unsigned int offset;
+	struct gpiod_line_request *line { nullptr };
+};
+
+class AstroberryGpiodBulk : public AstroberryGpioBulk
+{
+public:
+	AstroberryGpiodBulk(AstroberryGpiodChip *chip, struct gpiod_line_request *request, const unsigned int *offsets, unsigned int count, const int *values)
+		: AstroberryGpioBulk(count, values), chip(chip), request(request), offsets(offsets, offsets + count), buffer(count) {}
+	~AstroberryGpiodBulk()
+	{
+		if (request)
+			gpiod_line_request_release(request);
+	}
+	void release() override
+	{
+		if (!request)
+			return;
+		gpiod_line_request_release(request);
+		request = nullptr;
+		for (unsigned int offset : offsets)
+			chip->setUsed(offset, false);
+	}
+protected:
+	bool write(const int *values) override
+	{
+		if (!request)
+			return false;
+		for (size_t i = 0; i < buffer.size(); i++)
+			buffer[i] = values[i] ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE;
+		return gpiod_line_request_set_values(request, buffer.data()) == 0;
+	}
+	bool read(int *values) override
+	{
+		if (!request || gpiod_line_request_get_values(request, buffer.data()) != 0)
+			return false;
+		for (size_t i = 0; i < buffer.size(); i++)
+			values[i] = buffer[i];
+		return true;
+	}
+private:
+	AstroberryGpiodChip *chip;
+	struct gpiod_line_request *request;
+	std::vector<unsigned int> offsets;
+	std::vector<enum gpiod_line_value> buffer;
+};
+
+// all lines share one request, so the kernel keeps their edges in a single queue
+class AstroberryGpiodEvents : public AstroberryGpioEvents
+{
+public:
+	AstroberryGpiodEvents(AstroberryGpiodChip *chip, struct gpiod_line_request *request, struct gpiod_edge_event_buffer *buffer, const unsigned int *offsets, unsigned int count)
+		: chip(chip), request(request), buffer(buffer), offsets(offsets, offsets + count) {}
+	~AstroberryGpiodEvents()
+	{
+		if (request)
+			gpiod_line_request_release(request);
+		gpiod_edge_event_buffer_free(buffer);
+	}
+	std::vector<int> getFds() override { return request ? std::vector<int>(1, gpiod_line_request_get_fd(request)) : std::vector<int>(); }
+	int read(AstroberryGpioEvent *events, int max) override
+	{
+		if (!request)
+			return -1;
+		int pending = gpiod_line_request_wait_edge_events(request, 0);
+		if (pending <= 0)
+			return pending;
+		int count = gpiod_line_request_read_edge_events(request, buffer, std::min(max, GPIO_EVENT_BUFFER));
+		for (int i = 0; i < count; i++)
+		{
+			struct gpiod_edge_event *event = gpiod_edge_event_buffer_get_event(buffer, i);
+			const unsigned int offset = gpiod_edge_event_get_line_offset(event);
+			events[i].timestamp = gpiod_edge_event_get_timestamp_ns(event);
+			events[i].index = std::find(offsets.begin(), offsets.end(), offset) - offsets.begin();
+			events[i].value = gpiod_edge_event_get_event_type(event) == GPIOD_EDGE_EVENT_RISING_EDGE;
+		}
+		return count;
+	}
+	int getValue(unsigned int index) override
+	{
+		return request && index < offsets.size() ? (int) gpiod_line_request_get_value(request, offsets[index]) : -1;
+	}
+	void release() override
+	{
+		if (!request)
+			return;
+		gpiod_line_request_release(request);
+		request = nullptr;
+		for (unsigned int offset : offsets)
+			chip->setUsed(offset, false);
+	}
+private:
+	AstroberryGpiodChip *chip;
+	struct gpiod_line_request *request;
+	struct gpiod_edge_event_buffer *buffer;
+	std::vector<unsigned int> offsets;
+};
+#else
+class AstroberryGpiodLine : public AstroberryGpioLine
+{
+public:
+	AstroberryGpiodLine(AstroberryGpiodChip *chip, struct gpiod_line *line, unsigned int offset) : chip(chip), line(line), offset(offset) {}
+	bool isUsed() override { return gpiod_line_is_used(line); }
+	bool requestOutput(const char *consumer, int value) override { return requested(gpiod_line_request_output(line, consumer, value) == 0); }
+	bool requestInput(const char *consumer) override { return requested(gpiod_line_request_input(line, consumer) == 0); }
+	void release() override
+	{
+		gpiod_line_release(line);
+		chip->setUsed(offset, false);
+	}
+	int getValue() override { return gpiod_line_get_value(line); }
+	bool setValue(int value) override { return gpiod_line_set_value(line, value) == 0; }
+private:
+	bool requested(bool ok)
+	{
+		if (ok)
+			chip->setUsed(offset, true);
+		return ok;
+	}
+
+	AstroberryGpiodChip *chip;
+	struct gpiod_line *line;
+	unsigned int offset;
+};
+
+class AstroberryGpiodBulk : public AstroberryGpioBulk
+{
+public:
+	AstroberryGpiodBulk(AstroberryGpiodChip *chip, const struct gpiod_line_bulk &bulk, const unsigned int *offsets, unsigned int count, const int *values)
+		: AstroberryGpioBulk(count, values), chip(chip), bulk(bulk), offsets(offsets, offsets + count) {}
+	void release() override
+	{
+		if (!requested)
+			return;
+		gpiod_line_release_bulk(&bulk);
+		requested = false;
+		for (unsigned int offset : offsets)
+			chip->setUsed(offset, false);
+	}
+protected:
+	bool write(const int *values) override { return requested && gpiod_line_set_value_bulk(&bulk, values) == 0; }
+	bool read(int *values) override { return requested && gpiod_line_get_value_bulk(&bulk, values) == 0; }
+private:
+	AstroberryGpiodChip *chip;
+	struct gpiod_line_bulk bulk;
+	std::vector<unsigned int> offsets;
+	bool requested { true };
+};
+
+// v1 queues the edges of each line separately, a read merges them by timestamp
+class AstroberryGpiodEvents : public AstroberryGpioEvents
+{
+public:
+	AstroberryGpiodEvents(AstroberryGpiodChip *chip, const std::vector<struct gpiod_line*> &lines, const unsigned int *offsets, unsigned int count)
+		: chip(chip), lines(lines), offsets(offsets, offsets + count) {}
+	std::vector<int> getFds() override
+	{
+		std::vector<int> fds;
+		for (size_t i = 0; i < lines.size() && requested; i++)
+			fds.push_back(gpiod_line_event_get_fd(lines[i]));
+		return fds;
+	}
+	int read(AstroberryGpioEvent *events, int max) override
+	{
+		if (!requested)
+			return -1;
+
+		// share the space, a busy line cannot starve the others
+		const int share = std::max(1, max / (int) lines.size());
+		const struct timespec poll = { 0, 0 };
+		struct gpiod_line_event buffer[GPIO_EVENT_BUFFER];
+		int count = 0;
+		for (unsigned int i = 0; i < lines.size() && count < max; i++)
+		{
+			if (gpiod_line_event_wait(lines[i], &poll) <= 0)
+				continue;
+			int n = gpiod_line_event_read_multiple(lines[i], buffer, std::min(std::min(share, max - count), GPIO_EVENT_BUFFER));
+			for (int j = 0; j < n; j++, count++)
+			{
+				events[count].timestamp = (int64_t) buffer[j].ts.tv_sec * 1000000000L + buffer[j].ts.tv_nsec;
+				events[count].index = i;
+				events[count].value = buffer[j].event_type == GPIOD_LINE_EVENT_RISING_EDGE;
+			}
+		}
+		std::stable_sort(events, events + count, [](const AstroberryGpioEvent &a, const AstroberryGpioEvent &b) { return a.timestamp < b.timestamp; });
+
+		return count;
+	}
+	int getValue(unsigned int index) override { return requested && index < lines.size() ? gpiod_line_get_value(lines[index]) : -1; }
+	void release() override
+	{
+		if (!requested)
+			return;
+		for (struct gpiod_line *line : lines)
+			gpiod_line_release(line);
+		requested = false;
+		for (unsigned int offset : offsets)
+			chip->setUsed(offset, false);
+	}
+private:
+	AstroberryGpiodChip *chip;
+	std::vector<struct gpiod_line*> lines;
+	std::vector<unsigned int> offsets;
+	bool requested { true };
+};
+#endif
+
+AstroberryGpiodChip &AstroberryGpiodChip::shared(const char *path)
+{
+	static std::mutex mutex;
+	static std::map<std::string, std::unique_ptr<AstroberryGpiodChip>> chips;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::unique_ptr<AstroberryGpiodChip> &chip = chips[path];
+	if (!chip)
+		chip.reset(new AstroberryGpiodChip(path));
+
+	return *chip;
+}
+
+AstroberryGpiodChip::AstroberryGpiodChip(const char *path) : path(path)
+{
+}
+
+AstroberryGpiodChip::~AstroberryGpiodChip()
+{
+	closeChip();
+}
+
+bool AstroberryGpiodChip::openChip()
+{
+	chip = gpiod_chip_open(path.c_str());
+	return chip != nullptr;
+}
+
+void AstroberryGpiodChip::closeChip()
+{
+	// closing the chip releases all its lines
+	events.clear();
+	bulks.clear();
+	lines.clear();
+	if (chip)
+		gpiod_chip_close(chip);
+	chip = nullptr;
+}
+
+bool AstroberryGpiodChip::queryUsed(unsigned int offset)
+{
+	// a line that does not exist cannot be used by us either
+	AstroberryGpioLine *line = getLine(offset);
+	return !line || line->isUsed();
+}
+
+AstroberryGpioLine *AstroberryGpiodChip::getLine(unsigned int offset)
+{
+	if (!chip)
+		return nullptr;
+
+	std::unique_ptr<AstroberryGpioLine> &line = lines[offset];
+	if (!line)
+	{
+#ifdef HAVE_GPIOD_V2
+		struct gpiod_line_info *info = gpiod_chip_get_line_info(chip, offset);
+		if (!info)
+		{
+			lines.erase(offset);
+			return nullptr;
+		}
+		gpiod_line_info_free(info);
+		line.reset(new AstroberryGpiodLine(this, offset));
+#else
+		struct gpiod_line *gpiodLine = gpiod_chip_get_line(chip, offset);
+		if (!gpiodLine)
+		{
+			lines.erase(offset);
+			return nullptr;
+		}
+		line.reset(new AstroberryGpiodLine(this, gpiodLine, offset));
+#endif
+	}
+
+	return line.get();
+}
+
+AstroberryGpioBulk *AstroberryGpiodChip::requestOutputs(const unsigned int *offsets, unsigned int count, const char *consumer, const int *values)
+{
+	if (!chip || count == 0)
+		return nullptr;
+
+#ifdef HAVE_GPIOD_V2
+	struct gpiod_line_request *request = requestLines(chip, offsets, count, consumer, values);
+	if (!request)
+		return nullptr;
+	bulks.emplace_back(new AstroberryGpiodBulk(this, request, offsets, count, values));
+#else
+	struct gpiod_line_bulk bulk;
+	gpiod_line_bulk_init(&bulk);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		struct gpiod_line *line = gpiod_chip_get_line(chip, offsets[i]);
+		if (!line)
+			return nullptr;
+		gpiod_line_bulk_add(&bulk, line);
+	}
+	if (gpiod_line_request_bulk_output(&bulk, consumer, values) != 0)
+		return nullptr;
+	bulks.emplace_back(new AstroberryGpiodBulk(this, bulk, offsets, count, values));
+#endif
+
+	for (unsigned int i = 0; i < count; i++)
+		setUsed(offsets[i], true);
+
+	return bulks.back().get();
+}
+
+AstroberryGpioEvents *AstroberryGpiodChip::requestEvents(const unsigned int *offsets, unsigned int count, const char *consumer)
+{
+	if (!chip || count == 0)
+		return nullptr;
+
+#ifdef HAVE_GPIOD_V2
+	struct gpiod_edge_event_buffer *buffer = gpiod_edge_event_buffer_new(GPIO_EVENT_BUFFER);
+	if (!buffer)
+		return nullptr;
+	struct gpiod_line_request *request = requestLines(chip, offsets, count, consumer, nullptr, true);
+	if (!request)
+	{
+		gpiod_edge_event_buffer_free(buffer);
+		return nullptr;
+	}
+	events.emplace_back(new AstroberryGpiodEvents(this, request, buffer, offsets, count));
+#else
+	std::vector<struct gpiod_line*> requested;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		struct gpiod_line *line = gpiod_chip_get_line(chip, offsets[i]);
+		if (!line || gpiod_line_request_both_edges_events(line, consumer) != 0)
+		{
+			for (struct gpiod_line *r : requested)
+				gpiod_line_release(r);
+			return nullptr;
+		}
+		requested.push_back(line);
+	}
+	events.emplace_back(new AstroberryGpiodEvents(this, requested, offsets, count));
+#endif
+
+	for (unsigned int i = 0; i < count; i++)
+		setUsed(offsets[i], true);
+
+	return events.back().get();
+}
+
+class AstroberryMockEvents;
+
+class AstroberryMockLine : public AstroberryGpioLine
+{
+public:
+	AstroberryMockLine(AstroberryMockChip *chip, unsigned int offset) : chip(chip), offset(offset) {}
+	bool isUsed() override { return mode != AstroberryMockChip::LINE_UNUSED; }
+	bool requestOutput(const char *consumer, int value) override
+	{
+		(void) consumer;
+		if (mode != AstroberryMockChip::LINE_UNUSED)
+			return false;
+		mode = AstroberryMockChip::LINE_OUTPUT;
+		setLevel(value);
+		chip->setUsed(offset, true);
+		return true;
+	}
+	bool requestInput(const char *consumer) override
+	{
+		(void) consumer;
+		if (mode != AstroberryMockChip::LINE_UNUSED)
+			return false;
+		mode = AstroberryMockChip::LINE_INPUT;
+		chip->setUsed(offset, true);
+		return true;
+	}
+	void release() override
+	{
+		mode = AstroberryMockChip::LINE_UNUSED;
+		chip->setUsed(offset, false);
+	}
+	int getValue() override { return mode == AstroberryMockChip::LINE_UNUSED ? -1 : level.load(); }
+	bool setValue(int value) override
+	{
+		if (mode != AstroberryMockChip::LINE_OUTPUT)
+			return false;
+		setLevel(value);
+		return true;
+	}
+	void setLevel(int value);
+
+	std::atomic<int> mode { AstroberryMockChip::LINE_UNUSED };
+	std::atomic<int> level { 0 };
+	std::atomic<AstroberryMockEvents*> events { nullptr };
+	unsigned int eventIndex { 0 };
+private:
+	AstroberryMockChip *chip;
+	unsigned int offset;
+};
+
+// mock lines of a bulk are written one after another, listeners see one change per line
+class AstroberryMockBulk : public AstroberryGpioBulk
+{
+public:
+	AstroberryMockBulk(const std::vector<AstroberryMockLine*> &lines, const int *values) : AstroberryGpioBulk(lines.size(), values), lines(lines) {}
+	void release() override
+	{
+		for (AstroberryMockLine *line : lines)
+			line->release();
+	}
+protected:
+	bool write(const int *values) override
+	{
+		for (AstroberryMockLine *line : lines)
+			if (line->mode != AstroberryMockChip::LINE_OUTPUT)
+				return false;
+		for (size_t i = 0; i < lines.size(); i++)
+			lines[i]->setLevel(values[i]);
+		return true;
+	}
+	bool read(int *values) override
+	{
+		for (size_t i = 0; i < lines.size(); i++)
+			values[i] = lines[i]->getValue();
+		return true;
+	}
+private:
+	std::vector<AstroberryMockLine*> lines;
+};
+
+// edges are queued with the time they were injected, the pipe is readable while the queue is not empty
+class AstroberryMockEvents : public AstroberryGpioEvents
+{
+public:
+	AstroberryMockEvents(const std::vector<AstroberryMockLine*> &lines, const int *fds) : lines(lines)
+	{
+		pipeFd[0] = fds[0];
+		pipeFd[1] = fds[1];
+		for (size_t i = 0; i < lines.size(); i++)
+		{
+			lines[i]->eventIndex = i;
+			lines[i]->events = this;
+		}
+	}
+	~AstroberryMockEvents()
+	{
+		release();
+		close(pipeFd[0]);
+		close(pipeFd[1]);
+	}
+	std::vector<int> getFds() override { return std::vector<int>(1, pipeFd[0]); }
+	int read(AstroberryGpioEvent *events, int max) override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!requested)
+			return -1;
+		int count = 0;
+		for (; count < max && !queue.empty(); count++)
+		{
+			events[count] = queue.front();
+			queue.pop_front();
+		}
+		char buf[64];
+		if (queue.empty())
+			while (::read(pipeFd[0], buf, sizeof(buf)) > 0);
+		return count;
+	}
+	int getValue(unsigned int index) override { return index < lines.size() ? lines[index]->getValue() : -1; }
+	void release() override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!requested)
+			return;
+		for (AstroberryMockLine *line : lines)
+		{
+			line->events = nullptr;
+			line->release();
+		}
+		requested = false;
+	}
+	void push(unsigned int index, int value)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!requested || queue.size() >= GPIO_EVENT_QUEUE)
+			return;
+		AstroberryGpioEvent event = { (int64_t) ts.tv_sec * 1000000000L + ts.tv_nsec, index, value };
+		queue.push_back(event);
+		char c = 0;
+		if (write(pipeFd[1], &c, 1) < 0)
+			return;
+	}
+private:
+	std::mutex mutex;
+	std::vector<AstroberryMockLine*> lines;
+	std::deque<AstroberryGpioEvent> queue;
+	int pipeFd[2];
+	bool requested { true };
+};
+
+void AstroberryMockLine::setLevel(int value)
+{
+	if (level.exchange(value != 0) == (value != 0))
+		return;
+
+	AstroberryMockEvents *queue = events.load();
+	if (queue)
+		queue->push(eventIndex, value != 0);
+	chip->changed(offset, value != 0);
+}
+
+AstroberryMockChip::AstroberryMockChip(unsigned int lines) : count(lines)
+{
+}
+
+AstroberryMockChip::~AstroberryMockChip()
+{
+	closeChip();
+}
+
+bool AstroberryMockChip::openChip()
+{
+	opened = true;
+	return true;
+}
+
+void AstroberryMockChip::closeChip()
+{
+	events.clear();
+	bulks.clear();
+	lines.clear();
+	opened = false;
+}
+
+bool AstroberryMockChip::queryUsed(unsigned int offset)
+{
+	AstroberryGpioLine *line = getLine(offset);
+	return !line || line->isUsed();
+}
+
+AstroberryGpioLine *AstroberryMockChip::getLine(unsigned int offset)
+{
+	if (!opened || offset >= count)
+		return nullptr;
+
+	std::unique_ptr<AstroberryGpioLine> &line = lines[offset];
+	if (!line)
+		line.reset(new AstroberryMockLine(this, offset));
+
+	return line.get();
+}
+
+AstroberryGpioBulk *AstroberryMockChip::requestOutputs(const unsigned int *offsets, unsigned int count, const char *consumer, const int *values)
+{
+	std::vector<AstroberryMockLine*> requested;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		AstroberryMockLine *line = static_cast<AstroberryMockLine*>(getLine(offsets[i]));
+		if (!line || !line->requestOutput(consumer, values[i]))
+		{
+			// all or nothing, like a kernel request
+			for (AstroberryMockLine *r : requested)
+				r->release();
+			return nullptr;
+		}
+		requested.push_back(line);
+	}
+
+	if (requested.empty())
+		return nullptr;
+
+	bulks.emplace_back(new AstroberryMockBulk(requested, values));
+	return bulks.back().get();
+}
+
+AstroberryGpioEvents *AstroberryMockChip::requestEvents(const unsigned int *offsets, unsigned int count, const char *consumer)
+{
+	std::vector<AstroberryMockLine*> requested;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		AstroberryMockLine *line = static_cast<AstroberryMockLine*>(getLine(offsets[i]));
+		if (!line || !line->requestInput(consumer))
+		{
+			for (AstroberryMockLine *r : requested)
+				r->release();
+			return nullptr;
+		}
+		requested.push_back(line);
+	}
+
+	int fds[2];
+	if (requested.empty() || pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		for (AstroberryMockLine *r : requested)
+			r->release();
+		return nullptr;
+	}
+
+	events.emplace_back(new AstroberryMockEvents(requested, fds));
+	return events.back().get();
+}
+
+int AstroberryMockChip::getMode(unsigned int offset)
+{
+	AstroberryMockLine *line = static_cast<AstroberryMockLine*>(getLine(offset));
+	return line ? line->mode.load() : (int) LINE_UNUSED;
+}
+
+int AstroberryMockChip::getLevel(unsigned int offset)
+{
+	AstroberryMockLine *line = static_cast<AstroberryMockLine*>(getLine(offset));
+	return line ? line->level.load() : 0;
+}
+
+void AstroberryMockChip::setInput(unsigned int offset, int value)
+{
+	AstroberryMockLine *line = static_cast<AstroberryMockLine*>(getLine(offset));
+	if (line && line->mode != LINE_OUTPUT)
+		line->setLevel(value);
+}
+
+void AstroberryMockChip::changed(unsigned int offset, int value)
+{
+	if (!listener)
+		return;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	listener->lineChanged(offset, value, (int64_t) ts.tv_sec * 1000000000L + ts.tv_nsec);
+}
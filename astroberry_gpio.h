@@ -0,0 +1,187 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYGPIO_H
+#define ASTROBERRYGPIO_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define ASTROBERRY_GPIO_CHIP "/dev/gpiochip0" // Raspberry Pi header gpios
+
+/*
+ * GPIO lines
+ *
+ * Drivers request and drive lines through these interfaces instead of calling
+ * libgpiod directly, so the same code runs on libgpiod v1 or v2 and against
+ * the in-memory mock chip used by simulation. Lines are owned by their chip
+ * and stay valid until the chip is closed.
+ *
+ * Lines that always switch together are requested as one bulk. A bulk is a
+ * single kernel request, so all its levels are written or read in one ioctl.
+ */
+class AstroberryGpioLine
+{
+public:
+	virtual ~AstroberryGpioLine() {}
+	virtual bool isUsed() = 0; // requested by any consumer
+	virtual bool requestOutput(const char *consumer, int value) = 0;
+	virtual bool requestInput(const char *consumer) = 0;
+	virtual void release() = 0;
+	virtual int getValue() = 0;
+	virtual bool setValue(int value) = 0;
+};
+
+// output lines requested together, levels are kept here as every write carries all of them
+class AstroberryGpioBulk
+{
+public:
+	virtual ~AstroberryGpioBulk();
+	unsigned int size() const { return levels.size(); }
+	bool setValues(const int *values); // one value per line, in request order
+	bool setValue(unsigned int index, int value);
+	bool getValues(int *values);
+	AstroberryGpioLine *getLine(unsigned int index); // single line view, cannot be released on its own
+	virtual void release() = 0;
+protected:
+	AstroberryGpioBulk(unsigned int count, const int *values);
+	virtual bool write(const int *values) = 0;
+	virtual bool read(int *values) = 0;
+private:
+	std::mutex mutex;
+	std::vector<int> levels;
+	std::vector<std::unique_ptr<AstroberryGpioLine>> views;
+};
+
+// edge of an input line, as reported by the kernel
+struct AstroberryGpioEvent
+{
+	int64_t timestamp; // ns, kernel event clock
+	unsigned int index; // line in request order
+	int value; // level after the edge
+};
+
+/*
+ * Edge events of input lines requested together, both edges of every line.
+ * The kernel queues events until they are read, so a reader waking up late
+ * gets all of them in one batch rather than only the latest level.
+ */
+class AstroberryGpioEvents
+{
+public:
+	virtual ~AstroberryGpioEvents() {}
+	virtual std::vector<int> getFds() = 0; // readable while events are queued
+	virtual int read(AstroberryGpioEvent *events, int max) = 0; // queued events oldest first, never blocks, -1 on error
+	virtual int getValue(unsigned int index) = 0;
+	virtual void release() = 0;
+};
+
+class AstroberryGpioChip
+{
+public:
+	virtual ~AstroberryGpioChip() {}
+	bool open(); // counted, the chip stays open until every open is matched by a close
+	void close();
+	bool isOpen() const { return users > 0; }
+	bool isUsed(unsigned int offset); // cached until the chip is closed, tracks our own requests
+	virtual AstroberryGpioLine *getLine(unsigned int offset) = 0; // nullptr if there is no such line
+	virtual AstroberryGpioBulk *requestOutputs(const unsigned int *offsets, unsigned int count, const char *consumer, const int *values) = 0; // nullptr on failure
+	virtual AstroberryGpioEvents *requestEvents(const unsigned int *offsets, unsigned int count, const char *consumer) = 0; // nullptr on failure
+protected:
+	virtual bool openChip() = 0;
+	virtual void closeChip() = 0;
+	virtual bool queryUsed(unsigned int offset) = 0;
+	void setUsed(unsigned int offset, bool used);
+private:
+	std::mutex mutex;
+	int users { 0 };
+	std::map<unsigned int, bool> usedIndex;
+};
+
+// /dev/gpiochipN through libgpiod, one instance per chip and process
+class AstroberryGpiodChip : public AstroberryGpioChip
+{
+public:
+	static AstroberryGpiodChip &shared(const char *path = ASTROBERRY_GPIO_CHIP);
+	~AstroberryGpiodChip();
+	AstroberryGpioLine *getLine(unsigned int offset) override;
+	AstroberryGpioBulk *requestOutputs(const unsigned int *offsets, unsigned int count, const char *consumer, const int *values) override;
+	AstroberryGpioEvents *requestEvents(const unsigned int *offsets, unsigned int count, const char *consumer) override;
+protected:
+	bool openChip() override;
+	void closeChip() override;
+	bool queryUsed(unsigned int offset) override;
+private:
+	friend class AstroberryGpiodLine;
+	friend class AstroberryGpiodBulk;
+	friend class AstroberryGpiodEvents;
+	explicit AstroberryGpiodChip(const char *path);
+
+	std::string path;
+	struct gpiod_chip *chip { nullptr };
+	std::map<unsigned int, std::unique_ptr<AstroberryGpioLine>> lines;
+	std::vector<std::unique_ptr<AstroberryGpioBulk>> bulks;
+	std::vector<std::unique_ptr<AstroberryGpioEvents>> events;
+};
+
+// receives every level change on a mock chip, from the thread driving the line
+class AstroberryGpioListener
+{
+public:
+	virtual ~AstroberryGpioListener() {}
+	virtual void lineChanged(unsigned int offset, int value, int64_t timestamp) = 0; // CLOCK_MONOTONIC ns
+};
+
+// in-memory chip, lines keep their level and report changes to the listener, edges of event lines are queued as well
+class AstroberryMockChip : public AstroberryGpioChip
+{
+public:
+	enum { LINE_UNUSED, LINE_INPUT, LINE_OUTPUT };
+
+	explicit AstroberryMockChip(unsigned int lines = 54);
+	~AstroberryMockChip();
+	AstroberryGpioLine *getLine(unsigned int offset) override;
+	AstroberryGpioBulk *requestOutputs(const unsigned int *offsets, unsigned int count, const char *consumer, const int *values) override;
+	AstroberryGpioEvents *requestEvents(const unsigned int *offsets, unsigned int count, const char *consumer) override;
+	void setListener(AstroberryGpioListener *listener) { this->listener = listener; }
+	int getMode(unsigned int offset);
+	int getLevel(unsigned int offset);
+	void setInput(unsigned int offset, int value); // level seen by an input line, an edge for event lines
+protected:
+	bool openChip() override;
+	void closeChip() override;
+	bool queryUsed(unsigned int offset) override;
+private:
+	friend class AstroberryMockLine;
+	friend class AstroberryMockBulk;
+	friend class AstroberryMockEvents;
+	void changed(unsigned int offset, int value);
+
+	unsigned int count;
+	bool opened { false };
+	AstroberryGpioListener *listener { nullptr };
+	std::map<unsigned int, std::unique_ptr<AstroberryGpioLine>> lines;
+	std::vector<std::unique_ptr<AstroberryGpioBulk>> bulks;
+	std::vector<std::unique_ptr<AstroberryGpioEvents>> events;
+};
+
+#endif
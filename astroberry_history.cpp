@@ -0,0 +1,243 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <algorithm>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "astroberry_history.h"
+
+#define HISTORY_ALL_FILTERS INT_MIN // index key holding records of all filters
+#define HISTORY_NEIGHBOURS 4 // records interpolated per prediction
+#define HISTORY_ALTITUDE_SCALE 10.0 // degrees of altitude weighted as 1°C
+
+AstroberryHistory::AstroberryHistory()
+{
+}
+
+AstroberryHistory::~AstroberryHistory()
+{
+	close();
+}
+
+uint16_t AstroberryHistory::fletcher16(const void *data, size_t length)
+{
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	uint16_t sum1 = 0, sum2 = 0;
+
+	while (length--)
+	{
+		sum1 = (sum1 + *p++) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+
+	return (sum2 << 8) | sum1;
+}
+
+bool AstroberryHistory::open(const char *fileName)
+{
+	close();
+
+	fd = ::open(fileName, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close();
+		return false;
+	}
+
+	// a record torn by power loss is cut off, so appends stay aligned
+	size_t count = st.st_size / sizeof(AstroberryFocusRecord);
+	if ((off_t) (count * sizeof(AstroberryFocusRecord)) != st.st_size && ftruncate(fd, count * sizeof(AstroberryFocusRecord)) != 0)
+	{
+		close();
+		return false;
+	}
+
+	std::vector<AstroberryFocusRecord> file(count);
+	if (count > 0 && pread(fd, file.data(), count * sizeof(AstroberryFocusRecord), 0) != (ssize_t) (count * sizeof(AstroberryFocusRecord)))
+	{
+		close();
+		return false;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (file[i].check != fletcher16(&file[i], offsetof(AstroberryFocusRecord, check)))
+			continue;
+		records.push_back(file[i]);
+		index(records.size() - 1);
+	}
+
+	return true;
+}
+
+void AstroberryHistory::close()
+{
+	if (fd >= 0)
+		::close(fd);
+
+	fd = -1;
+	records.clear();
+	byFilter.clear();
+}
+
+void AstroberryHistory::index(size_t i)
+{
+	const AstroberryFocusRecord &record = records[i];
+
+	// only records with known temperature can be interpolated
+	if (isnan(record.temperature))
+		return;
+
+	const int keys[2] = { record.filter, HISTORY_ALL_FILTERS };
+	for (int k = 0; k < 2; k++)
+	{
+		std::vector<size_t> &list = byFilter[keys[k]];
+		std::vector<size_t>::iterator it = std::upper_bound(list.begin(), list.end(), i,
+			[this](size_t a, size_t b) { return records[a].temperature < records[b].temperature; });
+		list.insert(it, i);
+	}
+}
+
+bool AstroberryHistory::append(int position, float temperature, float altitude, int filter)
+{
+	if (fd < 0)
+		return false;
+
+	AstroberryFocusRecord record;
+	record.timestamp = time(nullptr);
+	record.position = position;
+	record.temperature = temperature;
+	record.altitude = altitude;
+	record.filter = filter;
+	record.check = fletcher16(&record, offsetof(AstroberryFocusRecord, check));
+
+	if (write(fd, &record, sizeof(record)) != sizeof(record))
+		return false;
+
+	records.push_back(record);
+	index(records.size() - 1);
+
+	return true;
+}
+
+bool AstroberryHistory::predict(float temperature, float altitude, int filter, double &position, int &matches) const
+{
+	matches = 0;
+
+	// without temperature the last focus with this filter is the best guess
+	if (isnan(temperature))
+	{
+		for (size_t i = records.size(); i-- > 0; )
+		{
+			if (records[i].filter == filter)
+			{
+				position = records[i].position;
+				matches = 1;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// fall back to all filters if this one has never been focused
+	std::map<int, std::vector<size_t>>::const_iterator it = byFilter.find(filter);
+	if (it == byFilter.end())
+		it = byFilter.find(HISTORY_ALL_FILTERS);
+	if (it == byFilter.end())
+		return false;
+	const std::vector<size_t> &list = it->second;
+
+	// walk out from the requested temperature until no closer record can follow
+	size_t hi = std::lower_bound(list.begin(), list.end(), temperature,
+		[this](size_t a, float t) { return records[a].temperature < t; }) - list.begin();
+	size_t lo = hi;
+	double distance[HISTORY_NEIGHBOURS];
+	size_t nearest[HISTORY_NEIGHBOURS];
+	int found = 0;
+
+	while (lo > 0 || hi < list.size())
+	{
+		// next candidate is the one closer in temperature
+		size_t candidate;
+		if (lo == 0)
+			candidate = list[hi++];
+		else if (hi == list.size())
+			candidate = list[--lo];
+		else if (temperature - records[list[lo - 1]].temperature < records[list[hi]].temperature - temperature)
+			candidate = list[--lo];
+		else
+			candidate = list[hi++];
+
+		const AstroberryFocusRecord &record = records[candidate];
+		double dt = fabs(record.temperature - temperature);
+		if (found == HISTORY_NEIGHBOURS && dt >= distance[found - 1])
+			break;
+
+		double da = isnan(altitude) || isnan(record.altitude) ? 0 : (record.altitude - altitude) / HISTORY_ALTITUDE_SCALE;
+		double d = sqrt(dt * dt + da * da);
+
+		// keep the nearest records sorted by distance
+		int slot;
+		if (found < HISTORY_NEIGHBOURS)
+			slot = found++;
+		else if (d < distance[HISTORY_NEIGHBOURS - 1])
+			slot = HISTORY_NEIGHBOURS - 1;
+		else
+			continue;
+		while (slot > 0 && distance[slot - 1] > d)
+		{
+			distance[slot] = distance[slot - 1];
+			nearest[slot] = nearest[slot - 1];
+			slot--;
+		}
+		distance[slot] = d;
+		nearest[slot] = candidate;
+	}
+
+	if (found == 0)
+		return false;
+
+	// inverse distance weighting, an exact match wins
+	double sum = 0, weights = 0;
+	for (int i = 0; i < found; i++)
+	{
+		if (distance[i] < 1e-3)
+		{
+			position = records[nearest[i]].position;
+			matches = 1;
+			return true;
+		}
+		double w = 1 / (distance[i] * distance[i]);
+		sum += w * records[nearest[i]].position;
+		weights += w;
+	}
+
+	position = sum / weights;
+	matches = found;
+	return true;
+}
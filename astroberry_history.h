@@ -0,0 +1,66 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYHISTORY_H
+#define ASTROBERRYHISTORY_H
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Focus history
+ *
+ * Every settled focus position is appended to a binary file of fixed-size
+ * records. The whole file is loaded on open and indexed in memory by filter
+ * slot, each slot sorted by temperature. A prediction looks up the nearest
+ * records around the requested temperature and altitude and interpolates
+ * their positions with inverse distance weights.
+ */
+struct AstroberryFocusRecord
+{
+	uint32_t timestamp;	// unix time
+	int32_t position;	// MAX_RESOLUTION units
+	float temperature;	// °C, NAN if unknown
+	float altitude;		// degrees, NAN if unknown
+	int16_t filter;		// filter slot, -1 if unknown
+	uint16_t check;		// Fletcher-16 of the fields above
+};
+
+class AstroberryHistory
+{
+public:
+	AstroberryHistory();
+	~AstroberryHistory();
+	bool open(const char *fileName);
+	void close();
+	bool isOpen() const { return fd >= 0; }
+	bool append(int position, float temperature, float altitude, int filter);
+	bool predict(float temperature, float altitude, int filter, double &position, int &matches) const;
+	size_t size() const { return records.size(); }
+private:
+	static uint16_t fletcher16(const void *data, size_t length);
+	void index(size_t i);
+
+	int fd { -1 };
+	std::vector<AstroberryFocusRecord> records;
+	std::map<int, std::vector<size_t>> byFilter; // record indexes sorted by temperature
+};
+
+#endif
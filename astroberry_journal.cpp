@@ -0,0 +1,138 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <vector>
+
+#include "astroberry_journal.h"
+
+#define JOURNAL_MAGIC 0xAB01
+#define JOURNAL_RECORDS 4096 // 64 kB ring
+
+AstroberryJournal::AstroberryJournal()
+{
+}
+
+AstroberryJournal::~AstroberryJournal()
+{
+	close();
+}
+
+uint32_t AstroberryJournal::crc32(const void *data, size_t length)
+{
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	uint32_t crc = 0xFFFFFFFF;
+
+	while (length--)
+	{
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+bool AstroberryJournal::open(const char *fileName)
+{
+	close();
+
+	fd = ::open(fileName, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	// allocate the whole ring up front, unused records read back as zeros
+	if (posix_fallocate(fd, 0, JOURNAL_RECORDS * sizeof(AstroberryJournalRecord)) != 0)
+	{
+		close();
+		return false;
+	}
+
+	// continue the sequence after the newest valid record
+	AstroberryJournalRecord record;
+	sequence = recover(record) ? record.sequence + 1 : 0;
+
+	return true;
+}
+
+void AstroberryJournal::close()
+{
+	if (fd < 0)
+		return;
+
+	fdatasync(fd);
+	::close(fd);
+	fd = -1;
+}
+
+bool AstroberryJournal::recover(AstroberryJournalRecord &record)
+{
+	if (fd < 0)
+		return false;
+
+	// a single read of the whole ring
+	std::vector<AstroberryJournalRecord> records(JOURNAL_RECORDS);
+	ssize_t length = pread(fd, records.data(), records.size() * sizeof(AstroberryJournalRecord), 0);
+	if (length <= 0)
+		return false;
+
+	bool found = false;
+	size_t count = length / sizeof(AstroberryJournalRecord);
+	for (size_t i = 0; i < count; i++)
+	{
+		const AstroberryJournalRecord &r = records[i];
+		if (r.magic != JOURNAL_MAGIC || r.crc != crc32(&r, offsetof(AstroberryJournalRecord, crc)))
+			continue;
+
+		// sequence numbers may wrap, compare by difference
+		if (!found || (int32_t) (r.sequence - record.sequence) > 0)
+		{
+			record = r;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+bool AstroberryJournal::append(int position, int resolution, bool atRest)
+{
+	if (fd < 0)
+		return false;
+
+	AstroberryJournalRecord record;
+	record.magic = JOURNAL_MAGIC;
+	record.flags = atRest ? JOURNAL_AT_REST : 0;
+	record.resolution = resolution;
+	record.sequence = sequence;
+	record.position = position;
+	record.crc = crc32(&record, offsetof(AstroberryJournalRecord, crc));
+
+	off_t offset = (off_t) (sequence % JOURNAL_RECORDS) * sizeof(AstroberryJournalRecord);
+	if (pwrite(fd, &record, sizeof(record), offset) != sizeof(record))
+		return false;
+
+	sequence++;
+
+	if (syncPolicy == SYNC_ALWAYS || (syncPolicy == SYNC_AT_REST && atRest))
+		return fdatasync(fd) == 0;
+
+	return true;
+}
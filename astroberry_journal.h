@@ -0,0 +1,67 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYJOURNAL_H
+#define ASTROBERRYJOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Position journal
+ *
+ * A pre-allocated file used as a ring of fixed-size records. Every record is
+ * written in place with a single pwrite, so the file never grows or gets
+ * rewritten and the SD card only sees small writes. Records carry a sequence
+ * number and a CRC; a torn write fails the check and recovery falls back to
+ * the newest record that is still valid.
+ */
+struct AstroberryJournalRecord
+{
+	uint16_t magic;
+	uint8_t flags;		// JOURNAL_AT_REST when the motor was not moving
+	uint8_t resolution;	// position units per full step
+	uint32_t sequence;
+	int32_t position;
+	uint32_t crc;
+};
+
+class AstroberryJournal
+{
+public:
+	enum { SYNC_NONE, SYNC_AT_REST, SYNC_ALWAYS };
+	enum { JOURNAL_AT_REST = 1 };
+
+	AstroberryJournal();
+	~AstroberryJournal();
+	bool open(const char *fileName);
+	void close();
+	bool isOpen() const { return fd >= 0; }
+	bool recover(AstroberryJournalRecord &record);
+	bool append(int position, int resolution, bool atRest);
+	void setSyncPolicy(int policy) { syncPolicy = policy; }
+	uint32_t getSequence() const { return sequence; }
+private:
+	static uint32_t crc32(const void *data, size_t length);
+
+	int fd { -1 };
+	int syncPolicy { SYNC_AT_REST };
+	uint32_t sequence { 0 };
+};
+
+#endif
@@ -0,0 +1,490 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "astroberry_metrics.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define METRICS_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define METRICS_SSE2
+#endif
+
+#define FITS_BLOCK 2880
+#define FITS_CARD 80
+#define METRICS_STAR_SIGMA 5 // detection threshold above background in noise units
+#define METRICS_STAR_RADIUS 16 // pixels measured around a star
+#define METRICS_MAX_STARS 50 // brightest stars used for the median
+
+#if defined(METRICS_NEON) || defined(METRICS_SSE2)
+bool AstroberryMetrics::vectorized = true;
+#else
+bool AstroberryMetrics::vectorized = false;
+#endif
+
+bool AstroberryMetrics::setVectorized(bool enable)
+{
+#if defined(METRICS_NEON) || defined(METRICS_SSE2)
+	vectorized = enable;
+	return true;
+#else
+	return !enable;
+#endif
+}
+
+const char *AstroberryMetrics::getVectorization()
+{
+#if defined(METRICS_NEON)
+	return vectorized ? "NEON" : "scalar";
+#elif defined(METRICS_SSE2)
+	return vectorized ? "SSE2" : "scalar";
+#else
+	return "scalar";
+#endif
+}
+
+// 8 pixel kernels, sums of x and x² are kept in 4 float lanes
+#if defined(METRICS_NEON)
+typedef float32x4_t vsum_t;
+static inline vsum_t vzero() { return vdupq_n_f32(0); }
+
+static inline double vreduce(vsum_t v)
+{
+	float lanes[4];
+	vst1q_f32(lanes, v);
+	return (double) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static inline void vaccumulate(int32x4_t v, vsum_t &sum, vsum_t &squares)
+{
+	float32x4_t f = vcvtq_f32_s32(v);
+	sum = vaddq_f32(sum, f);
+	squares = vmlaq_f32(squares, f, f);
+}
+
+static inline void vsquare(int32x4_t v, vsum_t &squares)
+{
+	float32x4_t f = vcvtq_f32_s32(v);
+	squares = vmlaq_f32(squares, f, f);
+}
+
+// 4 * centre - left - right - up - down
+static inline void vlaplacian(const uint16_t *up, const uint16_t *row, const uint16_t *down, vsum_t &sum, vsum_t &squares)
+{
+	uint16x8_t c = vld1q_u16(row), l = vld1q_u16(row - 1), r = vld1q_u16(row + 1), u = vld1q_u16(up), d = vld1q_u16(down);
+	int32x4_t lo = vreinterpretq_s32_u32(vshll_n_u16(vget_low_u16(c), 2));
+	lo = vsubq_s32(lo, vreinterpretq_s32_u32(vaddl_u16(vget_low_u16(l), vget_low_u16(r))));
+	lo = vsubq_s32(lo, vreinterpretq_s32_u32(vaddl_u16(vget_low_u16(u), vget_low_u16(d))));
+	int32x4_t hi = vreinterpretq_s32_u32(vshll_n_u16(vget_high_u16(c), 2));
+	hi = vsubq_s32(hi, vreinterpretq_s32_u32(vaddl_u16(vget_high_u16(l), vget_high_u16(r))));
+	hi = vsubq_s32(hi, vreinterpretq_s32_u32(vaddl_u16(vget_high_u16(u), vget_high_u16(d))));
+	vaccumulate(lo, sum, squares);
+	vaccumulate(hi, sum, squares);
+}
+
+// pixel 2 to the right minus pixel
+static inline void vgradient(const uint16_t *row, vsum_t &squares)
+{
+	uint16x8_t a = vld1q_u16(row), b = vld1q_u16(row + 2);
+	vsquare(vreinterpretq_s32_u32(vsubl_u16(vget_low_u16(b), vget_low_u16(a))), squares);
+	vsquare(vreinterpretq_s32_u32(vsubl_u16(vget_high_u16(b), vget_high_u16(a))), squares);
+}
+
+static inline bool vabove(const uint16_t *p, uint16_t threshold)
+{
+	uint16x8_t above = vcgtq_u16(vld1q_u16(p), vdupq_n_u16(threshold));
+	uint16x4_t any = vorr_u16(vget_low_u16(above), vget_high_u16(above));
+	return vget_lane_u64(vreinterpret_u64_u16(any), 0) != 0;
+}
+
+// big endian signed to unsigned, i.e. swap bytes & flip the sign bit
+static inline void vfits16(const uint8_t *in, uint16_t *out)
+{
+	uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(in)));
+	vst1q_u16(out, veorq_u16(v, vdupq_n_u16(0x8000)));
+}
+#elif defined(METRICS_SSE2)
+typedef __m128 vsum_t;
+static inline vsum_t vzero() { return _mm_setzero_ps(); }
+
+static inline double vreduce(vsum_t v)
+{
+	float lanes[4];
+	_mm_storeu_ps(lanes, v);
+	return (double) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static inline void vaccumulate(__m128i v, vsum_t &sum, vsum_t &squares)
+{
+	__m128 f = _mm_cvtepi32_ps(v);
+	sum = _mm_add_ps(sum, f);
+	squares = _mm_add_ps(squares, _mm_mul_ps(f, f));
+}
+
+static inline void vsquare(__m128i v, vsum_t &squares)
+{
+	__m128 f = _mm_cvtepi32_ps(v);
+	squares = _mm_add_ps(squares, _mm_mul_ps(f, f));
+}
+
+static inline __m128i vload(const uint16_t *p)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+// 4 * centre - left - right - up - down
+static inline void vlaplacian(const uint16_t *up, const uint16_t *row, const uint16_t *down, vsum_t &sum, vsum_t &squares)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c = vload(row), l = vload(row - 1), r = vload(row + 1), u = vload(up), d = vload(down);
+	__m128i lo = _mm_slli_epi32(_mm_unpacklo_epi16(c, zero), 2);
+	lo = _mm_sub_epi32(lo, _mm_add_epi32(_mm_unpacklo_epi16(l, zero), _mm_unpacklo_epi16(r, zero)));
+	lo = _mm_sub_epi32(lo, _mm_add_epi32(_mm_unpacklo_epi16(u, zero), _mm_unpacklo_epi16(d, zero)));
+	__m128i hi = _mm_slli_epi32(_mm_unpackhi_epi16(c, zero), 2);
+	hi = _mm_sub_epi32(hi, _mm_add_epi32(_mm_unpackhi_epi16(l, zero), _mm_unpackhi_epi16(r, zero)));
+	hi = _mm_sub_epi32(hi, _mm_add_epi32(_mm_unpackhi_epi16(u, zero), _mm_unpackhi_epi16(d, zero)));
+	vaccumulate(lo, sum, squares);
+	vaccumulate(hi, sum, squares);
+}
+
+// pixel 2 to the right minus pixel
+static inline void vgradient(const uint16_t *row, vsum_t &squares)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = vload(row), b = vload(row + 2);
+	vsquare(_mm_sub_epi32(_mm_unpacklo_epi16(b, zero), _mm_unpacklo_epi16(a, zero)), squares);
+	vsquare(_mm_sub_epi32(_mm_unpackhi_epi16(b, zero), _mm_unpackhi_epi16(a, zero)), squares);
+}
+
+// no unsigned compare in SSE2, saturated subtraction is zero where not above
+static inline bool vabove(const uint16_t *p, uint16_t threshold)
+{
+	__m128i excess = _mm_subs_epu16(vload(p), _mm_set1_epi16(threshold));
+	return _mm_movemask_epi8(_mm_cmpeq_epi16(excess, _mm_setzero_si128())) != 0xFFFF;
+}
+
+// big endian signed to unsigned, i.e. swap bytes & flip the sign bit
+static inline void vfits16(const uint8_t *in, uint16_t *out)
+{
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_xor_si128(v, _mm_set1_epi16((short) 0x8000)));
+}
+#endif
+
+bool AstroberryMetrics::loadFITS(const void *data, size_t size, AstroberryFrame &frame)
+{
+	const char *header = static_cast<const char*>(data);
+	int bitpix = 0, naxis = 0, width = 0, height = 0;
+	double bzero = 0, bscale = 1;
+	size_t card = 0;
+
+	if (size < FITS_BLOCK || strncmp(header, "SIMPLE  =", 9))
+		return false;
+
+	// header is a sequence of 80 character cards ending with END
+	for (;; card += FITS_CARD)
+	{
+		if (card + FITS_CARD > size)
+			return false;
+
+		const char *key = header + card;
+		if (!strncmp(key, "END     ", 8))
+			break;
+		if (key[8] != '=')
+			continue;
+
+		char value[FITS_CARD];
+		memcpy(value, key + 10, FITS_CARD - 10);
+		value[FITS_CARD - 10] = 0;
+
+		if (!strncmp(key, "BITPIX  ", 8))
+			bitpix = atoi(value);
+		else if (!strncmp(key, "NAXIS   ", 8))
+			naxis = atoi(value);
+		else if (!strncmp(key, "NAXIS1  ", 8))
+			width = atoi(value);
+		else if (!strncmp(key, "NAXIS2  ", 8))
+			height = atoi(value);
+		else if (!strncmp(key, "BZERO   ", 8))
+			bzero = atof(value);
+		else if (!strncmp(key, "BSCALE  ", 8))
+			bscale = atof(value);
+	}
+
+	// data starts at the next block boundary
+	size_t offset = (card / FITS_BLOCK + 1) * FITS_BLOCK;
+	size_t count = (size_t) width * height;
+	size_t bytes = bitpix == 8 ? 1 : bitpix == 16 ? 2 : 0;
+
+	if (naxis < 2 || width <= 0 || height <= 0 || bytes == 0 || offset + count * bytes > size)
+		return false;
+
+	frame.width = width;
+	frame.height = height;
+	frame.pixels.resize(count);
+
+	// pixels are big endian, 16 bit values are signed with BZERO 32768 for unsigned data
+	const uint8_t *p = reinterpret_cast<const uint8_t*>(header + offset);
+	size_t i = 0;
+
+	// unsigned 16 bit data is by far the most common, convert it 8 pixels at a time
+#if defined(METRICS_NEON) || defined(METRICS_SSE2)
+	if (vectorized && bytes == 2 && bscale == 1 && bzero == 32768)
+	{
+		for (; i + 8 <= count; i += 8)
+			vfits16(p + 2 * i, &frame.pixels[i]);
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		double value = bytes == 1 ? p[i] : (int16_t) (p[2 * i] << 8 | p[2 * i + 1]);
+		value = value * bscale + bzero;
+		frame.pixels[i] = value < 0 ? 0 : value > 65535 ? 65535 : (uint16_t) value;
+	}
+
+	return true;
+}
+
+void AstroberryMetrics::estimateBackground(const AstroberryFrame &frame, double &background, double &noise)
+{
+	std::vector<uint32_t> histogram(65536, 0);
+	for (size_t i = 0; i < frame.pixels.size(); i++)
+		histogram[frame.pixels[i]]++;
+
+	// median
+	size_t half = frame.pixels.size() / 2, count = 0;
+	int median = 0;
+	while (median < 65535 && count + histogram[median] <= half)
+		count += histogram[median++];
+
+	// median absolute deviation, widening a window around the median
+	count = histogram[median];
+	int deviation = 0;
+	while (count <= half && deviation < 65535)
+	{
+		deviation++;
+		if (median - deviation >= 0)
+			count += histogram[median - deviation];
+		if (median + deviation <= 65535)
+			count += histogram[median + deviation];
+	}
+
+	background = median;
+	noise = std::max(1.4826 * deviation, 1.0); // MAD scaled to sigma of gaussian noise
+}
+
+int AstroberryMetrics::findStars(const AstroberryFrame &frame, double threshold, int maxStars, std::vector<AstroberryStar> &stars)
+{
+	const int w = frame.width;
+	const int border = METRICS_STAR_RADIUS;
+	const uint16_t level = threshold < 0 ? 0 : threshold >= 65535 ? 65535 : (uint16_t) threshold;
+	std::vector<AstroberryStar> candidates;
+
+	stars.clear();
+
+	for (int y = border; y < frame.height - border; y++)
+	{
+		const uint16_t *row = &frame.pixels[(size_t) y * w];
+		for (int x = border; x < w - border; x++)
+		{
+#if defined(METRICS_NEON) || defined(METRICS_SSE2)
+			// skip 8 pixels of background at once
+			if (vectorized && x + 8 <= w - border && !vabove(row + x, level))
+			{
+				x += 7;
+				continue;
+			}
+#endif
+			const uint16_t v = row[x];
+			if (v <= threshold || v == 65535)
+				continue;
+
+			// local maximum, ties go to the first pixel in scan order
+			if (v < row[x + 1] || v < row[x - w] || v < row[x - w - 1] || v < row[x - w + 1] || v < row[x + w - 1] || v < row[x + w] || v < row[x + w + 1] || v <= row[x - 1])
+				continue;
+
+			// a hot pixel has no neighbours above the noise
+			int lit = (row[x - 1] > threshold) + (row[x + 1] > threshold) + (row[x - w] > threshold) + (row[x + w] > threshold);
+			if (lit < 2)
+				continue;
+
+			AstroberryStar star = { x, y, v };
+			candidates.push_back(star);
+		}
+	}
+
+	// brightest first, stars too close to a brighter one are dropped
+	std::sort(candidates.begin(), candidates.end(), [](const AstroberryStar &a, const AstroberryStar &b) { return a.peak > b.peak; });
+	for (size_t i = 0; i < candidates.size() && (int) stars.size() < maxStars; i++)
+	{
+		bool isolated = true;
+		for (size_t j = 0; j < stars.size() && isolated; j++)
+			isolated = abs(candidates[i].x - stars[j].x) > 2 * border || abs(candidates[i].y - stars[j].y) > 2 * border;
+		if (isolated)
+			stars.push_back(candidates[i]);
+	}
+
+	return stars.size();
+}
+
+double AstroberryMetrics::halfFluxRadius(const AstroberryFrame &frame, const AstroberryStar &star, double background, int radius)
+{
+	const int x0 = std::max(star.x - radius, 0), x1 = std::min(star.x + radius, frame.width - 1);
+	const int y0 = std::max(star.y - radius, 0), y1 = std::min(star.y + radius, frame.height - 1);
+	double flux = 0, cx = 0, cy = 0;
+
+	// centroid
+	for (int y = y0; y <= y1; y++)
+	{
+		for (int x = x0; x <= x1; x++)
+		{
+			double f = frame.pixels[(size_t) y * frame.width + x] - background;
+			if (f <= 0)
+				continue;
+			flux += f;
+			cx += f * x;
+			cy += f * y;
+		}
+	}
+
+	if (flux <= 0)
+		return NAN;
+
+	cx /= flux;
+	cy /= flux;
+
+	// flux weighted mean distance from the centroid
+	double sum = 0;
+	flux = 0;
+	for (int y = y0; y <= y1; y++)
+	{
+		for (int x = x0; x <= x1; x++)
+		{
+			double f = frame.pixels[(size_t) y * frame.width + x] - background;
+			double r = sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+			if (f <= 0 || r > radius)
+				continue;
+			flux += f;
+			sum += f * r;
+		}
+	}
+
+	return flux > 0 ? sum / flux : NAN;
+}
+
+double AstroberryMetrics::measureHFR(const AstroberryFrame &frame, int &stars)
+{
+	double background, noise;
+	estimateBackground(frame, background, noise);
+
+	std::vector<AstroberryStar> found;
+	stars = findStars(frame, background + METRICS_STAR_SIGMA * noise, METRICS_MAX_STARS, found);
+
+	std::vector<double> hfr;
+	for (size_t i = 0; i < found.size(); i++)
+	{
+		double r = halfFluxRadius(frame, found[i], background, METRICS_STAR_RADIUS);
+		if (!isnan(r))
+			hfr.push_back(r);
+	}
+
+	stars = hfr.size();
+	if (hfr.empty())
+		return NAN;
+
+	std::nth_element(hfr.begin(), hfr.begin() + hfr.size() / 2, hfr.end());
+	return hfr[hfr.size() / 2];
+}
+
+double AstroberryMetrics::laplacianVariance(const AstroberryFrame &frame)
+{
+	const int w = frame.width;
+	double sum = 0, squares = 0;
+
+	if (w < 3 || frame.height < 3)
+		return NAN;
+
+	for (int y = 1; y < frame.height - 1; y++)
+	{
+		const uint16_t *row = &frame.pixels[(size_t) y * w];
+		const uint16_t *up = row - w, *down = row + w;
+		int x = 1;
+
+#if defined(METRICS_NEON) || defined(METRICS_SSE2)
+		if (vectorized)
+		{
+			vsum_t vsum = vzero(), vsquares = vzero();
+			for (; x + 8 <= w - 1; x += 8)
+				vlaplacian(up + x, row + x, down + x, vsum, vsquares);
+			sum += vreduce(vsum);
+			squares += vreduce(vsquares);
+		}
+#endif
+
+		for (; x < w - 1; x++)
+		{
+			double l = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+			sum += l;
+			squares += l * l;
+		}
+	}
+
+	const double n = (double) (w - 2) * (frame.height - 2);
+	return squares / n - (sum / n) * (sum / n);
+}
+
+double AstroberryMetrics::brenner(const AstroberryFrame &frame)
+{
+	const int w = frame.width;
+	double squares = 0;
+
+	if (w < 3 || frame.height < 1)
+		return NAN;
+
+	for (int y = 0; y < frame.height; y++)
+	{
+		const uint16_t *row = &frame.pixels[(size_t) y * w];
+		int x = 0;
+
+#if defined(METRICS_NEON) || defined(METRICS_SSE2)
+		if (vectorized)
+		{
+			vsum_t vsquares = vzero();
+			for (; x + 8 <= w - 2; x += 8)
+				vgradient(row + x, vsquares);
+			squares += vreduce(vsquares);
+		}
+#endif
+
+		for (; x < w - 2; x++)
+		{
+			double d = row[x + 2] - row[x];
+			squares += d * d;
+		}
+	}
+
+	return squares / ((double) (w - 2) * frame.height);
+}
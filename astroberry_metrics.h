@@ -0,0 +1,70 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYMETRICS_H
+#define ASTROBERRYMETRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Focus metrics
+ *
+ * Frames are reduced to 16 bit monochrome on load, colour cubes keep their
+ * first plane. Background and noise are the median and MAD of the frame
+ * histogram. Stars are local maxima well above the noise, and the focus
+ * metric is the median half flux radius of the brightest of them, which
+ * follows a hyperbola around focus. Laplacian variance and Brenner gradient
+ * are contrast metrics for frames without stars, they peak at focus.
+ *
+ * Loops touching every pixel use NEON or SSE2 where the compiler targets
+ * it, with a scalar fallback. Vector sums are accumulated in float per row,
+ * so results may differ from the scalar ones in the last digits.
+ */
+struct AstroberryFrame
+{
+	int width { 0 };
+	int height { 0 };
+	std::vector<uint16_t> pixels;
+};
+
+struct AstroberryStar
+{
+	int x;
+	int y;
+	uint16_t peak;
+};
+
+class AstroberryMetrics
+{
+public:
+	static bool loadFITS(const void *data, size_t size, AstroberryFrame &frame);
+	static void estimateBackground(const AstroberryFrame &frame, double &background, double &noise);
+	static int findStars(const AstroberryFrame &frame, double threshold, int maxStars, std::vector<AstroberryStar> &stars);
+	static double halfFluxRadius(const AstroberryFrame &frame, const AstroberryStar &star, double background, int radius);
+	static double measureHFR(const AstroberryFrame &frame, int &stars); // NAN if no stars found
+	static double laplacianVariance(const AstroberryFrame &frame);
+	static double brenner(const AstroberryFrame &frame); // mean squared gradient
+	static bool setVectorized(bool enable); // false if built without vector support
+	static const char *getVectorization();
+private:
+	static bool vectorized;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "astroberry_metrics.h"
+
+/*
+ * Focus metrics benchmark
+ *
+ * Renders a synthetic star field, encodes it as 16 bit FITS and times every
+ * metric with the scalar and the vector kernels.
+ *
+ * Usage: astroberry_metrics_bench [width height [iterations]]
+ */
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void renderStars(AstroberryFrame &frame, int stars, double sigma)
+{
+	const int w = frame.width, h = frame.height;
+	unsigned int seed = 1;
+
+	// sky with gaussian-ish read noise
+	for (size_t i = 0; i < frame.pixels.size(); i++)
+		frame.pixels[i] = 1000 + (rand_r(&seed) % 64 + rand_r(&seed) % 64 + rand_r(&seed) % 64) / 3 - 32;
+
+	for (int s = 0; s < stars; s++)
+	{
+		int cx = 32 + rand_r(&seed) % (w - 64), cy = 32 + rand_r(&seed) % (h - 64);
+		double peak = 2000 + rand_r(&seed) % 30000;
+		for (int y = -16; y <= 16; y++)
+		{
+			for (int x = -16; x <= 16; x++)
+			{
+				uint16_t &p = frame.pixels[(size_t) (cy + y) * w + cx + x];
+				double v = p + peak * exp(-(x * x + y * y) / (2 * sigma * sigma));
+				p = v > 65535 ? 65535 : v;
+			}
+		}
+	}
+}
+
+static std::vector<uint8_t> encodeFITS(const AstroberryFrame &frame)
+{
+	std::vector<uint8_t> fits(2880, ' ');
+	char card[81];
+	const char *cards[] = { "SIMPLE  = %20s", "BITPIX  = %20d", "NAXIS   = %20d", "NAXIS1  = %20d", "NAXIS2  = %20d", "BZERO   = %20d", "END" };
+
+	for (int i = 0; i < 7; i++)
+	{
+		if (i == 0)
+			snprintf(card, sizeof(card), cards[i], "T");
+		else
+		{
+			const int values[] = { 0, 16, 2, frame.width, frame.height, 32768, 0 };
+			snprintf(card, sizeof(card), cards[i], values[i]);
+		}
+		memcpy(&fits[i * 80], card, strlen(card));
+	}
+
+	for (size_t i = 0; i < frame.pixels.size(); i++)
+	{
+		uint16_t v = frame.pixels[i] ^ 0x8000;
+		fits.push_back(v >> 8);
+		fits.push_back(v & 0xFF);
+	}
+	fits.resize((fits.size() + 2879) / 2880 * 2880, 0);
+
+	return fits;
+}
+
+int main(int argc, char *argv[])
+{
+	AstroberryFrame frame;
+	frame.width = argc > 2 ? atoi(argv[1]) : 5472; // 20 MP
+	frame.height = argc > 2 ? atoi(argv[2]) : 3648;
+	int iterations = argc > 3 ? atoi(argv[3]) : 5;
+
+	if (frame.width < 128 || frame.height < 128 || iterations < 1)
+	{
+		fprintf(stderr, "Usage: %s [width height [iterations]]\n", argv[0]);
+		return 1;
+	}
+
+	frame.pixels.resize((size_t) frame.width * frame.height);
+	renderStars(frame, 500, 2.5);
+	std::vector<uint8_t> fits = encodeFITS(frame);
+	const double mpix = frame.pixels.size() / 1e6;
+
+	printf("%dx%d (%0.1f MP), %d iterations\n", frame.width, frame.height, mpix, iterations);
+	printf("%-12s %-8s %12s %10s %14s\n", "metric", "kernel", "ms", "MPix/s", "value");
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (!AstroberryMetrics::setVectorized(pass == 1))
+			continue;
+
+		for (int metric = 0; metric < 6; metric++)
+		{
+			static const char *names[] = { "fits", "background", "stars", "hfr", "laplacian", "brenner" };
+			double value = 0, start = now();
+
+			for (int i = 0; i < iterations; i++)
+			{
+				AstroberryFrame loaded;
+				double background, noise;
+				std::vector<AstroberryStar> stars;
+				int count;
+
+				switch (metric)
+				{
+					case 0:
+						value = AstroberryMetrics::loadFITS(fits.data(), fits.size(), loaded) && loaded.pixels == frame.pixels;
+						break;
+					case 1:
+						AstroberryMetrics::estimateBackground(frame, background, noise);
+						value = background;
+						break;
+					case 2:
+						AstroberryMetrics::estimateBackground(frame, background, noise);
+						value = AstroberryMetrics::findStars(frame, background + 5 * noise, 50, stars);
+						break;
+					case 3:
+						value = AstroberryMetrics::measureHFR(frame, count);
+						break;
+					case 4:
+						value = AstroberryMetrics::laplacianVariance(frame);
+						break;
+					case 5:
+						value = AstroberryMetrics::brenner(frame);
+						break;
+				}
+			}
+
+			double ms = (now() - start) * 1000 / iterations;
+			printf("%-12s %-8s %12.2f %10.1f %14.4f\n", names[metric], AstroberryMetrics::getVectorization(), ms, mpix / ms * 1000, value);
+		}
+	}
+
+	return 0;
+}
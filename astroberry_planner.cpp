@@ -0,0 +1,109 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <math.h>
+
+#include "astroberry_planner.h"
+
+void AstroberryPlanner::setProfile(double startSpeed, double maxSpeed, double acceleration)
+{
+	v0 = startSpeed > 1 ? startSpeed : 1;
+	vmax = maxSpeed > v0 ? maxSpeed : v0;
+	accel = acceleration > 0 ? acceleration : 0;
+}
+
+void AstroberryPlanner::plan(int steps, double initialSpeed)
+{
+	total = steps > 0 ? steps : 0;
+	vi = initialSpeed > v0 ? initialSpeed : v0;
+
+	// no ramp - run the whole move at start speed
+	if (accel == 0)
+	{
+		vi = vpeak = v0;
+		accelSteps = decelSteps = decelRate = 0;
+		return;
+	}
+
+	if (vi > vmax)
+		vi = vmax;
+
+	vpeak = vmax;
+	decelRate = accel;
+	accelSteps = (vpeak * vpeak - vi * vi) / (2 * accel);
+	decelSteps = (vpeak * vpeak - v0 * v0) / (2 * accel);
+
+	// triangular profile for short moves
+	if (accelSteps + decelSteps > total)
+	{
+		vpeak = sqrt((2 * accel * total + vi * vi + v0 * v0) / 2);
+
+		if (vpeak < vi)
+		{
+			// too late to stop smoothly, decelerate harder over the remaining steps
+			vpeak = vi;
+			accelSteps = 0;
+			decelSteps = total;
+			decelRate = total > 0 ? (vi * vi - v0 * v0) / (2.0 * total) : accel;
+		} else {
+			accelSteps = (vpeak * vpeak - vi * vi) / (2 * accel);
+			decelSteps = total - accelSteps;
+		}
+	}
+}
+
+double AstroberryPlanner::speedAt(int step) const
+{
+	if (accel == 0)
+		return v0;
+
+	// evaluate speed in the middle of the step
+	double s = step + 0.5;
+	double remaining = total - s;
+
+	if (s < accelSteps)
+		return sqrt(vi * vi + 2 * accel * s);
+
+	if (remaining < decelSteps)
+		return sqrt(v0 * v0 + 2 * decelRate * (remaining > 0 ? remaining : 0));
+
+	return vpeak;
+}
+
+long AstroberryPlanner::interval(int step) const
+{
+	return (long) (1e9 / speedAt(step));
+}
+
+double AstroberryPlanner::duration() const
+{
+	if (accel == 0 || total == 0)
+		return total / v0;
+
+	double cruiseSteps = total - accelSteps - decelSteps;
+
+	return (vpeak - vi) / accel + (cruiseSteps > 0 ? cruiseSteps / vpeak : 0) + (vpeak - v0) / decelRate;
+}
+
+int AstroberryPlanner::stoppingDistance(double speed) const
+{
+	if (accel == 0 || speed <= v0)
+		return 0;
+
+	return (int) ceil((speed * speed - v0 * v0) / (2 * accel));
+}
@@ -0,0 +1,55 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYPLANNER_H
+#define ASTROBERRYPLANNER_H
+
+/*
+ * Trapezoidal motion planner
+ *
+ * Splits a move of N steps into acceleration, cruise and deceleration phases.
+ * Moves start at the initial speed (start speed when starting from rest),
+ * ramp up to max speed with constant acceleration and ramp back down to the
+ * start speed on the last step. Short moves get a triangular profile.
+ * All speeds are in steps/s, acceleration in steps/s^2.
+ */
+class AstroberryPlanner
+{
+public:
+	void setProfile(double startSpeed, double maxSpeed, double acceleration);
+	void plan(int steps, double initialSpeed = 0);
+	long interval(int step) const; // ns from the given step to the next one
+	double speedAt(int step) const;
+	double duration() const; // s
+	int stoppingDistance(double speed) const;
+	int getSteps() const { return total; }
+	double getStartSpeed() const { return v0; }
+private:
+	double v0 { 500 };
+	double vmax { 500 };
+	double accel { 0 };
+
+	int total { 0 };
+	double vi { 500 };
+	double vpeak { 500 };
+	double accelSteps { 0 };
+	double decelSteps { 0 };
+	double decelRate { 0 };
+};
+
+#endif
@@ -23,8 +23,6 @@
 
 #include "astroberry_relays.h"
 
-#include <gpiod.h>
-
 // We declare an auto pointer to IndiAstroberryRelays
 std::unique_ptr<IndiAstroberryRelays> indiAstroberryRelays(new IndiAstroberryRelays());
 
@@ -92,8 +90,8 @@ IndiAstroberryRelays::~IndiAstroberryRelays()
 bool IndiAstroberryRelays::Connect()
 {
 	// Init GPIO
-	chip = gpiod_chip_open(gpio_chip_path);
-	if (!chip)
+	chip = &AstroberryGpiodChip::shared();
+	if (!chip->open())
 	{
 		DEBUG(INDI::Logger::DBG_SESSION, "Problem initiating Astroberry Relays.");
 		return false;
@@ -102,25 +100,23 @@ bool IndiAstroberryRelays::Connect()
 	// verify BCM Pins are not used by other consumers
 	for (unsigned int pin = 0; pin < 4; pin++)
 	{
-		if (gpiod_line_is_used(gpiod_chip_get_line(chip, BCMpinsN[pin].value)))
+		if (chip->isUsed(BCMpinsN[pin].value))
 		{
 			DEBUGF(INDI::Logger::DBG_ERROR, "BCM Pin %0.0f already used", BCMpinsN[pin].value);
-			gpiod_chip_close(chip);
+			chip->close();
 			return false;
 		}
 	}
 
-	// Select gpios
-	gpio_relay1 = gpiod_chip_get_line(chip, BCMpinsN[0].value);
-	gpio_relay2 = gpiod_chip_get_line(chip, BCMpinsN[1].value);
-	gpio_relay3 = gpiod_chip_get_line(chip, BCMpinsN[2].value);
-	gpio_relay4 = gpiod_chip_get_line(chip, BCMpinsN[3].value);
-
 	// Set initial gpios direction and states
-	gpiod_line_request_output(gpio_relay1, "1@astroberry_relays", relayState[0]);
-	gpiod_line_request_output(gpio_relay2, "2@astroberry_relays", relayState[1]);
-	gpiod_line_request_output(gpio_relay3, "3@astroberry_relays", relayState[2]);
-	gpiod_line_request_output(gpio_relay4, "4@astroberry_relays", relayState[3]);
+	const unsigned int relayOffsets[4] = { (unsigned int) BCMpinsN[0].value, (unsigned int) BCMpinsN[1].value, (unsigned int) BCMpinsN[2].value, (unsigned int) BCMpinsN[3].value };
+	gpio_relays = chip->requestOutputs(relayOffsets, 4, "astroberry_relays", relayState);
+	if (!gpio_relays)
+	{
+		DEBUG(INDI::Logger::DBG_ERROR, "Problem requesting relay gpios.");
+		chip->close();
+		return false;
+	}
 
 	// Lock BCM Pins setting
 	BCMpinsNP.s = IPS_BUSY;
@@ -144,7 +140,8 @@ bool IndiAstroberryRelays::Connect()
 bool IndiAstroberryRelays::Disconnect()
 {
 	// Close GPIO
-	gpiod_chip_close(chip);
+	chip->close();
+	gpio_relays = nullptr;
 
 	// Unlock BCM Pins setting
 	BCMpinsNP.s=IPS_IDLE;
@@ -288,27 +285,28 @@ bool IndiAstroberryRelays::ISNewNumber (const char *dev, const char *name, doubl
 							return false;
 						}
 					}
+				}
 
-					// verify BCM Pins are not used by other consumers
-					chip = gpiod_chip_open("/dev/gpiochip0");
-					if (chip)
-					{
-						struct gpiod_line *line = gpiod_chip_get_line(chip, values[i]);
-						bool line_status = gpiod_line_is_used(line);
-						gpiod_chip_close(chip);
+				// verify BCM Pins are not used by other consumers
+				AstroberryGpioChip &gpio = AstroberryGpiodChip::shared();
+				if (!gpio.open())
+				{
+					DEBUG(INDI::Logger::DBG_ERROR, "Problem initiating Astroberry Relays.");
+					return false;
+				}
 
-						if (line_status)
-						{
-							BCMpinsNP.s=IPS_ALERT;
-							IDSetNumber(&BCMpinsNP, nullptr);
-							DEBUGF(INDI::Logger::DBG_ERROR, "BCM Pin %0.0f already used!", values[i]);
-							return false;
-						}
-					} else {
-						DEBUG(INDI::Logger::DBG_ERROR, "Problem initiating Astroberry Relays.");
+				for (unsigned int i = 0; i < valcount; i++)
+				{
+					if (gpio.isUsed(values[i]))
+					{
+						gpio.close();
+						BCMpinsNP.s=IPS_ALERT;
+						IDSetNumber(&BCMpinsNP, nullptr);
+						DEBUGF(INDI::Logger::DBG_ERROR, "BCM Pin %0.0f already used!", values[i]);
 						return false;
 					}
 				}
+				gpio.close();
 
 				IUUpdateNumber(&BCMpinsNP,values,names,n);
 
@@ -324,9 +322,6 @@ bool IndiAstroberryRelays::ISNewNumber (const char *dev, const char *name, doubl
 }
 bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISState *states, char *names[], int n)
 {
-	// return value for relays setting
-	int rv;
-
 	// first we check if it's for our device
 	if (!strcmp(dev, getDeviceName()))
 	{
@@ -368,8 +363,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 
 			if ( Switch1S[0].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay1, activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(0, activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #1");
 					Switch1SP.s = IPS_ALERT;
@@ -388,8 +382,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 			}
 			if ( Switch1S[1].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay1, !activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(0, !activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #1");
 					Switch1SP.s = IPS_ALERT;
@@ -415,8 +408,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 
 			if ( Switch2S[0].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay2, activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(1, activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #2");
 					Switch2SP.s = IPS_ALERT;
@@ -435,8 +427,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 			}
 			if ( Switch2S[1].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay2, !activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(1, !activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #2");
 					Switch2SP.s = IPS_ALERT;
@@ -462,8 +453,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 
 			if ( Switch3S[0].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay3, activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(2, activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #3");
 					Switch3SP.s = IPS_ALERT;
@@ -482,8 +472,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 			}
 			if ( Switch3S[1].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay3, !activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(2, !activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #3");
 					Switch3SP.s = IPS_ALERT;
@@ -509,8 +498,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 
 			if ( Switch4S[0].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay4, activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(3, activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #4");
 					Switch4SP.s = IPS_ALERT;
@@ -529,8 +517,7 @@ bool IndiAstroberryRelays::ISNewSwitch (const char *dev, const char *name, ISSta
 			}
 			if ( Switch4S[1].s == ISS_ON )
 			{
-				rv = gpiod_line_set_value(gpio_relay4, !activeState);
-				if (rv != 0)
+				if (!gpio_relays->setValue(3, !activeState))
 				{
 					DEBUG(INDI::Logger::DBG_ERROR, "Error setting Astroberry Relay #4");
 					Switch4SP.s = IPS_ALERT;
@@ -609,11 +596,13 @@ void IndiAstroberryRelays::TimerHit()
 void IndiAstroberryRelays::udateSwitches()
 {
 	int gpio_relay_status[4];
-	
-	gpio_relay_status[0] = gpiod_line_get_value(gpio_relay1);
-	gpio_relay_status[1] = gpiod_line_get_value(gpio_relay2);
-	gpio_relay_status[2] = gpiod_line_get_value(gpio_relay3);
-	gpio_relay_status[3] = gpiod_line_get_value(gpio_relay4);
+
+	// all relays are read in one call
+	if (!gpio_relays->getValues(gpio_relay_status))
+	{
+		DEBUG(INDI::Logger::DBG_ERROR, "Error reading Astroberry Relays status");
+		return;
+	}
 
 	// handle active-low status
 	for (int i=0; i < 4; i++) {
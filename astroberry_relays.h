@@ -25,6 +25,8 @@
 
 #include <defaultdevice.h>
 
+#include "astroberry_gpio.h"
+
 class IndiAstroberryRelays : public INDI::DefaultDevice
 {
 public:
@@ -73,12 +75,8 @@ private:
 	int relayState[4]; // relayState is mission critical to maintain relays status between reconnections. initially set to !activeState
 	int pollingTime = 1000;
 
-	const char* gpio_chip_path = "/dev/gpiochip0";
-	struct gpiod_chip *chip;
-	struct gpiod_line *gpio_relay1;
-	struct gpiod_line *gpio_relay2;
-	struct gpiod_line *gpio_relay3;
-	struct gpiod_line *gpio_relay4;
+	AstroberryGpioChip *chip { nullptr };
+	AstroberryGpioBulk *gpio_relays { nullptr }; // all four relays, toggled & polled in one call
 };
 
 #endif
@@ -0,0 +1,179 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "astroberry_schedule.h"
+
+#define SCHEDULE_DIR_SETUP 5000 // ns between direction change and first step
+#define SCHEDULE_MODE_SETUP 5000 // ns between microstep mode change and next step
+
+void AstroberrySchedule::addStep(uint64_t &time, long period, int delta)
+{
+	AstroberryStepEvent event;
+	event.speed = 1e9 / period;
+	event.line = LINE_STEP;
+
+	// step on
+	event.time = time;
+	event.value = 1;
+	event.delta = 0;
+	events.push_back(event);
+
+	// step off - the step is done
+	event.time = time + period / 2;
+	event.value = 0;
+	event.delta = delta;
+	events.push_back(event);
+
+	time += period;
+}
+
+void AstroberrySchedule::addMode(uint64_t &time, const uint8_t mode[3])
+{
+	AstroberryStepEvent event;
+	event.time = time;
+	event.speed = events.empty() ? 0 : events.back().speed;
+	event.delta = 0;
+
+	for (int i = 0; i < 3; i++)
+	{
+		event.line = LINE_M0 + i;
+		event.value = mode[i];
+		events.push_back(event);
+	}
+
+	time += SCHEDULE_MODE_SETUP;
+}
+
+void AstroberrySchedule::addDirection(uint64_t &time, int dir, bool reverse)
+{
+	AstroberryStepEvent event;
+	event.time = time;
+	event.speed = 0;
+	event.line = LINE_DIR;
+	event.value = (dir == 1) != reverse ? 1 : 0;
+	event.delta = 0;
+	events.push_back(event);
+
+	time += SCHEDULE_DIR_SETUP;
+}
+
+void AstroberrySchedule::compile(int position, int target, int backlash, bool reverse, AstroberryPlanner &planner, double initialSpeed, bool setDirection, int overshoot)
+{
+	const int dir = target > position ? 1 : -1;
+	const int fine = resolution.fineStep;
+	uint64_t time = 0;
+
+	events.clear();
+	steps = abs(target - position) / fine + overshoot;
+	backlashSteps = backlash;
+	overshootSteps = overshoot;
+	coarseSteps = 0;
+
+	// backlash take-up rides the acceleration ramp of the travel
+	planner.plan(backlash + steps, initialSpeed);
+
+	// split travel into fine alignment, coarse slew and fine final approach
+	int alignSteps = steps;
+	int ratio = resolution.coarseStep / fine;
+	if (ratio > 1 && steps > resolution.approach + ratio)
+	{
+		// the shaft has turned by the take-up when travel starts, that is where coarse steps align
+		int coarse = resolution.coarseStep;
+		int shaft = position + dir * backlash * fine;
+		int offset = ((shaft % coarse) + coarse) % coarse;
+		alignSteps = (dir == 1 ? (coarse - offset) % coarse : offset) / fine;
+		coarseSteps = (steps - alignSteps - resolution.approach) / ratio;
+		if (coarseSteps <= 0)
+		{
+			coarseSteps = 0;
+			alignSteps = steps;
+		}
+	}
+
+	events.reserve(2 * (alignSteps + backlash + coarseSteps + steps + overshoot) + 10);
+
+	// set direction, handle reverse motion
+	if (setDirection)
+		addDirection(time, dir, reverse);
+
+	// set microstep mode of the first phase
+	bool coarseFirst = coarseSteps > 0 && alignSteps == 0 && backlash == 0;
+	addMode(time, coarseFirst ? resolution.coarseMode : resolution.fineMode);
+
+	// backlash take-up, position does not change
+	int step = 0;
+	for (; step < backlash; step++)
+		addStep(time, planner.interval(step), 0);
+
+	// planned travel - a coarse step takes as long as the fine steps it replaces
+	for (; step < backlash + alignSteps; step++)
+		addStep(time, planner.interval(step), dir * fine);
+
+	if (coarseSteps > 0)
+	{
+		if (!coarseFirst)
+			addMode(time, resolution.coarseMode);
+
+		for (int i = 0; i < coarseSteps; i++)
+		{
+			long period = 0;
+			for (int j = 0; j < ratio; j++)
+				period += planner.interval(step++);
+			addStep(time, period, dir * resolution.coarseStep);
+			events.back().speed = events[events.size() - 2].speed = 1e9 * ratio / period;
+		}
+
+		addMode(time, resolution.fineMode);
+
+		for (; step < backlash + steps; step++)
+			addStep(time, planner.interval(step), dir * fine);
+	}
+
+	// overshoot return - reverse and reach the target from the other side
+	if (overshoot > 0)
+	{
+		addDirection(time, -dir, reverse);
+		planner.plan(overshoot);
+		for (int i = 0; i < overshoot; i++)
+			addStep(time, planner.interval(i), -dir * fine);
+	}
+
+	endTime = time;
+}
+
+bool AstroberrySchedule::dump(const char *fileName) const
+{
+	FILE *pFile = fopen(fileName, "w");
+	if (pFile == NULL)
+		return false;
+
+	static const char *lineNames[LINE_COUNT] = { "dir", "step", "m0", "m1", "m2" };
+
+	fprintf(pFile, "index,time_ns,line,value,delta,speed\n");
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const AstroberryStepEvent &e = events[i];
+		fprintf(pFile, "%zu,%llu,%s,%d,%d,%0.1f\n", i, (unsigned long long) e.time, lineNames[e.line], e.value, e.delta, e.speed);
+	}
+
+	fclose(pFile);
+	return true;
+}
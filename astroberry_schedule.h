@@ -0,0 +1,104 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYSCHEDULE_H
+#define ASTROBERRYSCHEDULE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "astroberry_planner.h"
+
+/*
+ * Step pulse schedule
+ *
+ * A whole move compiled into a flat array of line level changes before motion
+ * starts: direction change, microstep mode changes, backlash take-up and the
+ * planned travel. Every entry carries its deadline relative to the start of
+ * the move and the position change applied once it has been executed.
+ *
+ * Backlash steps are the first steps of the planned ramp, so take-up speeds
+ * up with the move instead of running at start speed. With an overshoot the
+ * travel goes past the target by that many fine steps, reverses and comes
+ * back, so the final approach is always from the other side.
+ *
+ * Positions are counted in MAX_RESOLUTION microsteps. Speeds are in fine
+ * steps/s, fine step being the finest resolution selected for the focuser.
+ */
+struct AstroberryStepEvent
+{
+	uint64_t time;	// ns from start of schedule
+	float speed;	// fine steps/s at this step
+	uint8_t line;	// AstroberrySchedule::LINE_*
+	uint8_t value;	// line level or MODE_FLOAT
+	int8_t delta;	// position change
+};
+
+/*
+ * Adaptive resolution
+ *
+ * With coarseStep set, moves slew with coarse steps and switch to fine steps
+ * for the final approach. Mode changes only happen on coarse step boundaries,
+ * so the driver indexer never lands between two coarse positions.
+ */
+struct AstroberryResolution
+{
+	int fineStep { 1 };	// position units per fine step
+	int coarseStep { 0 };	// position units per coarse step, 0 disables adaptive moves
+	int approach { 0 };	// fine steps of the final approach
+	uint8_t fineMode[3] { 0, 0, 0 };	// M0, M1, M2 levels
+	uint8_t coarseMode[3] { 0, 0, 0 };
+};
+
+class AstroberrySchedule
+{
+public:
+	enum { LINE_DIR, LINE_STEP, LINE_M0, LINE_M1, LINE_M2, LINE_COUNT };
+	enum { MODE_LOW = 0, MODE_HIGH = 1, MODE_FLOAT = 2 };
+
+	void setResolution(const AstroberryResolution &res) { resolution = res; }
+	const AstroberryResolution &getResolution() const { return resolution; }
+	void compile(int position, int target, int backlash, bool reverse, AstroberryPlanner &planner, double initialSpeed = 0, bool setDirection = true, int overshoot = 0);
+	void clear() { events.clear(); }
+	void reserve(size_t count) { events.reserve(count); }
+	size_t size() const { return events.size(); }
+	bool empty() const { return events.empty(); }
+	const AstroberryStepEvent &operator[](size_t i) const { return events[i]; }
+	const AstroberryStepEvent *data() const { return events.data(); }
+	uint64_t duration() const { return events.empty() ? 0 : endTime; }
+	int getSteps() const { return steps; } // fine steps, overshoot included
+	int getCoarseSteps() const { return coarseSteps; }
+	int getBacklash() const { return backlashSteps; }
+	int getOvershoot() const { return overshootSteps; }
+	bool dump(const char *fileName) const;
+private:
+	void addStep(uint64_t &time, long period, int delta);
+	void addMode(uint64_t &time, const uint8_t mode[3]);
+	void addDirection(uint64_t &time, int dir, bool reverse);
+
+	AstroberryResolution resolution;
+	std::vector<AstroberryStepEvent> events;
+	uint64_t endTime { 0 };
+	int steps { 0 };
+	int coarseSteps { 0 };
+	int backlashSteps { 0 };
+	int overshootSteps { 0 };
+};
+
+#endif
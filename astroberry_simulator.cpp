@@ -0,0 +1,273 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "astroberry_schedule.h"
+#include "astroberry_simulator.h"
+#include "astroberry_stepper.h"
+
+#define SIMULATOR_MAX_RESOLUTION 32
+#define SIMULATOR_MAX_STEP_TIMES (1 << 20) // per move
+#define SIMULATOR_SENSOR_ID "28-000000000001"
+
+static int64_t monotonicNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static bool writeFile(const std::string &path, const char *content)
+{
+	FILE *fp = fopen(path.c_str(), "w");
+	if (fp == NULL)
+		return false;
+
+	bool ok = fputs(content, fp) >= 0;
+	return fclose(fp) == 0 && ok;
+}
+
+AstroberrySimulator::AstroberrySimulator()
+{
+	chip.setListener(this);
+}
+
+AstroberrySimulator::~AstroberrySimulator()
+{
+	stopThermometer();
+}
+
+void AstroberrySimulator::configure(int board, const unsigned int pins[PIN_COUNT])
+{
+	this->board = board;
+	for (int i = 0; i < PIN_COUNT; i++)
+		this->pins[i] = pins[i];
+}
+
+void AstroberrySimulator::setPosition(int position)
+{
+	// the stepper starts out moving outward, so the gears are engaged that way
+	motor = position;
+	drawtube = position - backlash;
+	updateEncoder(encoderOnDrawtube ? drawtube.load() : position, true);
+}
+
+void AstroberrySimulator::setEncoder(unsigned int pinA, unsigned int pinB, int counts, bool onDrawtube)
+{
+	encoderPins[0] = pinA;
+	encoderPins[1] = pinB;
+	encoderCounts = counts;
+	encoderOnDrawtube = onDrawtube;
+	updateEncoder(onDrawtube ? drawtube.load() : motor.load(), true);
+}
+
+void AstroberrySimulator::updateEncoder(int position, bool jump)
+{
+	const int counts = encoderCounts.load();
+	if (counts <= 0)
+		return;
+
+	// one line changes per count, A leads B outward: 00, 10, 11, 01
+	long target = (long) floor((double) position * counts / SIMULATOR_MAX_RESOLUTION);
+	if (jump)
+		encoderCount = target;
+	do
+	{
+		if (encoderCount != target)
+			encoderCount += target > encoderCount ? 1 : -1;
+		const int phase = encoderCount & 3;
+		chip.setInput(encoderPins[0], phase == 1 || phase == 2);
+		chip.setInput(encoderPins[1], phase >= 2);
+	} while (encoderCount != target);
+}
+
+void AstroberrySimulator::beginMove()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	stepTimes.clear();
+	missed = 0;
+	moveStart = monotonicNow();
+}
+
+int AstroberrySimulator::getMicrostep()
+{
+	// decode mode lines the way the driver board does, a floating line is an input
+	uint8_t level[3];
+	for (int i = 0; i < 3; i++)
+	{
+		int mode = chip.getMode(pins[PIN_M0 + i]);
+		level[i] = mode == AstroberryMockChip::LINE_INPUT ? AstroberrySchedule::MODE_FLOAT : chip.getLevel(pins[PIN_M0 + i]);
+	}
+
+	for (int resolution = 1; resolution <= SIMULATOR_MAX_RESOLUTION; resolution <<= 1)
+	{
+		uint8_t mode[3];
+		if (AstroberryStepper::getModePins(board, resolution, mode) && mode[0] == level[0] && mode[1] == level[1] && mode[2] == level[2])
+			return SIMULATOR_MAX_RESOLUTION / resolution;
+	}
+
+	return SIMULATOR_MAX_RESOLUTION;
+}
+
+void AstroberrySimulator::lineChanged(unsigned int offset, int value, int64_t timestamp)
+{
+	if (offset != pins[PIN_STEP] || value != 1)
+		return;
+
+	// sleep line is active high
+	if (chip.getLevel(pins[PIN_SLEEP]) == 1)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		missed++;
+		return;
+	}
+
+	// a lost step leaves the motor where it was
+	lossBudget += stepLoss.load();
+	if (lossBudget >= 100)
+	{
+		lossBudget -= 100;
+		return;
+	}
+
+	const int step = chip.getLevel(pins[PIN_DIR]) == 1 ? getMicrostep() : -getMicrostep();
+	const int position = motor.fetch_add(step) + step;
+
+	// drawtube is pushed once the motor took up the dead band
+	int tube = drawtube.load();
+	if (tube < position - backlash)
+		drawtube = position - backlash;
+	else if (tube > position)
+		drawtube = position;
+	updateEncoder(encoderOnDrawtube ? drawtube.load() : position);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (stepTimes.size() < SIMULATOR_MAX_STEP_TIMES)
+		stepTimes.push_back(timestamp);
+}
+
+AstroberrySimulatorStats AstroberrySimulator::getStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	AstroberrySimulatorStats stats = { (long) stepTimes.size(), missed, 0, 0, 0, 0 };
+
+	if (stepTimes.empty())
+		return stats;
+
+	stats.latency = (stepTimes[0] - moveStart) / 1000.0;
+	for (size_t i = 1; i < stepTimes.size(); i++)
+	{
+		double period = (stepTimes[i] - stepTimes[i - 1]) / 1000.0;
+		if (i == 1 || period < stats.minPeriod)
+			stats.minPeriod = period;
+		if (period > stats.maxPeriod)
+			stats.maxPeriod = period;
+	}
+	if (stepTimes.size() > 1)
+		stats.meanPeriod = (stepTimes.back() - stepTimes[0]) / 1000.0 / (stepTimes.size() - 1);
+
+	return stats;
+}
+
+std::vector<int64_t> AstroberrySimulator::getStepTimes()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stepTimes;
+}
+
+bool AstroberrySimulator::startThermometer(double celsius, double rate)
+{
+	startCelsius = celsius;
+	this->rate = rate;
+	thermometerStart = monotonicNow();
+
+	if (!root.empty())
+	{
+		updateTemperature();
+		return true;
+	}
+
+	// same layout as sysfs, the devices directory links to sensors on a bus master
+	char path[] = "/tmp/astroberry-sim-XXXXXX";
+	if (mkdtemp(path) == NULL)
+		return false;
+	root = path;
+
+	std::string master = root + "/w1_bus_master1";
+	sensorPath = master + "/" SIMULATOR_SENSOR_ID;
+	if (mkdir(master.c_str(), 0755) != 0 || mkdir(sensorPath.c_str(), 0755) != 0 || mkdir(getDevicesPath().c_str(), 0755) != 0 ||
+		symlink(sensorPath.c_str(), (getDevicesPath() + "/" SIMULATOR_SENSOR_ID).c_str()) != 0 ||
+		!writeFile(sensorPath + "/resolution", "12\n"))
+	{
+		stopThermometer();
+		return false;
+	}
+
+	updateTemperature();
+	return true;
+}
+
+void AstroberrySimulator::stopThermometer()
+{
+	if (root.empty())
+		return;
+
+	unlink((getDevicesPath() + "/" SIMULATOR_SENSOR_ID).c_str());
+	unlink((sensorPath + "/w1_slave").c_str());
+	unlink((sensorPath + "/w1_slave.tmp").c_str());
+	unlink((sensorPath + "/resolution").c_str());
+	rmdir(sensorPath.c_str());
+	rmdir(getDevicesPath().c_str());
+	rmdir((root + "/w1_bus_master1").c_str());
+	rmdir(root.c_str());
+	root.clear();
+}
+
+void AstroberrySimulator::updateTemperature()
+{
+	if (root.empty())
+		return;
+
+	// quantize to the resolution the thermometer set, 1/16 °C at 12 bit
+	char buf[128];
+	FILE *fp = fopen((sensorPath + "/resolution").c_str(), "r");
+	int bits = 12;
+	if (fp)
+	{
+		if (fscanf(fp, "%d", &bits) != 1 || bits < 9 || bits > 12)
+			bits = 12;
+		fclose(fp);
+	}
+
+	double hours = (monotonicNow() - thermometerStart) / 3600e9;
+	double lsb = 1.0 / (1 << (bits - 8));
+	long millicelsius = lround(floor((startCelsius + rate * hours) / lsb) * lsb * 1000);
+
+	// replaced atomically, the thermometer thread may be reading it
+	snprintf(buf, sizeof(buf), "50 05 4b 46 7f ff 0c 10 1c : crc=1c YES\n50 05 4b 46 7f ff 0c 10 1c t=%ld\n", millicelsius);
+	if (writeFile(sensorPath + "/w1_slave.tmp", buf))
+		rename((sensorPath + "/w1_slave.tmp").c_str(), (sensorPath + "/w1_slave").c_str());
+}
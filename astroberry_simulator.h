@@ -0,0 +1,109 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYSIMULATOR_H
+#define ASTROBERRYSIMULATOR_H
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "astroberry_gpio.h"
+
+/*
+ * Focuser simulator
+ *
+ * A virtual motor driver listens on the mock GPIO chip the stepper drives in
+ * simulation mode. Every rising edge on the step line moves the motor by one
+ * microstep of the resolution decoded from the mode lines, in the direction
+ * of the dir line, unless the driver is asleep. The drawtube follows the motor
+ * through a dead band, so backlash compensation can be checked as well.
+ * A share of the steps can be lost, and a quadrature encoder on the motor
+ * shaft or on the drawtube reports where it really went on two input lines.
+ * Step timestamps of the current move are recorded for step rate and start
+ * latency statistics.
+ *
+ * A DS18B20 is simulated by a w1 devices directory in /tmp, the sensor
+ * reports a temperature changing at a constant rate from a start value.
+ */
+struct AstroberrySimulatorStats
+{
+	long steps;
+	long missed; // steps while the driver was asleep
+	double latency; // µs from the move request to the first step
+	double minPeriod; // µs
+	double maxPeriod; // µs
+	double meanPeriod; // µs
+};
+
+class AstroberrySimulator : public AstroberryGpioListener
+{
+public:
+	enum { PIN_DIR, PIN_STEP, PIN_SLEEP, PIN_M0, PIN_M1, PIN_M2, PIN_COUNT };
+
+	AstroberrySimulator();
+	~AstroberrySimulator();
+	AstroberryMockChip &getChip() { return chip; }
+	void configure(int board, const unsigned int pins[PIN_COUNT]);
+	void setBacklash(int backlash) { this->backlash = backlash; } // MAX_RESOLUTION units
+	void setStepLoss(int percent) { stepLoss = percent; }
+	void setEncoder(unsigned int pinA, unsigned int pinB, int counts, bool onDrawtube = false); // counts per full step, 0 for none, not while moving
+	void setPosition(int position); // motor & drawtube, engaged for outward motion
+	int getMotorPosition() const { return motor.load(); }
+	int getDrawtubePosition() const { return drawtube.load(); }
+	void beginMove();
+	AstroberrySimulatorStats getStats();
+	std::vector<int64_t> getStepTimes();
+	void lineChanged(unsigned int offset, int value, int64_t timestamp) override;
+
+	bool startThermometer(double celsius, double rate);
+	void stopThermometer();
+	void updateTemperature();
+	std::string getDevicesPath() const { return root + "/devices"; }
+private:
+	int getMicrostep();
+	void updateEncoder(int position, bool jump = false); // a jump sets the lines without edges in between
+
+	AstroberryMockChip chip;
+	int board { 0 };
+	unsigned int pins[PIN_COUNT] { 0, 0, 0, 0, 0, 0 };
+	std::atomic<int> backlash { 0 };
+	std::atomic<int> motor { 0 };
+	std::atomic<int> drawtube { 0 };
+	std::atomic<int> stepLoss { 0 }; // %
+	int lossBudget { 0 }; // stepping thread only
+	unsigned int encoderPins[2] { 0, 0 };
+	std::atomic<int> encoderCounts { 0 };
+	std::atomic<bool> encoderOnDrawtube { false };
+	long encoderCount { 0 }; // stepping thread only
+
+	std::mutex mutex; // guards the statistics below
+	std::vector<int64_t> stepTimes;
+	int64_t moveStart { 0 };
+	long missed { 0 };
+
+	std::string root;
+	std::string sensorPath;
+	double startCelsius { 0 };
+	double rate { 0 }; // °C per hour
+	int64_t thermometerStart { 0 };
+};
+
+#endif
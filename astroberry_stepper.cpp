@@ -0,0 +1,593 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <utility>
+#include <time.h>
+#include <unistd.h>
+
+#include "astroberry_gpio.h"
+#include "astroberry_stepper.h"
+
+#define NSEC_PER_SEC 1000000000L
+#define STEPPER_WAKEUP_DELAY 2000000L // 2 ms for the driver charge pump to settle after wake up
+#define STEPPER_THREAD_PRIORITY 50
+
+static void timespecAdd(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+static uint64_t timespecNs(const struct timespec &ts)
+{
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static bool timespecBefore(const struct timespec &a, const struct timespec &b)
+{
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static void sleepUntil(const struct timespec *deadline)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, nullptr) == EINTR);
+}
+
+// microstep mode pin levels for 1/1 to 1/32 resolution
+static const int modeTable[3][6][3] =
+{
+	// DRV8834 - M0, M1
+	{ { 0, 0, 0 }, { 1, 0, 0 }, { 2, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 }, { 2, 1, 0 } },
+	// A4988 - MS1, MS2, MS3
+	{ { 0, 0, 0 }, { 1, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 1, 1 }, { -1, -1, -1 } },
+	// DRV8825 - M0, M1, M2
+	{ { 0, 0, 0 }, { 1, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 }, { 0, 0, 1 }, { 1, 0, 1 } },
+};
+
+static const char *modeConsumer[3] = { "m0@astroberry_focuser", "m1@astroberry_focuser", "m2@astroberry_focuser" };
+
+AstroberryStepperEngine &AstroberryStepperEngine::shared()
+{
+	// never destroyed, steppers may stop from static destructors
+	static AstroberryStepperEngine *engine = new AstroberryStepperEngine();
+	return *engine;
+}
+
+void AstroberryStepperEngine::attach(AstroberryStepper *channel)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	channels.push_back(channel);
+	if (worker.joinable())
+		return;
+
+	quit = false;
+	worker = std::thread(&AstroberryStepperEngine::run, this);
+
+	// best effort - needs CAP_SYS_NICE, otherwise we stay with normal scheduling
+	struct sched_param param;
+	param.sched_priority = STEPPER_THREAD_PRIORITY;
+	pthread_setschedparam(worker.native_handle(), SCHED_FIFO, &param);
+}
+
+void AstroberryStepperEngine::detach(AstroberryStepper *channel)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		channels.erase(std::remove(channels.begin(), channels.end(), channel), channels.end());
+		if (!channels.empty() || !worker.joinable())
+			return;
+		quit = true;
+	}
+
+	// last channel gone, so is the thread
+	cv.notify_one();
+	worker.join();
+}
+
+void AstroberryStepperEngine::wake()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		signalled = true;
+	}
+	cv.notify_one();
+}
+
+void AstroberryStepperEngine::run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (!quit)
+	{
+		// pick up commands sent since the last event
+		if (signalled)
+		{
+			signalled = false;
+			for (AstroberryStepper *channel : channels)
+				channel->poll();
+		}
+
+		// the channel with the earliest deadline goes next
+		AstroberryStepper *due = nullptr;
+		for (AstroberryStepper *channel : channels)
+		{
+			if (channel->running && (!due || timespecBefore(channel->deadline, due->deadline)))
+				due = channel;
+		}
+
+		if (!due)
+		{
+			cv.wait(lock, [this] { return signalled || quit; });
+			continue;
+		}
+
+		const struct timespec deadline = due->deadline;
+		lock.unlock();
+		sleepUntil(&deadline);
+		lock.lock();
+
+		// the channel may have been stopped while we slept
+		if (std::find(channels.begin(), channels.end(), due) != channels.end())
+			due->step();
+	}
+}
+
+AstroberryStepper::AstroberryStepper()
+{
+}
+
+bool AstroberryStepper::getModePins(int board, int resolution, uint8_t mode[3])
+{
+	int index = 0;
+	while ((1 << index) < resolution && index < 5)
+		index++;
+
+	if (board < 0 || board > 2 || (1 << index) != resolution || modeTable[board][index][0] < 0)
+		return false;
+
+	for (int i = 0; i < 3; i++)
+		mode[i] = modeTable[board][index][i];
+
+	return true;
+}
+
+AstroberryStepper::~AstroberryStepper()
+{
+	stop();
+}
+
+bool AstroberryStepper::start(AstroberryGpioLine *dir, AstroberryGpioLine *step, AstroberryGpioLine *sleep, AstroberryGpioLine *mode[3], const uint8_t level[3])
+{
+	if (started)
+		return true;
+
+	if (pipe2(notifyFd, O_NONBLOCK | O_CLOEXEC) != 0)
+		return false;
+
+	gpio_dir = dir;
+	gpio_step = step;
+	gpio_sleep = sleep;
+	for (int i = 0; i < 3; i++)
+	{
+		gpio_mode[i] = mode[i];
+		modeLevel[i] = level[i];
+	}
+	asleep = gpio_sleep->getValue() == 1;
+	running = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = CMD_NONE;
+		started = true;
+	}
+
+	AstroberryStepperEngine::shared().attach(this);
+	return true;
+}
+
+void AstroberryStepper::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!started)
+			return;
+		started = false;
+		pending = CMD_NONE;
+	}
+	AstroberryStepperEngine::shared().detach(this);
+
+	// never leave a move hanging, it stops where the last event left it
+	if (running)
+	{
+		gpio_step->setValue(0);
+		running = false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		target = position.load();
+		speed = 0;
+		moving = false;
+		aborting = false;
+		interrupt = false;
+	}
+
+	close(notifyFd[0]);
+	close(notifyFd[1]);
+	notifyFd[0] = notifyFd[1] = -1;
+}
+
+bool AstroberryStepper::setResolution(const AstroberryResolution &res)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (moving)
+		return false;
+
+	schedule.setResolution(res);
+	spare.setResolution(res);
+	return true;
+}
+
+void AstroberryStepper::setApproach(int direction, int steps, int min, int max)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	approach = direction;
+	overshoot = steps;
+	overshootMin = min;
+	overshootMax = max;
+}
+
+int AstroberryStepper::getOvershoot(int from, int to) const
+{
+	// only moves ending against the approach direction go past the target, as far as travel allows
+	const int dir = to > from ? 1 : -1;
+	if (approach == 0 || to == from || dir == approach)
+		return 0;
+
+	const int room = (dir == 1 ? overshootMax - to : to - overshootMin) / schedule.getResolution().fineStep;
+	return std::max(0, std::min(overshoot, room));
+}
+
+int AstroberryStepper::getBacklash(int to, int backlash) const
+{
+	// an overshoot or a reversing retarget leaves the gears loaded in the direction of the last step
+	const int dir = to > position ? 1 : -1;
+	return dir == direction ? 0 : backlash;
+}
+
+bool AstroberryStepper::move(int newTarget, int backlash, bool reverse, const AstroberryPlanner &profile)
+{
+	struct timespec command;
+	clock_gettime(CLOCK_MONOTONIC, &command);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!started || moving || pending == CMD_MOVE)
+			return false;
+
+		target = newTarget;
+		if ((newTarget > position ? 1 : -1) != direction)
+			legStart = position;
+		direction = newTarget > position ? 1 : -1;
+		moveReverse = reverse;
+		planner = profile;
+		schedule.compile(position, newTarget, backlash, reverse, planner, 0, true, getOvershoot(position, newTarget));
+		timing.begin(command, timingSamples, schedule.size());
+		aborting = false;
+		replan = false;
+		interrupt = false;
+		moving = true;
+		pending = CMD_MOVE;
+	}
+	AstroberryStepperEngine::shared().wake();
+	return true;
+}
+
+bool AstroberryStepper::retarget(int newTarget, int backlash)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!moving || aborting)
+		return false;
+
+	// the worker replans between two steps
+	target = newTarget;
+	retargetBacklash = backlash;
+	replan = true;
+	interrupt = true;
+	return true;
+}
+
+void AstroberryStepper::abort()
+{
+	aborting = true;
+	interrupt = true;
+}
+
+void AstroberryStepper::standby()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!started || moving)
+			return;
+		pending = CMD_STANDBY;
+	}
+	AstroberryStepperEngine::shared().wake();
+}
+
+void AstroberryStepper::setPosition(int pos)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!moving)
+	{
+		position = target = legStart = pos;
+		takeUp = 0;
+	}
+}
+
+void AstroberryStepper::clearNotify()
+{
+	char buf[16];
+	while (read(notifyFd[0], buf, sizeof(buf)) > 0);
+}
+
+void AstroberryStepper::notify()
+{
+	char c = 1;
+	if (write(notifyFd[1], &c, 1) < 0 && errno != EAGAIN)
+		return;
+}
+
+void AstroberryStepper::setModeLine(int line, uint8_t value)
+{
+	int m = line - AstroberrySchedule::LINE_M0;
+
+	if (modeLevel[m] == value)
+		return;
+
+	if (value == AstroberrySchedule::MODE_FLOAT)
+	{
+		// high impedance - request as input
+		gpio_mode[m]->release();
+		gpio_mode[m]->requestInput(modeConsumer[m]);
+	}
+	else if (modeLevel[m] == AstroberrySchedule::MODE_FLOAT)
+	{
+		gpio_mode[m]->release();
+		gpio_mode[m]->requestOutput(modeConsumer[m], value);
+	} else {
+		gpio_mode[m]->setValue(value);
+	}
+
+	modeLevel[m] = value;
+}
+
+void AstroberryStepper::poll()
+{
+	Command cmd;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cmd = pending;
+		pending = CMD_NONE;
+	}
+
+	if (cmd == CMD_STANDBY)
+	{
+		gpio_sleep->setValue(1);
+		asleep = true;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		publish(AstroberryTelemetry::PHASE_STANDBY, now);
+	}
+
+	if (cmd == CMD_MOVE)
+		begin();
+}
+
+bool AstroberryStepper::replanMove()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	replan = false;
+	interrupt = aborting.load();
+	if (aborting)
+		return false;
+
+	// settling in the approach direction needs a run of at least the overshoot, or backlash is left in the gears
+	// a shorter run heads for the overshoot point first and comes back from there
+	const int fineStep = schedule.getResolution().fineStep;
+	const int approachRun = getOvershoot(target + approach, target) * fineStep;
+	const int runStart = direction == approach ? legStart : position.load();
+	int goal = target;
+	if (approach != 0 && (target - position) * approach >= 0 && (target - runStart) * approach < approachRun)
+	{
+		goal = target - approach * approachRun;
+		replan = true;
+	}
+	if (goal == position)
+		return false;
+	const int goalOvershoot = goal == target ? getOvershoot(position, goal) : 0;
+
+	const int remaining = (goal - position) * direction;
+	const int stopping = planner.stoppingDistance(speed) * fineStep;
+
+	if (remaining > 0 && remaining >= stopping)
+	{
+		// same direction, so no direction change and no backlash
+		spare.compile(position, goal, 0, moveReverse, planner, speed, false, goalOvershoot);
+	}
+	else if (stopping > 0)
+	{
+		// behind us or too close to stop - come to a stop and plan the way back from there
+		spare.compile(position, position + direction * stopping, 0, moveReverse, planner, speed, false);
+		replan = true;
+	} else {
+		// at rest - reverse with backlash compensation
+		direction = -direction;
+		legStart = position;
+		spare.compile(position, goal, retargetBacklash, moveReverse, planner, 0, true, goalOvershoot);
+	}
+
+	std::swap(schedule, spare);
+	return true;
+}
+
+void AstroberryStepper::begin()
+{
+	clock_gettime(CLOCK_MONOTONIC, &origin);
+
+	// motor wake up
+	if (asleep)
+	{
+		gpio_sleep->setValue(0);
+		asleep = false;
+		timespecAdd(&origin, STEPPER_WAKEUP_DELAY);
+	}
+
+	next = 0;
+	deadline = origin;
+	if (schedule.size() > 0)
+		timespecAdd(&deadline, schedule[0].time);
+	plannedEnd = timespecNs(origin) + schedule.duration();
+	running = true;
+	lastMissed = 0;
+	publish(AstroberryTelemetry::PHASE_START, origin);
+}
+
+void AstroberryStepper::step()
+{
+	AstroberryGpioLine *lines[AstroberrySchedule::LINE_M0] = { gpio_dir, gpio_step };
+	const AstroberryStepEvent *events = schedule.data();
+	const size_t count = schedule.size();
+	bool interrupted = false;
+
+	// fire the event that is due
+	if (next < count)
+	{
+		const AstroberryStepEvent &e = events[next++];
+		if (e.line < AstroberrySchedule::LINE_M0)
+			lines[e.line]->setValue(e.value);
+		else
+			setModeLine(e.line, e.value);
+		if (e.line == AstroberrySchedule::LINE_DIR)
+		{
+			// an overshoot reverses mid schedule
+			const int dir = (e.value == 1) != moveReverse ? 1 : -1;
+			if (dir != direction)
+				legStart = position;
+			direction = dir;
+		}
+		if (e.line == AstroberrySchedule::LINE_STEP)
+			timing.record(deadline, next < count ? events[next].time - e.time : 0);
+		if (e.line == AstroberrySchedule::LINE_STEP && e.value == 0 && e.delta == 0)
+			takeUp.fetch_add(direction * schedule.getResolution().fineStep, std::memory_order_relaxed);
+		position.fetch_add(e.delta, std::memory_order_relaxed);
+		speed.store(e.speed, std::memory_order_relaxed);
+		if (e.delta != 0 && timespecNs(deadline) - lastPublish >= TELEMETRY_INTERVAL)
+			publish(AstroberryTelemetry::PHASE_TRAVEL, deadline);
+
+		// a step pulse is counted on its falling edge, so never stop with the step line high
+		// abort right away, retarget only once a travel step is done
+		bool stepLow = e.line != AstroberrySchedule::LINE_STEP || e.value == 0;
+		interrupted = stepLow && interrupt.load(std::memory_order_relaxed) && (aborting || e.delta != 0);
+		if (!interrupted && next < count)
+		{
+			deadline = origin;
+			timespecAdd(&deadline, events[next].time);
+			return;
+		}
+	}
+
+	if (aborting)
+	{
+		gpio_step->setValue(0);
+		endMove(AstroberryTelemetry::PHASE_ABORT);
+		return;
+	}
+
+	if (interrupted)
+	{
+		// retargeted between two steps - next step is due half a period after this one
+		timespecAdd(&deadline, events[next - 1].time - events[next - 2].time);
+	} else {
+		// schedule done - a retarget may have arrived after the last step
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		speed = 0;
+		if (!replan)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!replan)
+			{
+				moving = false;
+				running = false;
+				publish(AstroberryTelemetry::PHASE_DONE, deadline);
+				notify();
+				return;
+			}
+		}
+	}
+
+	if (!replanMove())
+	{
+		endMove(aborting ? AstroberryTelemetry::PHASE_ABORT : AstroberryTelemetry::PHASE_DONE);
+		return;
+	}
+
+	// carry on with the new schedule
+	publish(AstroberryTelemetry::PHASE_REPLAN, deadline);
+	origin = deadline;
+	next = 0;
+	if (schedule.size() > 0)
+		timespecAdd(&deadline, schedule[0].time);
+	plannedEnd = timespecNs(origin) + schedule.duration();
+	replans++;
+}
+
+void AstroberryStepper::endMove(int phase)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		target = position.load();
+		speed = 0;
+		moving = false;
+		aborting = false;
+		interrupt = false;
+	}
+	running = false;
+	publish(phase, deadline);
+	notify();
+}
+
+void AstroberryStepper::publish(int phase, const struct timespec &time)
+{
+	AstroberryTelemetryRecord record;
+	record.time = timespecNs(time);
+	record.position = position.load(std::memory_order_relaxed);
+	record.target = target.load(std::memory_order_relaxed);
+	record.speed = speed.load(std::memory_order_relaxed);
+	record.phase = phase;
+	record.flags = timing.getMissed() != lastMissed ? AstroberryTelemetry::FLAG_LATE : 0;
+	lastMissed = timing.getMissed();
+	lastPublish = record.time;
+	telemetry.publish(record);
+}
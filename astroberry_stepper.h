@@ -0,0 +1,178 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYSTEPPER_H
+#define ASTROBERRYSTEPPER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "astroberry_planner.h"
+#include "astroberry_schedule.h"
+#include "astroberry_telemetry.h"
+#include "astroberry_timing.h"
+
+class AstroberryGpioLine;
+class AstroberryStepper;
+
+/*
+ * Stepping engine
+ *
+ * One worker thread per process replays the step schedules of all started
+ * steppers. It sleeps until the earliest deadline of any channel and fires
+ * that one event, so simultaneous moves interleave edge by edge, each on its
+ * own deadlines. A command for an idle channel is picked up right away when
+ * no channel moves, otherwise at the next deadline of a moving one.
+ */
+class AstroberryStepperEngine
+{
+public:
+	static AstroberryStepperEngine &shared();
+	void attach(AstroberryStepper *channel);
+	void detach(AstroberryStepper *channel);
+	void wake();
+private:
+	AstroberryStepperEngine() {}
+	void run();
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<AstroberryStepper*> channels;
+	bool signalled { false };
+	bool quit { false };
+};
+
+/*
+ * Stepper channel
+ *
+ * The stepping engine owns the dir, step and sleep lines once started. The
+ * INDI thread only sends commands (move, retarget, abort, standby) and reads
+ * progress. Every move is compiled into a step schedule before motion starts
+ * and the engine replays it against absolute CLOCK_MONOTONIC deadlines, so
+ * time spent in GPIO calls does not accumulate into the step period. A retarget compiles
+ * the rest of the move from current speed and swaps the schedule between steps.
+ * If the new target is behind us, or too close to stop in time, the motor
+ * decelerates to a stop first and heads back with backlash compensation.
+ * With an approach direction set, every move that ends against it overshoots
+ * the target and comes back, so the motor always settles from the same side.
+ * A retarget that would settle after a shorter run than the overshoot goes
+ * back past the target first, so the backlash is always taken up.
+ * Every step line edge is timed against its deadline, see AstroberryStepTiming.
+ * Progress is published as telemetry records, see AstroberryTelemetry.
+ * A byte is written to the notify pipe every time a move finishes.
+ */
+class AstroberryStepper
+{
+public:
+	enum { BOARD_DRV8834, BOARD_A4988, BOARD_DRV8825 };
+
+	AstroberryStepper();
+	~AstroberryStepper();
+	static bool getModePins(int board, int resolution, uint8_t mode[3]);
+	bool start(AstroberryGpioLine *dir, AstroberryGpioLine *step, AstroberryGpioLine *sleep, AstroberryGpioLine *mode[3], const uint8_t level[3]);
+	bool setResolution(const AstroberryResolution &res);
+	void setApproach(int direction, int overshoot, int min, int max); // direction 0 disables overshoot, overshoot in fine steps, min & max bound it
+	int getOvershoot(int from, int to) const; // fine steps a move from to would overshoot
+	int getBacklash(int to, int backlash) const; // backlash steps a move to would take up, only when it reverses the last direction travelled
+	void stop();
+	bool move(int target, int backlash, bool reverse, const AstroberryPlanner &profile);
+	bool retarget(int target, int backlash);
+	void abort();
+	void standby();
+	void setPosition(int pos);
+	int getPosition() const { return position.load(); }
+	int getShaftPosition() const { return position.load() + takeUp.load(); } // backlash take-up included
+	int getTarget() const { return target.load(); }
+	int getDirection() const { return direction.load(); }
+	bool isMoving() const { return moving.load(); }
+	bool isStandby() const { return asleep.load(); }
+	double getSpeed() const { return speed.load(); }
+	uint64_t getPlannedEnd() const { return plannedEnd.load(); } // CLOCK_MONOTONIC ns the schedule in progress ends
+	unsigned long getReplans() const { return replans.load(); } // schedules replanned by retargets so far
+	const AstroberrySchedule &getSchedule() const { return schedule; } // only valid while not moving
+	const AstroberryStepTiming &getTiming() const { return timing; } // only valid while not moving
+	void setTimingSamples(bool enabled) { timingSamples = enabled; } // keep raw samples of the next moves
+	AstroberryTelemetry &getTelemetry() { return telemetry; } // consumer side only
+	int getNotifyFd() const { return notifyFd[0]; }
+	void clearNotify();
+private:
+	friend class AstroberryStepperEngine;
+	enum Command { CMD_NONE, CMD_MOVE, CMD_STANDBY };
+
+	// called by the stepping engine
+	void poll();
+	void begin();
+	void step();
+	void endMove(int phase);
+	void publish(int phase, const struct timespec &time);
+	bool replanMove();
+	void setModeLine(int line, uint8_t value);
+	void notify();
+
+	AstroberryGpioLine *gpio_dir { nullptr };
+	AstroberryGpioLine *gpio_step { nullptr };
+	AstroberryGpioLine *gpio_sleep { nullptr };
+	AstroberryGpioLine *gpio_mode[3] { nullptr, nullptr, nullptr };
+	uint8_t modeLevel[3] { 0, 0, 0 };
+
+	std::mutex mutex;
+	bool started { false };
+	Command pending { CMD_NONE };
+	bool moveReverse { false };
+	int retargetBacklash { 0 };
+	int legStart { 0 }; // position the current direction of travel started from
+	int approach { 0 };
+	int overshoot { 0 };
+	int overshootMin { 0 };
+	int overshootMax { 0 };
+	AstroberryPlanner planner;
+	AstroberrySchedule schedule;
+	AstroberrySchedule spare;
+	AstroberryStepTiming timing;
+	std::atomic<bool> timingSamples { false };
+	AstroberryTelemetry telemetry;
+	uint64_t lastPublish { 0 };
+	size_t lastMissed { 0 };
+
+	std::atomic<int> position { 0 };
+	std::atomic<int> takeUp { 0 }; // motor travel of backlash take-up since setPosition
+	std::atomic<int> target { 0 };
+	std::atomic<int> direction { 1 };
+	std::atomic<bool> moving { false };
+	std::atomic<bool> aborting { false };
+	std::atomic<bool> asleep { false };
+	std::atomic<bool> replan { false };
+	std::atomic<bool> interrupt { false };
+	std::atomic<double> speed { 0 };
+	std::atomic<uint64_t> plannedEnd { 0 };
+	std::atomic<unsigned long> replans { 0 };
+	int notifyFd[2] { -1, -1 };
+
+	// replay state, only touched by the stepping engine
+	bool running { false };
+	size_t next { 0 };
+	struct timespec origin; // time zero of the schedule
+	struct timespec deadline;
+};
+
+#endif
@@ -0,0 +1,79 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <stdio.h>
+
+#include "astroberry_telemetry.h"
+
+static const char *phaseNames[] = { "start", "travel", "replan", "done", "abort", "standby" };
+
+bool AstroberryTelemetry::publish(const AstroberryTelemetryRecord &record)
+{
+	const size_t h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) == TELEMETRY_RING_SIZE)
+	{
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		overrun = true;
+		return false;
+	}
+
+	AstroberryTelemetryRecord &slot = ring[h % TELEMETRY_RING_SIZE];
+	slot = record;
+	if (overrun)
+		slot.flags |= FLAG_DROPPED;
+	overrun = false;
+
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
+
+size_t AstroberryTelemetry::drain(AstroberryTelemetryRecord *last)
+{
+	const size_t h = head.load(std::memory_order_acquire);
+	size_t t = tail.load(std::memory_order_relaxed);
+	const size_t count = h - t;
+
+	for (; t != h; t++)
+		history[historyCount++ % TELEMETRY_HISTORY_SIZE] = ring[t % TELEMETRY_RING_SIZE];
+	tail.store(t, std::memory_order_release);
+
+	if (count > 0 && last)
+		*last = history[(historyCount - 1) % TELEMETRY_HISTORY_SIZE];
+
+	return count;
+}
+
+bool AstroberryTelemetry::dump(const char *fileName) const
+{
+	FILE *pFile = fopen(fileName, "w");
+	if (pFile == NULL)
+		return false;
+
+	// oldest record first
+	const size_t size = getHistorySize();
+	fprintf(pFile, "time_ns,position,target,speed,phase,late,dropped\n");
+	for (size_t i = historyCount - size; i < historyCount; i++)
+	{
+		const AstroberryTelemetryRecord &r = history[i % TELEMETRY_HISTORY_SIZE];
+		fprintf(pFile, "%llu,%d,%d,%0.1f,%s,%d,%d\n", (unsigned long long) r.time, r.position, r.target, r.speed,
+			r.phase <= PHASE_STANDBY ? phaseNames[r.phase] : "?", (r.flags & FLAG_LATE) != 0, (r.flags & FLAG_DROPPED) != 0);
+	}
+
+	fclose(pFile);
+	return true;
+}
@@ -0,0 +1,79 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYTELEMETRY_H
+#define ASTROBERRYTELEMETRY_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_RING_SIZE 256 // records in flight between the threads, power of 2
+#define TELEMETRY_HISTORY_SIZE 4096 // records kept for a dump
+#define TELEMETRY_INTERVAL 10000000L // ns between travel records of a move
+
+/*
+ * Motion telemetry
+ *
+ * The stepper thread publishes fixed-size records of where the motor is:
+ * at every phase change of a move and every TELEMETRY_INTERVAL of travel.
+ * Records pass through a single-producer/single-consumer ring, so publishing
+ * takes neither a lock nor an allocation. When the ring is full the record is
+ * dropped and the next one that fits carries FLAG_DROPPED.
+ *
+ * The INDI thread drains the ring, keeps the latest records in a history
+ * and updates its properties from the last one. The history can be dumped
+ * to CSV at any time.
+ */
+struct AstroberryTelemetryRecord
+{
+	uint64_t time;		// CLOCK_MONOTONIC ns
+	int32_t position;	// MAX_RESOLUTION units
+	int32_t target;		// MAX_RESOLUTION units
+	float speed;		// fine steps/s
+	uint8_t phase;		// AstroberryTelemetry::PHASE_*
+	uint8_t flags;		// AstroberryTelemetry::FLAG_*
+};
+
+class AstroberryTelemetry
+{
+public:
+	enum { PHASE_START, PHASE_TRAVEL, PHASE_REPLAN, PHASE_DONE, PHASE_ABORT, PHASE_STANDBY };
+	enum { FLAG_LATE = 1, FLAG_DROPPED = 2 };
+
+	// stepper thread
+	bool publish(const AstroberryTelemetryRecord &record);
+
+	// INDI thread
+	size_t drain(AstroberryTelemetryRecord *last = nullptr);
+	unsigned long getDropped() const { return dropped.load(); }
+	size_t getHistorySize() const { return historyCount < TELEMETRY_HISTORY_SIZE ? historyCount : TELEMETRY_HISTORY_SIZE; }
+	bool dump(const char *fileName) const;
+private:
+	// the ring keeps head and tail on separate cache lines
+	std::atomic<size_t> head { 0 }; // written by the producer only
+	AstroberryTelemetryRecord ring[TELEMETRY_RING_SIZE];
+	std::atomic<size_t> tail { 0 }; // written by the consumer only
+	std::atomic<unsigned long> dropped { 0 };
+	bool overrun { false }; // producer only
+
+	AstroberryTelemetryRecord history[TELEMETRY_HISTORY_SIZE];
+	size_t historyCount { 0 }; // records ever drained
+};
+
+#endif
@@ -0,0 +1,597 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <map>
+#include <math.h>
+#include <memory>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "astroberry_thermometer.h"
+
+#define DS18B20_FAMILY "28-" // DS18B20 device is family code beginning with 28-
+#define DS18B20_CONVERSION_TIME 750 // ms at 12 bit resolution
+#define DS18B20_CONVERSION_MARGIN 250 // ms
+
+static bool readAttribute(const std::string &path, char *buf, size_t size)
+{
+	ssize_t length = 0, numRead;
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	while (length < (ssize_t) size - 1 && (numRead = read(fd, buf + length, size - 1 - length)) > 0)
+		length += numRead;
+	close(fd);
+	buf[length] = 0;
+
+	return length > 0;
+}
+
+static bool writeAttribute(const std::string &path, const char *value)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	bool ok = write(fd, value, strlen(value)) == (ssize_t) strlen(value);
+	close(fd);
+
+	return ok;
+}
+
+static int64_t monotonicNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+AstroberryThermometer::AstroberryThermometer() : devicesPath(THERMOMETER_W1_DEVICES)
+{
+	for (int i = 0; i < THERMOMETER_MAX_SENSORS; i++)
+		celsius[i] = NAN;
+}
+
+AstroberryThermometer::~AstroberryThermometer()
+{
+	stop();
+}
+
+AstroberryThermometer &AstroberryThermometer::shared(const std::string &path)
+{
+	static std::mutex mutex;
+	static std::map<std::string, std::unique_ptr<AstroberryThermometer>> thermometers;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::unique_ptr<AstroberryThermometer> &thermometer = thermometers[path];
+	if (!thermometer)
+	{
+		thermometer.reset(new AstroberryThermometer());
+		thermometer->setDevicesPath(path);
+	}
+
+	return *thermometer;
+}
+
+int AstroberryThermometer::subscribe(int readInterval, int samples)
+{
+	std::lock_guard<std::mutex> lock(readersMutex);
+
+	Reader reader;
+	if (pipe2(reader.fd, O_NONBLOCK | O_CLOEXEC) != 0)
+		return -1;
+	reader.interval = readInterval;
+	reader.oversampling = samples;
+
+	if (readers.empty() && !start(readInterval))
+	{
+		close(reader.fd[0]);
+		close(reader.fd[1]);
+		return -1;
+	}
+
+	readers.push_back(reader);
+	applySampling();
+
+	return reader.fd[0];
+}
+
+void AstroberryThermometer::unsubscribe(int fd)
+{
+	{
+		std::lock_guard<std::mutex> lock(readersMutex);
+		for (size_t i = 0; i < readers.size(); i++)
+		{
+			if (readers[i].fd[0] != fd)
+				continue;
+			close(readers[i].fd[0]);
+			close(readers[i].fd[1]);
+			readers.erase(readers.begin() + i);
+			break;
+		}
+		if (!readers.empty())
+		{
+			applySampling();
+			return;
+		}
+	}
+
+	// the worker may be waiting for the readers to publish, stop it unlocked
+	stop();
+}
+
+void AstroberryThermometer::setSampling(int fd, int readInterval, int samples)
+{
+	std::lock_guard<std::mutex> lock(readersMutex);
+	for (Reader &reader : readers)
+	{
+		if (reader.fd[0] != fd)
+			continue;
+		reader.interval = readInterval;
+		reader.oversampling = samples;
+	}
+	applySampling();
+}
+
+void AstroberryThermometer::applySampling()
+{
+	// every reader gets readings at least as often and as good as it asked for
+	if (readers.empty())
+		return;
+
+	int shortest = readers[0].interval, most = readers[0].oversampling;
+	for (const Reader &reader : readers)
+	{
+		shortest = std::min(shortest, reader.interval);
+		most = std::max(most, reader.oversampling);
+	}
+	setOversampling(most);
+	setInterval(shortest);
+}
+
+bool AstroberryThermometer::start(int readInterval)
+{
+	if (worker.joinable())
+		return true;
+
+	interval = readInterval;
+	appliedResolution = 0;
+
+	// 1-Wire interface not enabled
+	if (access(devicesPath.c_str(), R_OK) != 0)
+		return false;
+
+	if (pipe2(quitFd, O_NONBLOCK | O_CLOEXEC) != 0)
+		return false;
+
+	if (pipe2(notifyFd, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		close(quitFd[0]);
+		close(quitFd[1]);
+		return false;
+	}
+
+	// sysfs may not deliver events on every kernel - a failed read rescans anyway
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd >= 0)
+		inotify_add_watch(inotifyFd, devicesPath.c_str(), IN_CREATE | IN_DELETE);
+
+	// look up the sensors right away, so callers know if they are there
+	findSensors();
+
+	worker = std::thread(&AstroberryThermometer::run, this);
+
+	return true;
+}
+
+void AstroberryThermometer::setInterval(int ms)
+{
+	interval = ms;
+	wake();
+}
+
+void AstroberryThermometer::setResolution(int bits)
+{
+	resolution = bits < 9 ? 9 : bits > 12 ? 12 : bits;
+	wake();
+}
+
+void AstroberryThermometer::setOversampling(int samples)
+{
+	oversampling = samples < 1 ? 1 : samples > THERMOMETER_MAX_OVERSAMPLING ? THERMOMETER_MAX_OVERSAMPLING : samples;
+}
+
+int AstroberryThermometer::getConversionTime() const
+{
+	return DS18B20_CONVERSION_TIME >> (12 - resolution.load());
+}
+
+void AstroberryThermometer::wake()
+{
+	if (quitFd[1] < 0)
+		return;
+
+	char c = 0;
+	if (write(quitFd[1], &c, 1) < 0 && errno != EAGAIN)
+		return;
+}
+
+void AstroberryThermometer::stop()
+{
+	if (!worker.joinable())
+		return;
+
+	quit = true;
+	char c = 1;
+	if (write(quitFd[1], &c, 1) < 0)
+		return;
+	worker.join();
+	quit = false;
+
+	if (inotifyFd >= 0)
+		close(inotifyFd);
+	close(quitFd[0]);
+	close(quitFd[1]);
+	close(notifyFd[0]);
+	close(notifyFd[1]);
+	inotifyFd = quitFd[0] = quitFd[1] = notifyFd[0] = notifyFd[1] = -1;
+	sensorCount = 0;
+}
+
+std::vector<std::string> AstroberryThermometer::getSensorIds()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return sensorIds;
+}
+
+bool AstroberryThermometer::getTemperature(AstroberryTemperature &reading) const
+{
+	uint32_t seq;
+
+	do {
+		// odd sequence - update in progress
+		while ((seq = sequence.load(std::memory_order_acquire)) & 1);
+		reading.count = count.load(std::memory_order_relaxed);
+		for (int i = 0; i < THERMOMETER_MAX_SENSORS; i++)
+			reading.celsius[i] = celsius[i].load(std::memory_order_relaxed);
+		reading.timestamp = timestamp.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while (seq != sequence.load(std::memory_order_relaxed));
+
+	return reading.timestamp != 0;
+}
+
+double AstroberryThermometer::getAge() const
+{
+	AstroberryTemperature reading;
+	if (!getTemperature(reading))
+		return INFINITY;
+
+	return (monotonicNow() - reading.timestamp) / 1e9;
+}
+
+void AstroberryThermometer::clearNotify()
+{
+	clearNotify(notifyFd[0]);
+}
+
+void AstroberryThermometer::clearNotify(int fd)
+{
+	char buf[16];
+	while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+void AstroberryThermometer::publish(const float *values, int n)
+{
+	uint32_t seq = sequence.load(std::memory_order_relaxed);
+
+	sequence.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	count.store(n, std::memory_order_relaxed);
+	for (int i = 0; i < THERMOMETER_MAX_SENSORS; i++)
+		celsius[i].store(i < n ? values[i] : NAN, std::memory_order_relaxed);
+	timestamp.store(monotonicNow(), std::memory_order_relaxed);
+	sequence.store(seq + 2, std::memory_order_release);
+
+	char c = 1;
+	if (write(notifyFd[1], &c, 1) < 0 && errno != EAGAIN)
+		return;
+
+	std::lock_guard<std::mutex> lock(readersMutex);
+	for (const Reader &reader : readers)
+		if (write(reader.fd[1], &c, 1) < 0 && errno != EAGAIN)
+			continue;
+}
+
+bool AstroberryThermometer::findSensors()
+{
+	DIR *dir;
+	struct dirent *dirent;
+	std::vector<std::string> ids;
+
+	rescan = false;
+
+	dir = opendir(devicesPath.c_str());
+	if (dir != NULL)
+	{
+		while ((dirent = readdir(dir)))
+		{
+			if (dirent->d_type == DT_LNK && strncmp(dirent->d_name, DS18B20_FAMILY, strlen(DS18B20_FAMILY)) == 0)
+				ids.push_back(dirent->d_name);
+		}
+		closedir(dir);
+	}
+
+	// stable order, so sensors keep their index across restarts
+	std::sort(ids.begin(), ids.end());
+	if (ids.size() > THERMOMETER_MAX_SENSORS)
+		ids.resize(THERMOMETER_MAX_SENSORS);
+
+	sensorPaths.clear();
+	bulkPaths.clear();
+	bulkRead = !ids.empty();
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		std::string path = devicesPath + "/" + ids[i];
+		sensorPaths.push_back(path);
+
+		// bulk conversion is triggered on the bus master the sensor hangs on
+		char master[PATH_MAX];
+		if (realpath((path + "/..").c_str(), master) == NULL)
+		{
+			bulkRead = false;
+			continue;
+		}
+		std::string bulkPath = std::string(master) + "/therm_bulk_read";
+		if (access(bulkPath.c_str(), W_OK) != 0)
+			bulkRead = false;
+		else if (std::find(bulkPaths.begin(), bulkPaths.end(), bulkPath) == bulkPaths.end())
+			bulkPaths.push_back(bulkPath);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (ids != sensorIds)
+	{
+		sensorIds = ids;
+		sensorsVersion++;
+	}
+	sensorCount = ids.size();
+
+	return !ids.empty();
+}
+
+bool AstroberryThermometer::bulkConvert()
+{
+	// start conversion on all sensors at once
+	for (size_t i = 0; i < bulkPaths.size(); i++)
+	{
+		if (!writeAttribute(bulkPaths[i], "trigger\n"))
+			return false;
+	}
+
+	const int conversionTime = getConversionTime();
+	if (!sleepFor(conversionTime))
+		return false;
+
+	// -1 while any sensor is still converting
+	for (int waited = conversionTime; waited < conversionTime + DS18B20_CONVERSION_MARGIN; waited += 10)
+	{
+		bool converting = false;
+		for (size_t i = 0; i < bulkPaths.size(); i++)
+		{
+			char buf[16];
+			if (!readAttribute(bulkPaths[i], buf, sizeof(buf)))
+				return false;
+			if (atoi(buf) == -1)
+				converting = true;
+		}
+		if (!converting)
+			return true;
+		if (!sleepFor(10))
+			return false;
+	}
+
+	return false;
+}
+
+bool AstroberryThermometer::readSensor(const std::string &path, float &value)
+{
+	char buf[256];
+
+	if (bulkRead)
+	{
+		// converted by the bulk trigger, reads the scratchpad only
+		if (!readAttribute(path + "/temperature", buf, sizeof(buf)))
+			return false;
+	} else {
+		// opening the device's file triggers new reading
+		if (!readAttribute(path + "/w1_slave", buf, sizeof(buf)))
+			return false;
+
+		// first line ends with the CRC check result, second one holds the temperature
+		const char *t = strstr(buf, "t=");
+		if (strstr(buf, "YES") == NULL || t == NULL)
+			return false;
+		memmove(buf, t + 2, strlen(t + 2) + 1);
+	}
+
+	value = strtol(buf, NULL, 10) / 1000.0;
+
+	// check if temperature is reasonable
+	return fabs(value) <= 100;
+}
+
+void AstroberryThermometer::waitEvents(int timeout)
+{
+	struct pollfd fds[2];
+	fds[0].fd = quitFd[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = inotifyFd;
+	fds[1].events = POLLIN;
+
+	if (poll(fds, inotifyFd >= 0 ? 2 : 1, timeout) <= 0)
+		return;
+
+	// woken up for new settings or to quit
+	if (fds[0].revents & POLLIN)
+	{
+		char buf[16];
+		while (read(quitFd[0], buf, sizeof(buf)) > 0);
+	}
+
+	if (fds[1].revents & POLLIN)
+	{
+		// any sensor added or removed
+		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t length = read(inotifyFd, buf, sizeof(buf));
+		for (char *p = buf; p < buf + length; )
+		{
+			const struct inotify_event *event = (const struct inotify_event *) p;
+			if (event->len > 0 && strncmp(event->name, DS18B20_FAMILY, strlen(DS18B20_FAMILY)) == 0)
+				rescan = true;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+bool AstroberryThermometer::sleepFor(int ms)
+{
+	struct timespec deadline, now;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	// settings changes wake us up too, keep sleeping until the deadline
+	while (!quit)
+	{
+		struct pollfd fds;
+		fds.fd = quitFd[0];
+		fds.events = POLLIN;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (remaining <= 0)
+			return true;
+
+		if (poll(&fds, 1, remaining) > 0)
+		{
+			char buf[16];
+			while (read(quitFd[0], buf, sizeof(buf)) > 0);
+		}
+	}
+
+	return false;
+}
+
+void AstroberryThermometer::applyResolution()
+{
+	char buf[16];
+	int bits = resolution;
+
+	snprintf(buf, sizeof(buf), "%d\n", bits);
+	for (size_t i = 0; i < sensorPaths.size(); i++)
+		writeAttribute(sensorPaths[i] + "/resolution", buf);
+
+	// read back, older kernels and some clones do not support it
+	if (sensorPaths.empty() || !readAttribute(sensorPaths[0] + "/resolution", buf, sizeof(buf)))
+		appliedResolution = 0;
+	else
+		appliedResolution = atoi(buf);
+}
+
+void AstroberryThermometer::run()
+{
+	while (true)
+	{
+		if (rescan)
+		{
+			findSensors();
+			appliedResolution = 0;
+		}
+
+		if (!sensorPaths.empty())
+		{
+			if (appliedResolution != resolution)
+				applyResolution();
+
+			// take all samples back to back
+			const int samples = oversampling;
+			float values[THERMOMETER_MAX_SENSORS][THERMOMETER_MAX_OVERSAMPLING];
+			int valid[THERMOMETER_MAX_SENSORS] = { 0 };
+			for (int n = 0; n < samples && !quit; n++)
+			{
+				// fall back to one conversion per sensor if bulk conversion fails
+				if (bulkRead && !bulkConvert())
+					bulkRead = false;
+				if (quit)
+					break;
+
+				for (size_t i = 0; i < sensorPaths.size(); i++)
+				{
+					if (readSensor(sensorPaths[i], values[i][valid[i]]))
+						valid[i]++;
+					else
+						rescan = true; // sensor gone or bad read
+				}
+			}
+			if (quit)
+				break;
+
+			// median of each sensor
+			float median[THERMOMETER_MAX_SENSORS];
+			bool any = false;
+			for (size_t i = 0; i < sensorPaths.size(); i++)
+			{
+				if (valid[i] == 0)
+				{
+					median[i] = NAN;
+					continue;
+				}
+				std::nth_element(values[i], values[i] + valid[i] / 2, values[i] + valid[i]);
+				median[i] = values[i][valid[i] / 2];
+				any = true;
+			}
+
+			if (any)
+				publish(median, sensorPaths.size());
+		} else {
+			rescan = true;
+		}
+
+		waitEvents(interval);
+		if (quit)
+			break;
+	}
+}
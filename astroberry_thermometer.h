@@ -0,0 +1,136 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#ifndef ASTROBERRYTHERMOMETER_H
+#define ASTROBERRYTHERMOMETER_H
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define THERMOMETER_MAX_SENSORS 4
+#define THERMOMETER_MAX_OVERSAMPLING 9
+#define THERMOMETER_W1_DEVICES "/sys/bus/w1/devices"
+
+/*
+ * DS18B20 sampling thread
+ *
+ * The 1-Wire conversion blocks for ~750 ms, so it runs in its own thread.
+ * Every DS18B20 on the bus is enumerated once and the list is cached; inotify
+ * on the w1 devices directory tells us when a sensor is plugged in or removed,
+ * and a failed read forces a rescan as well. Where the bus master supports
+ * therm_bulk_read, all sensors convert at once and are read afterwards, so N
+ * sensors cost a single conversion wait.
+ *
+ * Conversion time halves with every bit of resolution dropped, from 750 ms at
+ * 12 bit to 94 ms at 9 bit. With oversampling, several conversions are taken
+ * back to back and the median of each sensor is published.
+ *
+ * The latest readings are published through a seqlock, readers never block,
+ * and a byte is written to the notify pipe for each new set of readings.
+ *
+ * Focusers hosted by one driver share a single thread per bus: each channel
+ * subscribes for a notify pipe of its own, the bus is sampled at the shortest
+ * interval and with the most readings any channel asked for, and the sensor
+ * resolution is one setting for all of them.
+ */
+struct AstroberryTemperature
+{
+	int count;
+	float celsius[THERMOMETER_MAX_SENSORS]; // NAN if the sensor failed to read
+	int64_t timestamp; // CLOCK_MONOTONIC ns
+};
+
+class AstroberryThermometer
+{
+public:
+	AstroberryThermometer();
+	~AstroberryThermometer();
+	static AstroberryThermometer &shared(const std::string &path = THERMOMETER_W1_DEVICES); // one per bus, for every channel of the driver
+	int subscribe(int interval, int samples); // notify fd of a new reader, the first one starts the thread, -1 on failure
+	void unsubscribe(int fd); // the last reader stops the thread
+	void setSampling(int fd, int interval, int samples); // of one reader
+	void clearNotify(int fd);
+	bool isRunning() const { return worker.joinable(); }
+	bool start(int interval);
+	void stop();
+	void setDevicesPath(const std::string &path = THERMOMETER_W1_DEVICES) { devicesPath = path; } // before start
+	void setInterval(int interval);
+	void setResolution(int bits);
+	void setOversampling(int samples);
+	int getResolution() const { return appliedResolution.load(); } // 0 until set on the sensors
+	int getResolutionSetting() const { return resolution.load(); } // bits requested, shared by all readers
+	int getConversionTime() const; // ms
+	bool isAvailable() const { return sensorCount.load() > 0; }
+	int getSensorCount() const { return sensorCount.load(); }
+	uint32_t getSensorsVersion() const { return sensorsVersion.load(); }
+	std::vector<std::string> getSensorIds();
+	bool getTemperature(AstroberryTemperature &reading) const;
+	double getAge() const; // s since last reading
+	int getNotifyFd() const { return notifyFd[0]; }
+	void clearNotify();
+private:
+	void run();
+	bool findSensors();
+	bool bulkConvert();
+	bool readSensor(const std::string &path, float &celsius);
+	void publish(const float *values, int count);
+	void waitEvents(int timeout);
+	bool sleepFor(int ms);
+	void wake();
+	void applyResolution();
+	void applySampling();
+
+	struct Reader
+	{
+		int fd[2];
+		int interval;
+		int oversampling;
+	};
+	std::mutex readersMutex; // guards readers, the worker writes to their pipes
+	std::vector<Reader> readers;
+
+	std::thread worker;
+	std::mutex mutex; // guards sensor ids only, never held during 1-Wire I/O
+	std::string devicesPath;
+	std::vector<std::string> sensorIds;
+	std::vector<std::string> sensorPaths;
+	std::vector<std::string> bulkPaths; // therm_bulk_read of each bus master
+	bool bulkRead { false };
+	std::atomic<int> interval { 60000 }; // ms between readings
+	std::atomic<int> resolution { 12 }; // bits
+	std::atomic<int> oversampling { 1 };
+	std::atomic<int> appliedResolution { 0 };
+	int inotifyFd { -1 };
+	int quitFd[2] { -1, -1 };
+	int notifyFd[2] { -1, -1 };
+	bool rescan { true };
+	std::atomic<bool> quit { false };
+
+	std::atomic<int> sensorCount { 0 };
+	std::atomic<uint32_t> sensorsVersion { 0 };
+	std::atomic<uint32_t> sequence { 0 };
+	std::atomic<int> count { 0 };
+	std::atomic<float> celsius[THERMOMETER_MAX_SENSORS];
+	std::atomic<int64_t> timestamp { 0 };
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "astroberry_timing.h"
+
+#define TIMING_UNIT_SHIFT 7 // histogram resolution below 1 µs is 128 ns
+
+static int64_t timespecNs(const struct timespec &ts)
+{
+	return (int64_t) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void AstroberryStepTiming::begin(const struct timespec &command, bool keepSamples, size_t expected)
+{
+	this->command = timespecNs(command);
+	this->keepSamples = keepSamples;
+	memset(histogram, 0, sizeof(histogram));
+	count = missed = 0;
+	latency = maxLateness = 0;
+
+	// reserved up front, so the stepper thread only allocates if a retarget makes the move longer
+	samples.clear();
+	if (keepSamples)
+		samples.reserve(expected < TIMING_MAX_SAMPLES ? expected : TIMING_MAX_SAMPLES);
+}
+
+void AstroberryStepTiming::record(const struct timespec &deadline, uint64_t window)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	const int64_t intended = timespecNs(deadline) - command;
+	const int64_t actual = timespecNs(now) - command;
+	const int64_t lateness = actual > intended ? actual - intended : 0;
+
+	if (count == 0)
+		latency = actual;
+	count++;
+	histogram[bucket(lateness)]++;
+	if (lateness > maxLateness)
+		maxLateness = lateness;
+	if (window > 0 && (uint64_t) lateness >= window)
+		missed++;
+
+	if (keepSamples && samples.size() < TIMING_MAX_SAMPLES)
+		samples.push_back({ intended, actual });
+}
+
+int AstroberryStepTiming::bucket(int64_t lateness)
+{
+	// 8 linear buckets per power of two
+	uint64_t x = (uint64_t) lateness >> TIMING_UNIT_SHIFT;
+	if (x < 8)
+		return x;
+
+	int msb = 63 - __builtin_clzll(x);
+	int index = (msb - 2) * 8 + ((x >> (msb - 3)) & 7);
+	return index < TIMING_BUCKETS ? index : TIMING_BUCKETS - 1;
+}
+
+int64_t AstroberryStepTiming::bucketLimit(int index)
+{
+	// upper bound of a bucket
+	if (index < 8)
+		return (int64_t) (index + 1) << TIMING_UNIT_SHIFT;
+
+	int shift = index / 8 - 1;
+	return (int64_t) ((8 + index % 8 + 1) << shift) << TIMING_UNIT_SHIFT;
+}
+
+double AstroberryStepTiming::getPercentile(double p) const
+{
+	if (count == 0)
+		return 0;
+
+	// the bucket bound never overstates the worst edge seen
+	size_t rank = (size_t) ceil(p / 100 * count);
+	size_t seen = 0;
+	for (int i = 0; i < TIMING_BUCKETS; i++)
+	{
+		seen += histogram[i];
+		if (seen >= rank && seen > 0)
+			return (bucketLimit(i) < maxLateness ? bucketLimit(i) : maxLateness) / 1e3;
+	}
+
+	return maxLateness / 1e3;
+}
+
+bool AstroberryStepTiming::dump(const char *fileName) const
+{
+	FILE *pFile = fopen(fileName, "w");
+	if (pFile == NULL)
+		return false;
+
+	fprintf(pFile, "index,intended_ns,actual_ns,lateness_ns\n");
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		const AstroberryTimingSample &s = samples[i];
+		fprintf(pFile, "%zu,%lld,%lld,%lld\n", i, (long long) s.intended, (long long) s.actual, (long long) (s.actual - s.intended));
+	}
+
+	fclose(pFile);
+	return true;
+}
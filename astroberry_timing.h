@@ -0,0 +1,74 @@
+/*******************************************************************************
+  Copyright(c) 2014-2022 Radek Kaczorek  <rkaczorek AT gmail DOT com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#ifndef ASTROBERRYTIMING_H
+#define ASTROBERRYTIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+#define TIMING_BUCKETS 192 // log-linear lateness histogram, 8 buckets per octave from 128 ns
+#define TIMING_MAX_SAMPLES 1000000 // raw samples kept for a dump, 16 MB
+
+/*
+ * Step timing
+ *
+ * The stepper thread records every step line edge of a move: when it was due
+ * and when the line level was actually set. Lateness goes into a fixed-size
+ * histogram, so recording neither allocates nor grows with the move length.
+ * An edge is a missed deadline when it comes out so late that the next edge
+ * was already due, which shortens the pulse or the step interval below what
+ * the planner asked for. Raw samples are only kept when a dump is requested.
+ *
+ * All times are CLOCK_MONOTONIC. Results are only valid while not moving.
+ */
+struct AstroberryTimingSample
+{
+	int64_t intended;	// ns from the move command
+	int64_t actual;		// ns from the move command
+};
+
+class AstroberryStepTiming
+{
+public:
+	void begin(const struct timespec &command, bool keepSamples, size_t expected);
+	void record(const struct timespec &deadline, uint64_t window); // window is ns until the next edge, 0 if none
+	size_t getCount() const { return count; }
+	size_t getMissed() const { return missed; }
+	double getLatency() const { return count > 0 ? latency / 1e3 : 0; } // µs from command to first step edge
+	double getPercentile(double p) const; // µs of lateness
+	double getMax() const { return maxLateness / 1e3; } // µs
+	bool dump(const char *fileName) const;
+private:
+	static int bucket(int64_t lateness);
+	static int64_t bucketLimit(int index);
+
+	int64_t command { 0 };
+	uint32_t histogram[TIMING_BUCKETS] {};
+	size_t count { 0 };
+	size_t missed { 0 };
+	int64_t latency { 0 };
+	int64_t maxLateness { 0 };
+	bool keepSamples { false };
+	std::vector<AstroberryTimingSample> samples;
+};
+
+#endif
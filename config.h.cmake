@@ -8,4 +8,7 @@
 #define VERSION_MAJOR @VERSION_MAJOR@
 #define VERSION_MINOR @VERSION_MINOR@
 
+/* Define if libgpiod provides the v2 API */
+#cmakedefine HAVE_GPIOD_V2 1
+
 #endif // CONFIG_H